@@ -0,0 +1,417 @@
+#include "blake2b.h"
+#include "mmr.h"
+#include "mmr_arena.h"
+#include "mmr_blocked.h"
+#include "mmr_spec.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/* usage: bench_runner [-n leaves] [-o ops] [-s seed] [--json]
+ * every workload runs on the same mmr of n leaves, random leaves are picked
+ * by a seeded xorshift so runs are reproducible.
+ */
+
+#define DEFAULT_LEAVES 1000000
+#define DEFAULT_OPS 10000
+#define DEFAULT_SEED 0x9e3779b97f4a7c15ULL
+#define BATCH_LEAVES 1024
+#define PROOF_MAX_LEN 64
+
+static uint64_t merges = 0;
+
+void merge_hash(uint8_t dst[HASH_SIZE], uint8_t left_hash[HASH_SIZE],
+                uint8_t right_hash[HASH_SIZE]) {
+  blake2b_state blake2b_ctx;
+  blake2b_init(&blake2b_ctx, HASH_SIZE);
+  blake2b_update(&blake2b_ctx, left_hash, HASH_SIZE);
+  blake2b_update(&blake2b_ctx, right_hash, HASH_SIZE);
+  blake2b_final(&blake2b_ctx, dst, HASH_SIZE);
+  merges++;
+}
+
+static inline void merge_hash_inline(uint8_t *dst, uint8_t *left,
+                                     uint8_t *right) {
+  merge_hash(dst, left, right);
+}
+
+MMR_DEFINE(bench_spec, HASH_SIZE, merge_hash_inline)
+
+static uint64_t rng_state = DEFAULT_SEED;
+
+static uint64_t xorshift64(void) {
+  uint64_t x = rng_state;
+  x ^= x << 13;
+  x ^= x >> 7;
+  x ^= x << 17;
+  rng_state = x;
+  return x;
+}
+
+static uint64_t now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+static void leaf_hash(uint8_t dst[HASH_SIZE], uint64_t index) {
+  memset(dst, 0, HASH_SIZE);
+  memcpy(dst, &index, sizeof(uint64_t));
+}
+
+static int json_output = 0;
+static int reports = 0;
+
+static void report(const char *name, uint64_t ops, uint64_t elapsed_ns,
+                   uint64_t merge_count) {
+  double ns_per_op = ops ? (double)elapsed_ns / (double)ops : 0;
+  double merges_per_op = ops ? (double)merge_count / (double)ops : 0;
+  if (json_output) {
+    printf("%s\n    {\"name\": \"%s\", \"ops\": %llu, \"ns_per_op\": %.1f, "
+           "\"merges_per_op\": %.2f}",
+           reports ? "," : "", name, (unsigned long long)ops, ns_per_op,
+           merges_per_op);
+  } else {
+    printf("%-16s %12llu ops %12.1f ns/op %8.2f merges/op\n", name,
+           (unsigned long long)ops, ns_per_op, merges_per_op);
+  }
+  reports++;
+}
+
+/* push leaves one by one */
+static int bench_push(uint8_t (*tree_buf)[HASH_SIZE], uint64_t tree_buf_size,
+                      uint64_t leaves) {
+  MMRContext ctx;
+  if (mmr_initialize_context(&ctx, 0, tree_buf, tree_buf_size, merge_hash)) {
+    return -1;
+  }
+  uint8_t leaf[HASH_SIZE];
+  merges = 0;
+  uint64_t start = now_ns();
+  for (uint64_t i = 0; i < leaves; i++) {
+    leaf_hash(leaf, i);
+    if (mmr_push(&ctx, leaf) != 0) {
+      return -1;
+    }
+  }
+  report("push", leaves, now_ns() - start, merges);
+  return 0;
+}
+
+/* push leaves one by one into an arena which grows from empty */
+static int bench_push_arena(const char *name, uint64_t leaves, int flags) {
+  MMRArena arena;
+  MMRContext ctx;
+  if (mmr_arena_init(&arena, MMR_ARENA_DEFAULT_SEGMENT_SHIFT, flags, NULL) ||
+      mmr_arena_initialize_context(&ctx, &arena, 0, merge_hash)) {
+    return -1;
+  }
+  uint8_t leaf[HASH_SIZE];
+  merges = 0;
+  uint64_t start = now_ns();
+  for (uint64_t i = 0; i < leaves; i++) {
+    leaf_hash(leaf, i);
+    if (mmr_push(&ctx, leaf) != 0) {
+      mmr_arena_free(&arena);
+      return -1;
+    }
+  }
+  report(name, leaves, now_ns() - start, merges);
+  mmr_arena_free(&arena);
+  return 0;
+}
+
+/* push leaves one by one with the MMR_DEFINE variant */
+static int bench_push_spec(uint8_t (*tree_buf)[HASH_SIZE],
+                           uint64_t tree_buf_size, uint64_t leaves) {
+  bench_spec_ctx ctx;
+  if (bench_spec_initialize_context(&ctx, 0, tree_buf, tree_buf_size)) {
+    return -1;
+  }
+  uint8_t leaf[HASH_SIZE];
+  merges = 0;
+  uint64_t start = now_ns();
+  for (uint64_t i = 0; i < leaves; i++) {
+    leaf_hash(leaf, i);
+    if (bench_spec_push(&ctx, leaf) != 0) {
+      return -1;
+    }
+  }
+  report("push_spec", leaves, now_ns() - start, merges);
+  return 0;
+}
+
+/* push leaves in batches of BATCH_LEAVES */
+static int bench_push_batch(uint8_t (*tree_buf)[HASH_SIZE],
+                            uint64_t tree_buf_size, uint64_t leaves) {
+  MMRContext ctx;
+  if (mmr_initialize_context(&ctx, 0, tree_buf, tree_buf_size, merge_hash)) {
+    return -1;
+  }
+  static uint8_t batch[BATCH_LEAVES][HASH_SIZE];
+  merges = 0;
+  uint64_t start = now_ns();
+  for (uint64_t i = 0; i < leaves; i += BATCH_LEAVES) {
+    size_t n = leaves - i < BATCH_LEAVES ? leaves - i : BATCH_LEAVES;
+    for (size_t j = 0; j < n; j++) {
+      leaf_hash(batch[j], i + j);
+    }
+    if (mmr_push_batch(&ctx, batch, n) != 0) {
+      return -1;
+    }
+  }
+  report("push_batch", leaves, now_ns() - start, merges);
+  return 0;
+}
+
+/* bag all peaks, the peaks cache is dropped before each call */
+static int bench_root(MMRContext *ctx, uint64_t ops) {
+  uint8_t root[HASH_SIZE];
+  merges = 0;
+  uint64_t start = now_ns();
+  for (uint64_t i = 0; i < ops; i++) {
+    ctx->peaks_cache_size = 0;
+    if (mmr_get_root(ctx, root) != 0) {
+      return -1;
+    }
+  }
+  report("root", ops, now_ns() - start, merges);
+  return 0;
+}
+
+/* gen proofs of random leaves */
+static int bench_gen_proof(const char *name, MMRContext *ctx, uint64_t leaves,
+                           uint64_t ops) {
+  uint8_t proof[PROOF_MAX_LEN][HASH_SIZE];
+  merges = 0;
+  uint64_t start = now_ns();
+  for (uint64_t i = 0; i < ops; i++) {
+    size_t proof_len = PROOF_MAX_LEN;
+    uint64_t pos = mmr_leaf_index_to_pos(xorshift64() % leaves);
+    if (mmr_gen_proof(ctx, proof, &proof_len, pos) != 0) {
+      return -1;
+    }
+  }
+  report(name, ops, now_ns() - start, merges);
+  return 0;
+}
+
+/* gen proofs of random leaves from the subtree blocked layout */
+static int bench_gen_proof_blocked(uint8_t (*tree_buf)[HASH_SIZE],
+                                   uint64_t mmr_size, uint64_t leaves,
+                                   uint64_t ops) {
+  uint64_t buf_size = mmr_blocked_buf_size(leaves);
+  void *buf = aligned_alloc(MMR_BLOCK_SIZE, buf_size);
+  if (!buf) {
+    return -1;
+  }
+  MMRBlocked blocked;
+  MMRContext ctx;
+  int ret = mmr_blocked_init(&blocked, buf, buf_size, leaves);
+  ret = ret || mmr_blocked_load(&blocked, tree_buf, mmr_size);
+  ret = ret || mmr_blocked_initialize_context(&ctx, &blocked, mmr_size,
+                                              merge_hash);
+  ret = ret || bench_gen_proof("gen_blocked", &ctx, leaves, ops);
+  free(buf);
+  return ret;
+}
+
+/* verify proofs of random leaves, proofs are generated before timing */
+static int bench_verify(MMRContext *ctx, uint64_t leaves, uint64_t ops) {
+  uint8_t root[HASH_SIZE];
+  if (mmr_get_root(ctx, root) != 0) {
+    return -1;
+  }
+  MMRVerifyContext verify_ctx;
+  mmr_initialize_verify_context(&verify_ctx, merge_hash);
+  uint8_t(*proofs)[PROOF_MAX_LEN][HASH_SIZE] = malloc(ops * sizeof(*proofs));
+  size_t *proof_lens = malloc(ops * sizeof(size_t));
+  uint64_t *indexes = malloc(ops * sizeof(uint64_t));
+  if (!proofs || !proof_lens || !indexes) {
+    return -1;
+  }
+  for (uint64_t i = 0; i < ops; i++) {
+    indexes[i] = xorshift64() % leaves;
+    proof_lens[i] = PROOF_MAX_LEN;
+    if (mmr_gen_proof(ctx, proofs[i], &proof_lens[i],
+                      mmr_leaf_index_to_pos(indexes[i])) != 0) {
+      return -1;
+    }
+  }
+  uint8_t leaf[HASH_SIZE], proof_root[HASH_SIZE];
+  uint64_t failed = 0;
+  merges = 0;
+  uint64_t start = now_ns();
+  for (uint64_t i = 0; i < ops; i++) {
+    leaf_hash(leaf, indexes[i]);
+    mmr_compute_proof_root(&verify_ctx, proof_root, ctx->mmr_size, leaf,
+                           mmr_leaf_index_to_pos(indexes[i]), proofs[i],
+                           proof_lens[i]);
+    failed += memcmp(proof_root, root, HASH_SIZE) != 0;
+  }
+  report("verify", ops, now_ns() - start, merges);
+  /* the same proofs at once */
+  MMRVerifyItem *items = malloc(ops * sizeof(MMRVerifyItem));
+  uint8_t(*item_leaves)[HASH_SIZE] = malloc(ops * HASH_SIZE);
+  uint8_t *results = malloc((ops + 7) / 8);
+  if (!items || !item_leaves || !results) {
+    return -1;
+  }
+  for (uint64_t i = 0; i < ops; i++) {
+    leaf_hash(item_leaves[i], indexes[i]);
+    items[i] = (MMRVerifyItem){item_leaves[i],
+                               mmr_leaf_index_to_pos(indexes[i]), proofs[i],
+                               proof_lens[i]};
+  }
+  merges = 0;
+  start = now_ns();
+  if (mmr_verify_many(&verify_ctx, root, ctx->mmr_size, items, ops,
+                      results) != 0) {
+    failed++;
+  }
+  report("verify_many", ops, now_ns() - start, merges);
+  free(items);
+  free(item_leaves);
+  free(results);
+  free(proofs);
+  free(proof_lens);
+  free(indexes);
+  return failed ? -1 : 0;
+}
+
+/* compute the root of k + 1 leaves from the proof of leaf k - 1,
+ * k is random and proofs are generated before timing */
+static int bench_new_root(MMRContext *ctx, uint64_t leaves, uint64_t ops) {
+  MMRVerifyContext verify_ctx;
+  mmr_initialize_verify_context(&verify_ctx, merge_hash);
+  uint8_t(*proofs)[PROOF_MAX_LEN][HASH_SIZE] = malloc(ops * sizeof(*proofs));
+  size_t *proof_lens = malloc(ops * sizeof(size_t));
+  uint64_t *counts = malloc(ops * sizeof(uint64_t));
+  if (!proofs || !proof_lens || !counts) {
+    return -1;
+  }
+  MMRContext prefix_ctx = *ctx;
+  for (uint64_t i = 0; i < ops; i++) {
+    counts[i] = 1 + xorshift64() % (leaves - 1);
+    prefix_ctx.mmr_size = mmr_compute_pos_by_leaf_index(counts[i] - 1).mmr_size;
+    proof_lens[i] = PROOF_MAX_LEN;
+    if (mmr_gen_proof(&prefix_ctx, proofs[i], &proof_lens[i],
+                      mmr_leaf_index_to_pos(counts[i] - 1)) != 0) {
+      return -1;
+    }
+  }
+  uint8_t leaf[HASH_SIZE], new_leaf[HASH_SIZE], new_root[HASH_SIZE];
+  merges = 0;
+  uint64_t start = now_ns();
+  for (uint64_t i = 0; i < ops; i++) {
+    MMRSizePos last = mmr_compute_pos_by_leaf_index(counts[i] - 1);
+    MMRSizePos next = mmr_compute_pos_by_leaf_index(counts[i]);
+    leaf_hash(leaf, counts[i] - 1);
+    leaf_hash(new_leaf, counts[i]);
+    mmr_compute_new_root_from_last_leaf_proof(
+        &verify_ctx, new_root, last.mmr_size, leaf, last.pos, proofs[i],
+        proof_lens[i], new_leaf, next);
+  }
+  report("new_root", ops, now_ns() - start, merges);
+  free(proofs);
+  free(proof_lens);
+  free(counts);
+  return 0;
+}
+
+/* chain new roots and proofs leaf by leaf from the first half of the mmr,
+ * only the first proof is generated */
+static int bench_chain_root(MMRContext *ctx, uint64_t leaves, uint64_t ops) {
+  MMRVerifyContext verify_ctx;
+  mmr_initialize_verify_context(&verify_ctx, merge_hash);
+  uint64_t count = leaves / 2;
+  if (ops > leaves - count) {
+    ops = leaves - count;
+  }
+  MMRContext prefix_ctx = *ctx;
+  prefix_ctx.mmr_size = mmr_leaf_count_to_size(count);
+  uint8_t proof[PROOF_MAX_LEN][HASH_SIZE];
+  size_t proof_len = PROOF_MAX_LEN;
+  if (mmr_gen_proof_by_leaf_index(&prefix_ctx, proof, &proof_len,
+                                  count - 1) != 0) {
+    return -1;
+  }
+  uint64_t mmr_size = prefix_ctx.mmr_size;
+  uint8_t leaf[HASH_SIZE], new_leaf[HASH_SIZE], new_root[HASH_SIZE];
+  leaf_hash(leaf, count - 1);
+  merges = 0;
+  uint64_t start = now_ns();
+  for (uint64_t i = 0; i < ops; i++) {
+    leaf_hash(new_leaf, count + i);
+    if (mmr_compute_new_root_and_proof(&verify_ctx, new_root, &mmr_size, leaf,
+                                       proof, &proof_len, PROOF_MAX_LEN,
+                                       new_leaf) != 0) {
+      return -1;
+    }
+    memcpy(leaf, new_leaf, HASH_SIZE);
+  }
+  report("chain_root", ops, now_ns() - start, merges);
+  return 0;
+}
+
+int main(int argc, char *argv[]) {
+  uint64_t leaves = DEFAULT_LEAVES;
+  uint64_t ops = DEFAULT_OPS;
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--json") == 0) {
+      json_output = 1;
+    } else if (strcmp(argv[i], "-n") == 0 && i + 1 < argc) {
+      leaves = strtoull(argv[++i], NULL, 0);
+    } else if (strcmp(argv[i], "-o") == 0 && i + 1 < argc) {
+      ops = strtoull(argv[++i], NULL, 0);
+    } else if (strcmp(argv[i], "-s") == 0 && i + 1 < argc) {
+      rng_state = strtoull(argv[++i], NULL, 0);
+    } else {
+      fprintf(stderr, "usage: %s [-n leaves] [-o ops] [-s seed] [--json]\n",
+              argv[0]);
+      return 1;
+    }
+  }
+  if (leaves < 2 || ops == 0 || rng_state == 0) {
+    fprintf(stderr, "leaves must be at least 2, ops and seed non zero\n");
+    return 1;
+  }
+  uint64_t tree_buf_size = 2 * leaves;
+  uint8_t(*tree_buf)[HASH_SIZE] = malloc(tree_buf_size * HASH_SIZE);
+  if (!tree_buf) {
+    fprintf(stderr, "failed to allocate %llu nodes\n",
+            (unsigned long long)tree_buf_size);
+    return 1;
+  }
+  if (json_output) {
+    printf("{\n  \"leaves\": %llu,\n  \"results\": [",
+           (unsigned long long)leaves);
+  }
+  MMRContext ctx;
+  int ret = bench_push_batch(tree_buf, tree_buf_size, leaves);
+  /* the push workload leaves the tree used by the read workloads */
+  ret = ret || bench_push_spec(tree_buf, tree_buf_size, leaves);
+  ret = ret || bench_push(tree_buf, tree_buf_size, leaves);
+  ret = ret || bench_push_arena("push_arena", leaves, 0);
+  ret = ret ||
+        bench_push_arena("push_arena_huge", leaves, MMR_ARENA_HUGE_PAGES);
+  uint64_t mmr_size = mmr_compute_pos_by_leaf_index(leaves - 1).mmr_size;
+  ret = ret || mmr_initialize_context(&ctx, mmr_size, tree_buf, tree_buf_size,
+                                      merge_hash);
+  ret = ret || bench_root(&ctx, ops);
+  ret = ret || bench_gen_proof("gen_proof", &ctx, leaves, ops);
+  ret = ret || bench_gen_proof_blocked(tree_buf, mmr_size, leaves, ops);
+  ret = ret || bench_verify(&ctx, leaves, ops);
+  ret = ret || bench_new_root(&ctx, leaves, ops);
+  ret = ret || bench_chain_root(&ctx, leaves, ops);
+  if (json_output) {
+    printf("\n  ]\n}\n");
+  }
+  free(tree_buf);
+  if (ret) {
+    fprintf(stderr, "benchmark failed\n");
+    return 1;
+  }
+  return 0;
+}
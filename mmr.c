@@ -7,10 +7,46 @@
  */
 
 #include "mmr.h"
+#include "mmr_spec.h"
 #include "assert.h"
 #include "stddef.h"
+#include "stdlib.h"
 #include "string.h"
 
+/* stats and tracing, see MMR_ENABLE_STATS in mmr.h */
+#ifdef MMR_ENABLE_STATS
+#define STATS_ADD(ctx, field, n) ((ctx)->stats.field += (n))
+#define TRACE_BEGIN(ctx, op)                                                   \
+  do {                                                                         \
+    if ((ctx)->hooks.begin != NULL) {                                          \
+      (ctx)->hooks.begin((ctx)->hooks.data, (op));                             \
+    }                                                                          \
+  } while (0)
+#define TRACE_END(ctx, op, ret)                                                \
+  do {                                                                         \
+    if ((ctx)->hooks.end != NULL) {                                            \
+      (ctx)->hooks.end((ctx)->hooks.data, (op), (ret));                        \
+    }                                                                          \
+  } while (0)
+#define INIT_STATS(ctx)                                                        \
+  do {                                                                         \
+    memset(&(ctx)->stats, 0, sizeof((ctx)->stats));                            \
+    memset(&(ctx)->hooks, 0, sizeof((ctx)->hooks));                            \
+  } while (0)
+#else
+#define STATS_ADD(ctx, field, n) ((void)0)
+#define TRACE_BEGIN(ctx, op) ((void)0)
+#define TRACE_END(ctx, op, ret) ((void)0)
+#define INIT_STATS(ctx) ((void)0)
+#endif
+
+/* merge with the merge functions of a context */
+#define MERGE(ctx, dst, left, right)                                           \
+  (STATS_ADD(ctx, merges, 1), (ctx)->merge((dst), (left), (right)))
+#define MERGE_NODES(ctx, dst, left, right, n)                                  \
+  (STATS_ADD(ctx, merges, (n)),                                                \
+   merge_nodes((ctx)->merge, (ctx)->merge_many, (dst), (left), (right), (n)))
+
 /* helper functions */
 
 /* calculate offset of parent position by height */
@@ -19,235 +55,608 @@ static uint64_t parent_offset(uint32_t height) { return 2 << height; }
 /* calculate offset of sibling position by height */
 static uint64_t sibling_offset(uint32_t height) { return (2 << height) - 1; }
 
-/* get right peak from a peak,
- * return height 0 pos 0 if can't find a right peak
+/* position math
+ * the helpers shared with mmr_blocked.c and MMR_DEFINE are in mmr_spec.h,
+ * they are built on clz/popcount/ctz which compile to single instructions on
+ * GCC and clang, other compilers use the portable fallbacks.
  */
-static MMRHeightPos get_right_peak(MMRHeightPos peak_pos, uint64_t mmr_size) {
-  uint64_t pos = peak_pos.pos;
-  uint32_t height = peak_pos.height;
-  // move to right sibling pos
-  pos += sibling_offset(height);
-  // loop until we find a pos in mmr
-  while (pos > mmr_size - 1) {
-    if (height == 0) {
-      MMRHeightPos ret = {0, 0};
-      return ret;
-    }
-    // move to left child
-    pos -= parent_offset(height - 1);
-    height -= 1;
-  }
-  MMRHeightPos peak = {height, pos};
-  return peak;
+
+static uint64_t simple_log2(uint64_t n) {
+  return n == 0 ? 0 : mmr_spec_bit_length(n) - 1;
 }
 
-static uint64_t left_peak_pos_by_height(uint32_t height) {
-  return (1 << (height + 1)) - 2;
+static uint32_t pos_height_in_tree(uint64_t pos) {
+  uint64_t leaf_index;
+  return mmr_spec_pos_height_and_leaf(pos, &leaf_index);
 }
 
-static MMRHeightPos left_peak_height_pos(uint64_t mmr_size) {
-  uint32_t height = 1;
-  uint64_t prev_pos = 0;
-  uint64_t pos = left_peak_pos_by_height(height);
-  while (pos < mmr_size) {
-    height += 1;
-    prev_pos = pos;
-    pos = left_peak_pos_by_height(height);
-  }
-  MMRHeightPos p = {height - 1, prev_pos};
-  return p;
+/* calculate position of a node from its height and index in that height */
+static uint64_t node_pos(uint32_t height, uint64_t index) {
+  /* a node is pushed right after the last leaf of its subtree */
+  uint64_t last_leaf = ((index + 1) << height) - 1;
+  return mmr_spec_leaf_index_to_pos(last_leaf) + height;
 }
 
-/* peaks_buf should at least equals to left_peak.height, to make sure we have
- * enough buf to store peaks.
+/* calculate leaf count from mmr_size,
+ * mmr_size is the position of the next node. if it's not a leaf, it's a
+ * parent of the last leaf whose push is not complete, the leaf is counted.
  */
-static MMRPeaks get_peaks(uint64_t peaks_buf[HASH_SIZE], MMRHeightPos left_peak,
-                          uint64_t mmr_size) {
-  /* After a little thought we can figure out the number of peaks will never
-   * greater than MMR height
-   * https://github.com/nervosnetwork/merkle-mountain-range#construct
-   */
-  size_t i = 0;
-  peaks_buf[i++] = left_peak.pos;
-  while (left_peak.height > 0) {
-    MMRHeightPos right_peak = get_right_peak(left_peak, mmr_size);
-    /* no more right peak */
-    if (right_peak.height == 0 && right_peak.pos == 0) {
-      break;
-    }
-    left_peak = right_peak;
-    peaks_buf[i++] = left_peak.pos;
-  }
-  struct MMRPeaks peaks = {peaks_buf, i};
-  return peaks;
+static uint64_t leaf_count_from_mmr_size(uint64_t mmr_size) {
+  uint64_t leaf_index;
+  uint32_t height = mmr_spec_pos_height_and_leaf(mmr_size, &leaf_index);
+  return height == 0 ? leaf_index : leaf_index + 1;
 }
 
-/* binary search, arr must be a sorted array
- * return -1 if binary search failed, otherwise return index
+/* calculate height of the peak which contains the leaf,
+ * the peaks follow the bits of leaf_count from the highest, so the leaf is in
+ * the peak of the highest bit that leaf_index differs from leaf_count.
  */
-static int binary_search(uint64_t *arr, size_t len, uint64_t target) {
-  if (len == 0) {
-    return -1;
+static uint32_t leaf_peak_height(uint64_t leaf_index, uint64_t leaf_count) {
+  if (leaf_index >= leaf_count) {
+    return 0;
   }
-  int b = 0;
-  int e = len;
-  while (b + 1 != e) {
-    int i = (b + e) / 2;
-    if (arr[i] < target) {
-      b = i;
-    } else if (arr[i] > target) {
-      e = i;
-    } else {
-      return i;
+  return mmr_spec_bit_length(leaf_index ^ leaf_count) - 1;
+}
+
+/* merge n independent nodes,
+ * pass them to merge_many in chunks or fallback to merge one by one
+ */
+static void merge_nodes(void (*merge)(uint8_t *, uint8_t *, uint8_t *),
+                        void (*merge_many)(uint8_t *[], uint8_t *[],
+                                           uint8_t *[], size_t),
+                        uint8_t *dst[], uint8_t *left[], uint8_t *right[],
+                        size_t n) {
+  if (merge_many == NULL) {
+    for (size_t i = 0; i < n; i++) {
+      merge(dst[i], left[i], right[i]);
     }
+    return;
   }
-  if (arr[b] == target) {
-    return b;
-  } else if (e < len && arr[e] == target) {
-    return e;
+  for (size_t i = 0; i < n; i += MMR_MERGE_MANY_MAX) {
+    size_t lanes = n - i;
+    if (lanes > MMR_MERGE_MANY_MAX) {
+      lanes = MMR_MERGE_MANY_MAX;
+    }
+    merge_many(&dst[i], &left[i], &right[i], lanes);
   }
-  return -1;
 }
 
-/* return number of zeros */
-static size_t count_zeros(uint64_t n, int only_count_leading) {
-  size_t num_zeros = 0;
+static void store_le64(uint8_t *p, uint64_t v) {
+  for (int i = 0; i < 8; i++) {
+    p[i] = (uint8_t)(v >> (8 * i));
+  }
+}
 
-  for (int i = 63; i >= 0; --i) {
-    if ((n & ((uint64_t)1 << (uint64_t)i)) == 0) {
-      ++num_zeros;
-    } else if (only_count_leading) {
-      break;
-    }
+static uint64_t load_le64(const uint8_t *p) {
+  uint64_t v = 0;
+  for (int i = 7; i >= 0; i--) {
+    v = (v << 8) | p[i];
   }
-  return num_zeros;
+  return v;
 }
 
-static int is_all_one_bits(uint64_t n) {
-  return n != 0 && count_zeros(n, 0) == count_zeros(n, 1);
+/* nodes under mmr_size are written before mmr_size is advanced, so readers
+ * load it with acquire and see complete nodes */
+static void publish_mmr_size(MMRContext *ctx, uint64_t mmr_size) {
+  __atomic_store_n(&ctx->mmr_size, mmr_size, __ATOMIC_RELEASE);
 }
 
-static uint64_t jump_left(uint64_t pos) {
-  size_t bit_length = 64 - count_zeros(pos, 1);
-  size_t most_significant_bits = 1 << (bit_length - 1);
-  return pos - (most_significant_bits - 1);
+/* node access
+ * contexts without a store read and write tree_buf directly, so the default
+ * backend never goes through a function pointer.
+ */
+
+/* return the top levels cache entry of pos,
+ * NULL if there is no cache or pos is not in the top levels of a mountain
+ */
+static MMRCacheEntry *top_cache_entry(MMRContext *ctx, uint64_t pos) {
+  if (ctx->top_cache == NULL) {
+    return NULL;
+  }
+  uint64_t leaf_index;
+  uint32_t height = mmr_spec_pos_height_and_leaf(pos, &leaf_index);
+  uint64_t leaf_count = leaf_count_from_mmr_size(ctx->mmr_size);
+  if (leaf_index >= leaf_count) {
+    return NULL;
+  }
+  uint32_t peak_height = leaf_peak_height(leaf_index, leaf_count);
+  uint32_t depth = peak_height - height;
+  if (depth == 0 || depth > ctx->top_cache_levels) {
+    return NULL;
+  }
+  /* the mountain is aligned to its leaves, so the low bits of the node index
+   * are its index in the level */
+  uint64_t level_index = (leaf_index >> height) & (((uint64_t)1 << depth) - 1);
+  uint64_t mountain_entries = ((uint64_t)2 << ctx->top_cache_levels) - 2;
+  uint64_t level_start = ((uint64_t)1 << depth) - 2;
+  return &ctx->top_cache[peak_height * mountain_entries + level_start +
+                         level_index];
 }
 
-static uint32_t pos_height_in_tree(uint64_t pos) {
-  pos += 1;
+static int read_store_nodes(MMRContext *ctx, const uint64_t *pos, size_t n,
+                            uint8_t dst[][HASH_SIZE]) {
+  if (n == 0) {
+    return 0;
+  }
+  if (ctx->store->batch_get != NULL) {
+    return ctx->store->batch_get(ctx->store->data, pos, n, dst);
+  }
+  for (size_t i = 0; i < n; i++) {
+    int ret = ctx->store->get(ctx->store->data, pos[i], dst[i]);
+    if (ret != 0) {
+      return ret;
+    }
+  }
+  return 0;
+}
 
-  while (!is_all_one_bits(pos)) {
-    pos = jump_left(pos);
+/* read nodes through the top levels cache,
+ * the nodes missed are read from the store together into the front of the
+ * chunk of dst, then moved to their slots and cached
+ */
+static int read_cached_nodes(MMRContext *ctx, const uint64_t *pos, size_t n,
+                             uint8_t dst[][HASH_SIZE]) {
+  uint64_t miss_pos[MMR_MAX_PEAKS];
+  size_t miss_index[MMR_MAX_PEAKS];
+  MMRCacheEntry *entries[MMR_MAX_PEAKS];
+  for (size_t start = 0; start < n; start += MMR_MAX_PEAKS) {
+    size_t end = n - start < MMR_MAX_PEAKS ? n : start + MMR_MAX_PEAKS;
+    size_t misses = 0;
+    for (size_t i = start; i < end; i++) {
+      MMRCacheEntry *entry = top_cache_entry(ctx, pos[i]);
+      entries[i - start] = entry;
+      if (entry == NULL || entry->pos != pos[i]) {
+        miss_pos[misses] = pos[i];
+        miss_index[misses] = i;
+        misses++;
+      }
+    }
+    STATS_ADD(ctx, cache_hits, end - start - misses);
+    STATS_ADD(ctx, node_reads, misses);
+    if (read_store_nodes(ctx, miss_pos, misses, dst + start) != 0) {
+      return -1;
+    }
+    /* miss_index[k] >= start + k, move from the back to not overwrite the
+     * nodes not moved yet */
+    for (size_t k = misses; k-- > 0;) {
+      if (miss_index[k] != start + k) {
+        memcpy(dst[miss_index[k]], dst[start + k], HASH_SIZE);
+      }
+    }
+    /* copy the hits before the misses replace their entries */
+    size_t k = 0;
+    for (size_t i = start; i < end; i++) {
+      if (k < misses && miss_index[k] == i) {
+        k++;
+        continue;
+      }
+      memcpy(dst[i], entries[i - start]->hash, HASH_SIZE);
+    }
+    for (k = 0; k < misses; k++) {
+      MMRCacheEntry *entry = entries[miss_index[k] - start];
+      if (entry != NULL) {
+        entry->pos = miss_pos[k];
+        memcpy(entry->hash, dst[miss_index[k]], HASH_SIZE);
+      }
+    }
   }
+  return 0;
+}
 
-  return 64 - count_zeros(pos, 1) - 1;
+static int read_nodes(MMRContext *ctx, const uint64_t *pos, size_t n,
+                      uint8_t dst[][HASH_SIZE]) {
+  if (ctx->store == NULL) {
+    STATS_ADD(ctx, node_reads, n);
+    for (size_t i = 0; i < n; i++) {
+      memcpy(dst[i], ctx->tree_buf[pos[i]], HASH_SIZE);
+    }
+    return 0;
+  }
+  if (ctx->top_cache != NULL) {
+    return read_cached_nodes(ctx, pos, n, dst);
+  }
+  STATS_ADD(ctx, node_reads, n);
+  return read_store_nodes(ctx, pos, n, dst);
 }
 
-static uint64_t simple_log2(uint64_t n) {
-  unsigned int res = 0;
-  while (n >>= 1)
-    res++;
-  return res;
+static int read_node(MMRContext *ctx, uint64_t pos, uint8_t dst[HASH_SIZE]) {
+  if (ctx->store == NULL) {
+    STATS_ADD(ctx, node_reads, 1);
+    memcpy(dst, ctx->tree_buf[pos], HASH_SIZE);
+    return 0;
+  }
+  if (ctx->top_cache != NULL) {
+    return read_cached_nodes(ctx, &pos, 1, (uint8_t(*)[HASH_SIZE])dst);
+  }
+  STATS_ADD(ctx, node_reads, 1);
+  return ctx->store->get(ctx->store->data, pos, dst);
 }
 
-static int bag_rhs_peaks(MMRContext *ctx, uint8_t dst[HASH_SIZE],
-                         uint64_t skip_pos, MMRPeaks *peaks) {
-  uint8_t peaks_elems[peaks->len][HASH_SIZE];
-  size_t len = 0;
-  for (int i = 0; i < peaks->len; i++) {
-    uint64_t pos = peaks->peaks[i];
-    if (pos > skip_pos) {
-      memcpy(peaks_elems[len++], ctx->tree_buf[pos], HASH_SIZE);
+/* collect the sibling positions from pos to its peak in mmr_size,
+ * return -1 if there are more than max_len siblings
+ * pos: the position of a node, set to the position of its peak
+ * sib_pos: a buf of MMR_MAX_PEAKS to receive the siblings from the lowest
+ * len: set to the number of siblings
+ */
+static int proof_path(uint64_t mmr_size, uint64_t *pos, uint64_t sib_pos[],
+                      size_t max_len, size_t *len) {
+  uint64_t leaf_index;
+  uint32_t height = mmr_spec_pos_height_and_leaf(*pos, &leaf_index);
+  size_t proof_len = 0;
+  while (*pos < mmr_size) {
+    uint64_t sib, next_pos;
+    if ((leaf_index >> height) & 1) {
+      // we are on right branch
+      sib = *pos - sibling_offset(height);
+      next_pos = *pos + 1;
+    } else {
+      sib = *pos + sibling_offset(height);
+      next_pos = *pos + parent_offset(height);
+    }
+
+    if (sib > mmr_size - 1) {
+      break;
     }
+    if (proof_len >= max_len) {
+      return -1;
+    }
+    sib_pos[proof_len++] = sib;
+    *pos = next_pos;
+    height++;
   }
+  *len = proof_len;
+  return 0;
+}
 
-  /* no peaks to bag */
-  if (len < 1) {
+/* bring the peaks cache of ctx to mmr_size,
+ * peaks kept by the last update are not read again, then the suffix bags are
+ * merged from the rightmost peak.
+ * return -1 if failed to read a peak
+ */
+static int update_peaks_cache(MMRContext *ctx, MMRPeaks *peaks) {
+  peaks->len = mmr_peaks_from_size(ctx->mmr_size, peaks->peaks);
+  if (ctx->peaks_cache_size == ctx->mmr_size) {
+    return 0;
+  }
+  /* the peaks on the left are the same if their positions are the same */
+  uint64_t cached_buf[MMR_MAX_PEAKS];
+  size_t cached_len = mmr_peaks_from_size(ctx->peaks_cache_size, cached_buf);
+  size_t keep = 0;
+  while (keep < cached_len && keep < peaks->len &&
+         cached_buf[keep] == peaks->peaks[keep]) {
+    keep++;
+  }
+  ctx->peaks_cache_size = 0;
+  if (read_nodes(ctx, &peaks->peaks[keep], peaks->len - keep,
+                 &ctx->peak_hashes[keep]) != 0) {
     return -1;
   }
-
-  while (len > 1) {
-    uint8_t *right = peaks_elems[--len];
-    uint8_t *left = peaks_elems[--len];
-    ctx->merge(peaks_elems[len++], right, left);
+  STATS_ADD(ctx, peaks_bagged, peaks->len);
+  size_t i = peaks->len;
+  if (i > 0) {
+    i--;
+    memcpy(ctx->peak_bags[i], ctx->peak_hashes[i], HASH_SIZE);
   }
-  memcpy(dst, peaks_elems[0], HASH_SIZE);
+  while (i > 0) {
+    i--;
+    MERGE(ctx, ctx->peak_bags[i], ctx->peak_bags[i + 1], ctx->peak_hashes[i]);
+  }
+  ctx->peaks_cache_size = ctx->mmr_size;
   return 0;
 }
 
 static size_t compute_peak_root(MMRVerifyContext *ctx,
-                                uint8_t peak_hash[HASH_SIZE], MMRPeaks peaks,
+                                uint8_t peak_hash[HASH_SIZE], uint64_t mmr_size,
                                 uint64_t *pos, uint8_t proof[][HASH_SIZE],
                                 size_t proof_len) {
   size_t i = 0;
-  uint32_t height = 0;
+  uint64_t leaf_index;
+  uint32_t height = mmr_spec_pos_height_and_leaf(*pos, &leaf_index);
+  uint32_t peak_height =
+      leaf_peak_height(leaf_index, leaf_count_from_mmr_size(mmr_size));
   // calculate peak's merkle root
-  // return if pos reach a peak pos
-  while (1) {
-    int idx = binary_search(peaks.peaks, peaks.len, *pos);
-    /* end loop if reach a peak or consume all the proof items */
-    if (idx >= 0 || i >= proof_len) {
-      break;
-    }
+  // end loop if reach the peak or consume all the proof items
+  while (height < peak_height && i < proof_len) {
     uint8_t *pitem = proof[i++];
     // verify merkle path
-    uint32_t pos_height = pos_height_in_tree(*pos);
-    uint32_t next_height = pos_height_in_tree(*pos + 1);
-    if (next_height > pos_height) {
+    if ((leaf_index >> height) & 1) {
       // we are on right branch
       *pos += 1;
-      ctx->merge(peak_hash, pitem, peak_hash);
+      MERGE(ctx, peak_hash, pitem, peak_hash);
     } else {
       // we are on left branch
       *pos += parent_offset(height);
-      ctx->merge(peak_hash, peak_hash, pitem);
+      MERGE(ctx, peak_hash, peak_hash, pitem);
     }
     height += 1;
   }
   return i;
 }
 
+/* batch proof helpers */
+
+/* check positions are leaves in mmr, sorted ascending without duplicates.
+ * return -1 if not.
+ */
+static int check_leaf_positions(uint64_t mmr_size, const uint64_t positions[],
+                                size_t n) {
+  if (n == 0) {
+    return -1;
+  }
+  for (size_t i = 0; i < n; i++) {
+    if (positions[i] >= mmr_size || pos_height_in_tree(positions[i]) != 0 ||
+        (i > 0 && positions[i] <= positions[i - 1])) {
+      return -1;
+    }
+  }
+  return 0;
+}
+
+/* the leaves of a peak are converted to leaf indexes once if there are at
+ * most this many, the positions of larger peaks are converted at every
+ * height */
+#define PEAK_INDEXES_MAX 64
+
+/* convert the positions of a peak's leaves to leaf indexes,
+ * return indexes, or NULL if n is greater than PEAK_INDEXES_MAX */
+static const uint64_t *peak_leaf_indexes(const uint64_t positions[], size_t n,
+                                         uint64_t indexes[PEAK_INDEXES_MAX]) {
+  if (n > PEAK_INDEXES_MAX) {
+    return NULL;
+  }
+  for (size_t i = 0; i < n; i++) {
+    mmr_spec_pos_height_and_leaf(positions[i], &indexes[i]);
+  }
+  return indexes;
+}
+
+/* return the index of leaf i's ancestor in height
+ * indexes: leaf indexes of positions, or NULL to convert positions[i]
+ */
+static uint64_t ancestor_index(const uint64_t positions[],
+                               const uint64_t indexes[], size_t i,
+                               uint32_t height) {
+  uint64_t leaf_index;
+  if (indexes != NULL) {
+    leaf_index = indexes[i];
+  } else {
+    mmr_spec_pos_height_and_leaf(positions[i], &leaf_index);
+  }
+  return leaf_index >> height;
+}
+
+/* return the end of the leaves under the same ancestor in height */
+static size_t skip_ancestor(const uint64_t positions[],
+                            const uint64_t indexes[], size_t i, size_t n,
+                            uint32_t height) {
+  uint64_t node = ancestor_index(positions, indexes, i, height);
+  while (++i < n && ancestor_index(positions, indexes, i, height) == node) {
+  }
+  return i;
+}
+
+/* put the siblings of a peak's leaves to proof height by height,
+ * siblings covered by the leaves are skipped.
+ */
+static int gen_peak_batch_proof(MMRContext *ctx, uint8_t proof[][HASH_SIZE],
+                                size_t *proof_len, size_t proof_max_len,
+                                const uint64_t positions[], size_t n,
+                                uint32_t peak_height) {
+  uint64_t indexes_buf[PEAK_INDEXES_MAX];
+  const uint64_t *indexes = peak_leaf_indexes(positions, n, indexes_buf);
+  for (uint32_t height = 0; height < peak_height; height++) {
+    size_t i = 0;
+    while (i < n) {
+      uint64_t node = ancestor_index(positions, indexes, i, height);
+      size_t next = skip_ancestor(positions, indexes, i, n, height);
+      if ((node & 1) == 0 && next < n &&
+          ancestor_index(positions, indexes, next, height) == node + 1) {
+        /* the right sibling is covered */
+        next = skip_ancestor(positions, indexes, next, n, height);
+      } else {
+        if (*proof_len >= proof_max_len) {
+          return -1;
+        }
+        if (read_node(ctx, node_pos(height, node ^ 1),
+                      proof[(*proof_len)++]) != 0) {
+          return -1;
+        }
+      }
+      i = next;
+    }
+  }
+  return 0;
+}
+
+/* calculate a peak's root from its leaves and proof height by height,
+ * the hash of each ancestor is kept in the slot of its first leaf, so the
+ * peak's root is in leaves[0]. merges of a height are independent and
+ * passed to merge_many together.
+ */
+static int compute_peak_batch_root(MMRVerifyContext *ctx,
+                                   const uint64_t positions[],
+                                   uint8_t leaves[][HASH_SIZE], size_t n,
+                                   uint32_t peak_height,
+                                   uint8_t proof[][HASH_SIZE],
+                                   size_t *proof_i, size_t proof_len) {
+  uint64_t indexes_buf[PEAK_INDEXES_MAX];
+  const uint64_t *indexes = peak_leaf_indexes(positions, n, indexes_buf);
+  uint8_t *dst[MMR_MERGE_MANY_MAX];
+  uint8_t *left[MMR_MERGE_MANY_MAX];
+  uint8_t *right[MMR_MERGE_MANY_MAX];
+  for (uint32_t height = 0; height < peak_height; height++) {
+    size_t lanes = 0;
+    size_t i = 0;
+    while (i < n) {
+      uint64_t node = ancestor_index(positions, indexes, i, height);
+      size_t next = skip_ancestor(positions, indexes, i, n, height);
+      dst[lanes] = leaves[i];
+      if ((node & 1) == 0 && next < n &&
+          ancestor_index(positions, indexes, next, height) == node + 1) {
+        left[lanes] = leaves[i];
+        right[lanes] = leaves[next];
+        next = skip_ancestor(positions, indexes, next, n, height);
+      } else {
+        if (*proof_i >= proof_len) {
+          return -1;
+        }
+        uint8_t *pitem = proof[(*proof_i)++];
+        left[lanes] = (node & 1) ? pitem : leaves[i];
+        right[lanes] = (node & 1) ? leaves[i] : pitem;
+      }
+      if (++lanes == MMR_MERGE_MANY_MAX) {
+        MERGE_NODES(ctx, dst, left, right, lanes);
+        lanes = 0;
+      }
+      i = next;
+    }
+    MERGE_NODES(ctx, dst, left, right, lanes);
+  }
+  return 0;
+}
+
+/* put the boundary siblings of leaves [start, end) in a peak to proof,
+ * the covered nodes of each height are contiguous, so a height has at most a
+ * left and a right sibling. the order is the same as gen_peak_batch_proof.
+ */
+static int gen_peak_range_proof(MMRContext *ctx, uint8_t proof[][HASH_SIZE],
+                                size_t *proof_len, size_t proof_max_len,
+                                uint64_t start, uint64_t end,
+                                uint32_t peak_height) {
+  uint64_t sib_pos[2 * MMR_MAX_PEAKS];
+  size_t len = 0;
+  for (uint32_t height = 0; height < peak_height; height++) {
+    uint64_t lo = start >> height;
+    uint64_t hi = (end - 1) >> height;
+    if (lo & 1) {
+      sib_pos[len++] = node_pos(height, lo - 1);
+    }
+    if ((hi & 1) == 0) {
+      sib_pos[len++] = node_pos(height, hi + 1);
+    }
+  }
+  if (*proof_len + len > proof_max_len) {
+    return -1;
+  }
+  if (read_nodes(ctx, sib_pos, len, &proof[*proof_len]) != 0) {
+    return -1;
+  }
+  *proof_len += len;
+  return 0;
+}
+
+/* calculate a peak's root from leaves [start, end) and proof height by
+ * height in a single pass over leaves, the hash of a node is kept in the slot
+ * of its first covered leaf, so the peak's root is in leaves[0].
+ */
+static int compute_peak_range_root(MMRVerifyContext *ctx,
+                                   uint8_t leaves[][HASH_SIZE], uint64_t start,
+                                   uint64_t end, uint32_t peak_height,
+                                   uint8_t proof[][HASH_SIZE],
+                                   size_t *proof_i, size_t proof_len) {
+  uint8_t *dst[MMR_MERGE_MANY_MAX];
+  uint8_t *left[MMR_MERGE_MANY_MAX];
+  uint8_t *right[MMR_MERGE_MANY_MAX];
+  for (uint32_t height = 0; height < peak_height; height++) {
+    uint64_t lo = start >> height;
+    uint64_t hi = (end - 1) >> height;
+    size_t lanes = 0;
+    for (uint64_t node = lo & ~(uint64_t)1; node <= hi; node += 2) {
+      uint8_t *l, *r;
+      if (node < lo || node + 1 > hi) {
+        if (*proof_i >= proof_len) {
+          return -1;
+        }
+      }
+      if (node < lo) {
+        /* the left sibling is in proof */
+        l = proof[(*proof_i)++];
+        r = leaves[0];
+      } else {
+        uint64_t first_leaf = node << height;
+        l = leaves[first_leaf > start ? first_leaf - start : 0];
+        if (node + 1 > hi) {
+          r = proof[(*proof_i)++];
+        } else {
+          r = leaves[((node + 1) << height) - start];
+        }
+      }
+      dst[lanes] = node < lo ? r : l;
+      left[lanes] = l;
+      right[lanes] = r;
+      if (++lanes == MMR_MERGE_MANY_MAX) {
+        MERGE_NODES(ctx, dst, left, right, lanes);
+        lanes = 0;
+      }
+    }
+    MERGE_NODES(ctx, dst, left, right, lanes);
+  }
+  return 0;
+}
+
 /* MMR API */
 
+/* calculate peak positions from mmr_size,
+ * return the number of peaks.
+ * peaks: a buf to receive peak positions from left to right
+ */
+size_t mmr_peaks_from_size(uint64_t mmr_size, uint64_t peaks[MMR_MAX_PEAKS]) {
+  /* peaks are the complete subtrees split from mmr_size, from the highest to
+   * the lowest. a subtree of height h holds 2^(h + 1) - 1 nodes, so each peak
+   * is found from the bit length of the remain size. */
+  size_t len = 0;
+  uint64_t pos = 0;
+  while (mmr_size > 0) {
+    uint32_t height = mmr_spec_bit_length(mmr_size + 1) - 2;
+    uint64_t tree_size = ((uint64_t)2 << height) - 1;
+    pos += tree_size;
+    peaks[len++] = pos - 1;
+    mmr_size -= tree_size;
+  }
+  return len;
+}
+
+/* calculate height of pos, leaves are height 0 */
+uint32_t mmr_pos_height(uint64_t pos) { return pos_height_in_tree(pos); }
+
+/* calculate position of a leaf from leaf index */
+uint64_t mmr_leaf_index_to_pos(uint64_t index) {
+  return mmr_spec_leaf_index_to_pos(index);
+}
+
+/* calculate leaf index from position of a leaf,
+ * return the index of the last leaf under pos if pos is not a leaf.
+ */
+uint64_t mmr_pos_to_leaf_index(uint64_t pos) {
+  uint64_t leaf_index;
+  mmr_spec_pos_height_and_leaf(pos, &leaf_index);
+  return leaf_index;
+}
+
 /* calculate MMRSizePos from leaf index,
  * mmr_size is the size of mmr when index is the last leaf,
  * pos is the position of leaf in internal mmr.
  */
 MMRSizePos mmr_compute_pos_by_leaf_index(uint64_t index) {
-  if (index == 0) {
-    MMRSizePos ret = {1, 0};
-    return ret;
-  }
-  // leaf_count
-  uint64_t leaves = index + 1;
-  uint64_t tree_node_count = 0;
-  uint32_t height = 0;
-  uint64_t mmr_size = 0;
-  while (leaves > 1) {
-    // get heighest peak height
-    height = simple_log2(leaves);
-    // calculate leaves in peak
-    uint64_t peak_leaves = (uint32_t)1 << height;
-    // heighest positon
-    uint64_t sub_tree_node_count = left_peak_pos_by_height(height) + 1;
-    tree_node_count += sub_tree_node_count;
-    leaves -= peak_leaves;
-    mmr_size += (peak_leaves * 2 - 1);
-  }
-  // two leaves can construct a new peak, the only valid number of leaves is 0
-  // or 1.
-  assert(leaves == 0 || leaves == 1);
-  if (leaves == 1) {
-    // add one pos for remain leaf
-    // equals to `tree_node_count - 1 + 1`
-    mmr_size += 1;
-    MMRSizePos ret = {mmr_size, tree_node_count};
-    return ret;
-  } else {
-    uint64_t pos = tree_node_count - 1;
-    MMRSizePos ret = {mmr_size, pos - height};
-    return ret;
+  MMRSizePos ret = {mmr_spec_mmr_size(index + 1),
+                    mmr_spec_leaf_index_to_pos(index)};
+  return ret;
+}
+
+/* calculate mmr_size from leaf count */
+uint64_t mmr_leaf_count_to_size(uint64_t leaf_count) {
+  return mmr_spec_mmr_size(leaf_count);
+}
+
+/* calculate leaf count from mmr_size,
+ * return UINT64_MAX if mmr_size is not a size of mmr
+ */
+uint64_t mmr_size_to_leaf_count(uint64_t mmr_size) {
+  uint64_t leaf_count = leaf_count_from_mmr_size(mmr_size);
+  if (mmr_spec_mmr_size(leaf_count) != mmr_size) {
+    return UINT64_MAX;
   }
+  return leaf_count;
 }
 
 /* Initialize MMRContext
@@ -269,24 +678,169 @@ int mmr_initialize_context(MMRContext *ctx, uint64_t mmr_size,
   ctx->mmr_size = mmr_size;
   ctx->tree_buf = tree_buf;
   ctx->tree_buf_size = tree_buf_size;
+  ctx->store = NULL;
+  ctx->peaks_cache_size = 0;
+  ctx->top_cache = NULL;
+  ctx->top_cache_levels = 0;
   ctx->merge = merge;
+  ctx->merge_many = NULL;
+  ctx->read_only = 0;
+  INIT_STATS(ctx);
   return 0;
 }
 
-/* push a leaf into mmr
- * leaf: a 32 bytes hash represented leaf
+/* Initialize MMRContext with a store
+ * mmr_size: the current size of mmr, for a empty MMR it's 0
+ * store: the backend to read and append mmr internal nodes
+ * merge: a function to merge left node hash and right node hash
  */
-int mmr_push(MMRContext *ctx, uint8_t leaf[HASH_SIZE]) {
+int mmr_initialize_store_context(MMRContext *ctx, uint64_t mmr_size,
+                                 MMRStore *store,
+                                 void(merge)(uint8_t dst[HASH_SIZE],
+                                             uint8_t right[HASH_SIZE],
+                                             uint8_t left[HASH_SIZE])) {
+  if (store == NULL || store->get == NULL || store->append == NULL) {
+    return -1;
+  }
+  ctx->mmr_size = mmr_size;
+  ctx->tree_buf = NULL;
+  ctx->tree_buf_size = UINT64_MAX;
+  ctx->store = store;
+  ctx->peaks_cache_size = 0;
+  ctx->top_cache = NULL;
+  ctx->top_cache_levels = 0;
+  ctx->merge = merge;
+  ctx->merge_many = NULL;
+  ctx->read_only = 0;
+  INIT_STATS(ctx);
+  return 0;
+}
+
+/* set a multi-lane merge function
+ * merge_many: a function to merge n pairs of left and right node hashes into
+ * dst, n is never greater than MMR_MERGE_MANY_MAX.
+ * set it to NULL to fallback to merge.
+ */
+void mmr_set_merge_many(MMRContext *ctx,
+                        void(merge_many)(uint8_t *dst[], uint8_t *left[],
+                                         uint8_t *right[], size_t n)) {
+  ctx->merge_many = merge_many;
+}
+
+/* load mmr_size of a context which may be pushed by another thread
+ * all nodes under the returned size are complete and never change.
+ */
+uint64_t mmr_snapshot_size(MMRContext *ctx) {
+  return __atomic_load_n(&ctx->mmr_size, __ATOMIC_ACQUIRE);
+}
+
+/* take a snapshot of a context for a reader thread
+ * the snapshot sees the mmr at mmr_snapshot_size(ctx), get_root and gen_proof
+ * on it need no lock while the writer keeps pushing to ctx. the snapshot has
+ * its own peaks cache, so reuse it for many proofs of the same size.
+ * the snapshot is read only, pushes and truncates on it return -1 since the
+ * store is shared with ctx.
+ * return -1 if the store of ctx doesn't set concurrent_get, the arena and
+ * blocked stores do, the mmr_file store remaps on growth and the sparse store
+ * moves its entries on pushes, so they don't
+ * snapshot: the context to receive the snapshot
+ */
+int mmr_snapshot(MMRContext *ctx, MMRContext *snapshot) {
+  if (ctx->store != NULL && !ctx->store->concurrent_get) {
+    return -1;
+  }
+  /* the peaks cache belongs to the writer, so it is not copied */
+  snapshot->mmr_size = mmr_snapshot_size(ctx);
+  snapshot->tree_buf = ctx->tree_buf;
+  snapshot->tree_buf_size = snapshot->mmr_size;
+  snapshot->store = ctx->store;
+  snapshot->merge = ctx->merge;
+  snapshot->merge_many = ctx->merge_many;
+  snapshot->read_only = 1;
+  snapshot->peaks_cache_size = 0;
+  /* so is the top levels cache, it is written on reads */
+  snapshot->top_cache = NULL;
+  snapshot->top_cache_levels = 0;
+#ifdef MMR_ENABLE_STATS
+  /* the hooks are shared, the counters are per snapshot */
+  memset(&snapshot->stats, 0, sizeof(snapshot->stats));
+  snapshot->hooks = ctx->hooks;
+#endif
+  return 0;
+}
+
+/* set a cache of the top levels of every mountain
+ * return -1 if levels is greater than MMR_TOP_CACHE_MAX_LEVELS
+ * cache: MMR_TOP_CACHE_ENTRIES(levels) entries, NULL to disable the cache
+ * levels: number of levels under the peaks to cache
+ */
+int mmr_set_top_cache(MMRContext *ctx, MMRCacheEntry cache[],
+                      uint32_t levels) {
+  if (levels > MMR_TOP_CACHE_MAX_LEVELS) {
+    return -1;
+  }
+  if (cache != NULL) {
+    for (size_t i = 0; i < MMR_TOP_CACHE_ENTRIES(levels); i++) {
+      cache[i].pos = UINT64_MAX;
+    }
+  }
+  ctx->top_cache = cache;
+  ctx->top_cache_levels = cache != NULL ? levels : 0;
+  return 0;
+}
+
+#ifdef MMR_ENABLE_STATS
+void mmr_set_hooks(MMRContext *ctx, const MMRHooks *hooks) {
+  ctx->hooks = *hooks;
+}
+#endif
+
+static int store_push(MMRContext *ctx, uint8_t leaf[HASH_SIZE]) {
+  MMRStore *store = ctx->store;
+  uint64_t pos = ctx->mmr_size;
+  if (store->append(store->data, pos, leaf) != 0) {
+    return -1;
+  }
+  uint64_t leaf_index = leaf_count_from_mmr_size(pos);
+  uint32_t merges = mmr_spec_trailing_zeros(leaf_index + 1);
+
+  /* the right child is always the node just appended */
+  uint8_t node[HASH_SIZE];
+  uint8_t left[HASH_SIZE];
+  memcpy(node, leaf, HASH_SIZE);
+  for (uint32_t height = 0; height < merges; height++) {
+    pos++;
+    if (store->get(store->data, pos - parent_offset(height), left) != 0) {
+      return -1;
+    }
+    MERGE(ctx, node, left, node);
+    if (store->append(store->data, pos, node) != 0) {
+      return -1;
+    }
+  }
+  publish_mmr_size(ctx, pos + 1);
+  return 0;
+}
+
+static int do_push(MMRContext *ctx, uint8_t leaf[HASH_SIZE]) {
+  if (ctx->read_only) {
+    return -1;
+  }
+  if (ctx->store != NULL) {
+    return store_push(ctx, leaf);
+  }
   uint64_t pos = ctx->mmr_size;
   if (pos >= ctx->tree_buf_size) {
     return -1;
   }
   ctx->tree_buf[pos][0] = 1;
   memcpy(ctx->tree_buf[pos], leaf, HASH_SIZE);
-  uint32_t height = 0;
+  /* the leaf completes a subtree for each trailing one bit of its index */
+  uint64_t leaf_index = leaf_count_from_mmr_size(pos);
+  uint32_t merges = mmr_spec_trailing_zeros(leaf_index + 1);
 
   uint64_t i = pos;
-  while (pos_height_in_tree(i + 1) > height) {
+  for (uint32_t height = 0; height < merges; height++) {
     i++;
     if (i >= ctx->tree_buf_size) {
       return -1;
@@ -295,84 +849,625 @@ int mmr_push(MMRContext *ctx, uint8_t leaf[HASH_SIZE]) {
     uint64_t right_pos = left_pos + sibling_offset(height);
     uint8_t *left = ctx->tree_buf[left_pos];
     uint8_t *right = ctx->tree_buf[right_pos];
-    ctx->merge(ctx->tree_buf[i], left, right);
-    height++;
+    MERGE(ctx, ctx->tree_buf[i], left, right);
   }
-  ctx->mmr_size = i + 1;
+  publish_mmr_size(ctx, i + 1);
   return 0;
 }
 
-/* get merkle root,
- * return -1 if mmr_size is 0
- * dst: a 32 bytes buf to receive merkle root
+/* push a leaf into mmr
+ * leaf: a 32 bytes hash represented leaf
  */
-int mmr_get_root(MMRContext *ctx, uint8_t dst[HASH_SIZE]) {
-  if (ctx->mmr_size == 0) {
+int mmr_push(MMRContext *ctx, uint8_t leaf[HASH_SIZE]) {
+  TRACE_BEGIN(ctx, MMR_OP_PUSH);
+  int ret = do_push(ctx, leaf);
+  TRACE_END(ctx, MMR_OP_PUSH, ret);
+  return ret;
+}
+
+/* push leaves into mmr
+ * a failed push on a store may have pushed the first leaves, re-read
+ * mmr_size after a failure.
+ * return -1 if tree_buf is not enough to receive the leaves or the store
+ * failed
+ * leaves: an array of 32 bytes hash represented leaves
+ * n: length of leaves
+ */
+static int do_push_batch(MMRContext *ctx, uint8_t leaves[][HASH_SIZE],
+                         size_t n) {
+  uint64_t leaf_count = leaf_count_from_mmr_size(ctx->mmr_size);
+  /* mmr_size must be a complete mmr */
+  if (ctx->read_only ||
+      mmr_spec_mmr_size(leaf_count) != ctx->mmr_size) {
     return -1;
-  } else if (ctx->mmr_size == 1) {
-    memcpy(dst, ctx->tree_buf[0], HASH_SIZE);
+  }
+  /* stores are append only, push leaves in order */
+  if (ctx->store != NULL) {
+    for (size_t i = 0; i < n; i++) {
+      if (store_push(ctx, leaves[i]) != 0) {
+        return -1;
+      }
+    }
     return 0;
   }
-  MMRHeightPos left_peak = left_peak_height_pos(ctx->mmr_size);
-  uint64_t peaks_buf[left_peak.height];
-  MMRPeaks peaks = get_peaks(peaks_buf, left_peak, ctx->mmr_size);
-  return bag_rhs_peaks(ctx, dst, 0, &peaks);
+  uint64_t new_leaf_count = leaf_count + n;
+  uint64_t new_mmr_size = mmr_spec_mmr_size(new_leaf_count);
+  if (new_mmr_size > ctx->tree_buf_size) {
+    return -1;
+  }
+  for (size_t i = 0; i < n; i++) {
+    uint64_t pos = mmr_spec_leaf_index_to_pos(leaf_count + i);
+    memcpy(ctx->tree_buf[pos], leaves[i], HASH_SIZE);
+  }
+  return mmr_push_subtrees(ctx, n, 0);
 }
 
-/* generate merkle proof
- * return -1 if proof length is not enough to receive the proof
- * proof: a array of 32 bytes buf to receive merkle proof
- * proof_max_len: length of proof buf, will be set to the actual len of proof.
- * pos: position of leaf
- */
-int mmr_gen_proof(MMRContext *ctx, uint8_t proof[][HASH_SIZE],
-                  size_t *proof_max_len, uint64_t pos) {
-  uint32_t height = 0;
-  size_t proof_len = 0;
-  while (pos < ctx->mmr_size) {
-    uint32_t pos_height = pos_height_in_tree(pos);
-    uint32_t next_height = pos_height_in_tree(pos + 1);
-    uint64_t sib_pos, next_pos;
-    if (next_height > pos_height) {
-      // we are on right branch
-      sib_pos = pos - sibling_offset(height);
-      next_pos = pos + 1;
-    } else {
-      sib_pos = pos + sibling_offset(height);
-      next_pos = pos + parent_offset(height);
-    }
+int mmr_push_batch(MMRContext *ctx, uint8_t leaves[][HASH_SIZE], size_t n) {
+  TRACE_BEGIN(ctx, MMR_OP_PUSH_BATCH);
+  int ret = do_push_batch(ctx, leaves, n);
+  TRACE_END(ctx, MMR_OP_PUSH_BATCH, ret);
+  return ret;
+}
 
-    if (sib_pos > ctx->mmr_size - 1) {
-      break;
-    }
-    if (proof_len >= *proof_max_len) {
-      return -1;
-    }
-    memcpy(proof[proof_len++], ctx->tree_buf[sib_pos], HASH_SIZE);
-    pos = next_pos;
-    height++;
+/* push leaves whose subtrees are already in tree_buf
+ * return -1 if the context has a store, leaf count or n are not multiples of
+ * 2^height, or tree_buf is not enough
+ * n: number of the new leaves
+ * height: nodes of the new leaves under and at height are in tree_buf
+ */
+int mmr_push_subtrees(MMRContext *ctx, uint64_t n, uint32_t height) {
+  uint64_t leaf_count = leaf_count_from_mmr_size(ctx->mmr_size);
+  /* mmr_size must be a complete mmr */
+  if (ctx->store != NULL || ctx->read_only ||
+      mmr_spec_mmr_size(leaf_count) != ctx->mmr_size || height >= 64) {
+    return -1;
   }
-  /* gen merkle proof of the peak */
-  MMRHeightPos left_peak = left_peak_height_pos(ctx->mmr_size);
-  uint64_t peaks_buf[left_peak.height];
-  MMRPeaks peaks = get_peaks(peaks_buf, left_peak, ctx->mmr_size);
-  if (proof_len >= *proof_max_len) {
+  uint64_t mask = ((uint64_t)1 << height) - 1;
+  if ((leaf_count & mask) != 0 || (n & mask) != 0) {
     return -1;
   }
-  /* bagging rhs peak */
-  int ret = bag_rhs_peaks(ctx, proof[proof_len], pos, &peaks);
-  if (ret == 0) {
-    proof_len++;
+  uint64_t new_leaf_count = leaf_count + n;
+  uint64_t new_mmr_size = mmr_spec_mmr_size(new_leaf_count);
+  if (new_mmr_size > ctx->tree_buf_size) {
+    return -1;
   }
-  /* put left peaks to proof */
-  for (int i = peaks.len - 1; i >= 0; i--) {
-    uint64_t peak_pos = peaks.peaks[i];
-    if (peak_pos < pos) {
-      if (proof_len >= *proof_max_len) {
-        return -1;
+  /* the nodes of each height are complete now, so merge the new nodes of the
+   * next height. nodes [leaf_count >> height, new_leaf_count >> height) are
+   * new in the height, they are independent and merged together. */
+  uint8_t *dst[MMR_MERGE_MANY_MAX];
+  uint8_t *left[MMR_MERGE_MANY_MAX];
+  uint8_t *right[MMR_MERGE_MANY_MAX];
+  for (height++; (new_leaf_count >> height) > 0; height++) {
+    uint64_t end = new_leaf_count >> height;
+    size_t lanes = 0;
+    for (uint64_t i = leaf_count >> height; i < end; i++) {
+      uint64_t pos = node_pos(height, i);
+      dst[lanes] = ctx->tree_buf[pos];
+      left[lanes] = ctx->tree_buf[pos - parent_offset(height - 1)];
+      right[lanes] = ctx->tree_buf[pos - 1];
+      if (++lanes == MMR_MERGE_MANY_MAX) {
+        MERGE_NODES(ctx, dst, left, right, lanes);
+        lanes = 0;
       }
-      memcpy(proof[proof_len++], ctx->tree_buf[peak_pos], HASH_SIZE);
     }
+    MERGE_NODES(ctx, dst, left, right, lanes);
+  }
+  publish_mmr_size(ctx, new_mmr_size);
+  return 0;
+}
+
+static int do_truncate(MMRContext *ctx, uint64_t leaf_count) {
+  uint64_t current = leaf_count_from_mmr_size(ctx->mmr_size);
+  if (ctx->read_only || leaf_count > current) {
+    return -1;
+  }
+  uint64_t mmr_size = mmr_spec_mmr_size(leaf_count);
+  MMRStore *store = ctx->store;
+  if (store != NULL && store->truncate != NULL &&
+      store->truncate(store->data, mmr_size) != 0) {
+    return -1;
+  }
+  publish_mmr_size(ctx, mmr_size);
+  /* the nodes from mmr_size will be pushed again with other hashes */
+  if (ctx->top_cache != NULL) {
+    for (size_t i = 0; i < MMR_TOP_CACHE_ENTRIES(ctx->top_cache_levels);
+         i++) {
+      if (ctx->top_cache[i].pos >= mmr_size) {
+        ctx->top_cache[i].pos = UINT64_MAX;
+      }
+    }
+  }
+  /* a cache of a larger size would look valid after pushing it back with
+   * other leaves, so repair it now. the peaks in common are kept, a failed
+   * read leaves the cache invalid and the next read retries. */
+  if (ctx->peaks_cache_size > mmr_size) {
+    uint64_t peaks_buf[MMR_MAX_PEAKS];
+    MMRPeaks peaks = {peaks_buf, 0};
+    update_peaks_cache(ctx, &peaks);
+  }
+  return 0;
+}
+
+/* truncate mmr to the first leaf_count leaves
+ * mmr_size is set back in O(1), the peaks cache is repaired by reading only
+ * the peaks which are not peaks before, O(log n). the nodes after mmr_size
+ * are overwritten by the following pushes, so snapshots larger than the new
+ * mmr_size must not be read after a truncate.
+ * return -1 if leaf_count is greater than the current leaf count, ctx is a
+ * snapshot, or the store failed to truncate
+ * leaf_count: number of leaves to keep
+ */
+int mmr_truncate(MMRContext *ctx, uint64_t leaf_count) {
+  TRACE_BEGIN(ctx, MMR_OP_TRUNCATE);
+  int ret = do_truncate(ctx, leaf_count);
+  TRACE_END(ctx, MMR_OP_TRUNCATE, ret);
+  return ret;
+}
+
+/* get merkle root,
+ * return -1 if mmr_size is 0 or failed to read the store
+ * dst: a 32 bytes buf to receive merkle root
+ */
+static int do_get_root(MMRContext *ctx, uint8_t dst[HASH_SIZE]) {
+  if (ctx->mmr_size == 0) {
+    return -1;
+  }
+  uint64_t peaks_buf[MMR_MAX_PEAKS];
+  MMRPeaks peaks = {peaks_buf, 0};
+  if (update_peaks_cache(ctx, &peaks) != 0) {
+    return -1;
+  }
+  /* the bag of all peaks */
+  memcpy(dst, ctx->peak_bags[0], HASH_SIZE);
+  return 0;
+}
+
+int mmr_get_root(MMRContext *ctx, uint8_t dst[HASH_SIZE]) {
+  TRACE_BEGIN(ctx, MMR_OP_GET_ROOT);
+  int ret = do_get_root(ctx, dst);
+  TRACE_END(ctx, MMR_OP_GET_ROOT, ret);
+  return ret;
+}
+
+/* generate merkle proof
+ * return -1 if proof length is not enough to receive the proof, or failed to
+ * read the store
+ * proof: a array of 32 bytes buf to receive merkle proof
+ * proof_max_len: length of proof buf, will be set to the actual len of proof.
+ * pos: position of leaf
+ */
+static int do_gen_proof(MMRContext *ctx, uint8_t proof[][HASH_SIZE],
+                        size_t *proof_max_len, uint64_t pos) {
+  /* collect the positions first, then read them together */
+  uint64_t proof_pos[MMR_MAX_PEAKS];
+  size_t proof_len;
+  if (proof_path(ctx->mmr_size, &pos, proof_pos, *proof_max_len,
+                 &proof_len) != 0) {
+    return -1;
+  }
+  if (read_nodes(ctx, proof_pos, proof_len, proof) != 0) {
+    return -1;
+  }
+  /* gen merkle proof of the peak */
+  uint64_t peaks_buf[MMR_MAX_PEAKS];
+  MMRPeaks peaks = {peaks_buf, 0};
+  if (update_peaks_cache(ctx, &peaks) != 0) {
+    return -1;
+  }
+  if (proof_len >= *proof_max_len) {
+    return -1;
+  }
+  /* peaks [0, left_len) are on the left, [rhs, len) are on the right */
+  size_t left_len = 0;
+  while (left_len < peaks.len && peaks.peaks[left_len] < pos) {
+    left_len++;
+  }
+  size_t rhs = left_len;
+  if (rhs < peaks.len && peaks.peaks[rhs] == pos) {
+    rhs++;
+  }
+  /* bagging rhs peak */
+  if (rhs < peaks.len) {
+    memcpy(proof[proof_len++], ctx->peak_bags[rhs], HASH_SIZE);
+  }
+  /* put left peaks to proof */
+  if (proof_len + left_len > *proof_max_len) {
+    return -1;
+  }
+  for (size_t i = 0; i < left_len; i++) {
+    memcpy(proof[proof_len + i], ctx->peak_hashes[left_len - 1 - i],
+           HASH_SIZE);
+  }
+  proof_len += left_len;
+  *proof_max_len = proof_len;
+  return 0;
+}
+
+int mmr_gen_proof(MMRContext *ctx, uint8_t proof[][HASH_SIZE],
+                  size_t *proof_max_len, uint64_t pos) {
+  TRACE_BEGIN(ctx, MMR_OP_GEN_PROOF);
+  int ret = do_gen_proof(ctx, proof, proof_max_len, pos);
+  if (ret == 0) {
+    STATS_ADD(ctx, proof_items, *proof_max_len);
+  }
+  TRACE_END(ctx, MMR_OP_GEN_PROOF, ret);
+  return ret;
+}
+
+/* generate merkle proof of a leaf by its index
+ * return -1 if leaf_index is not in the mmr, see mmr_gen_proof
+ * leaf_index: index of leaf
+ */
+int mmr_gen_proof_by_leaf_index(MMRContext *ctx, uint8_t proof[][HASH_SIZE],
+                                size_t *proof_max_len, uint64_t leaf_index) {
+  if (leaf_index >= leaf_count_from_mmr_size(ctx->mmr_size)) {
+    return -1;
+  }
+  return mmr_gen_proof(ctx, proof, proof_max_len,
+                       mmr_spec_leaf_index_to_pos(leaf_index));
+}
+
+/* generate merkle proof of multiple leaves
+ * siblings and peaks shared by the leaves are put into proof once, nodes the
+ * verifier can calculate from the leaves are skipped.
+ * the proof is built peak by peak from left to right:
+ * 1. for a peak contains leaves, siblings of the leaves height by height from
+ * left to right.
+ * 2. for a peak on the left of the last leaf without leaves, the peak hash.
+ * 3. peaks on the right of the last leaf, bagged into one hash.
+ * return -1 if proof length is not enough to receive the proof, positions are
+ * invalid or failed to read the store
+ * proof: a array of 32 bytes buf to receive merkle proof
+ * proof_max_len: length of proof buf, will be set to the actual len of proof.
+ * positions: positions of leaves, sorted ascending without duplicates
+ * n: length of positions
+ */
+static int do_gen_batch_proof(MMRContext *ctx, uint8_t proof[][HASH_SIZE],
+                              size_t *proof_max_len,
+                              const uint64_t positions[], size_t n) {
+  if (check_leaf_positions(ctx->mmr_size, positions, n) != 0) {
+    return -1;
+  }
+  uint64_t leaf_count = leaf_count_from_mmr_size(ctx->mmr_size);
+  uint64_t last_leaf = ancestor_index(positions, NULL, n - 1, 0);
+  uint64_t peaks_buf[MMR_MAX_PEAKS];
+  MMRPeaks peaks = {peaks_buf, 0};
+  if (update_peaks_cache(ctx, &peaks) != 0) {
+    return -1;
+  }
+  size_t proof_len = 0;
+  size_t i = 0;
+  uint64_t peak_start = 0;
+  /* peaks follow the bits of leaf_count from the highest */
+  for (size_t p = 0; p < peaks.len; p++) {
+    uint32_t peak_height = simple_log2(leaf_count ^ peak_start);
+    uint64_t peak_end = peak_start + ((uint64_t)1 << peak_height);
+    /* leaves are before the position of the first leaf of the next peak */
+    uint64_t end_pos = mmr_spec_leaf_index_to_pos(peak_end);
+    size_t first = i;
+    while (i < n && positions[i] < end_pos) {
+      i++;
+    }
+    if (first < i) {
+      if (gen_peak_batch_proof(ctx, proof, &proof_len, *proof_max_len,
+                               &positions[first], i - first,
+                               peak_height) != 0) {
+        return -1;
+      }
+    } else {
+      if (proof_len >= *proof_max_len) {
+        return -1;
+      }
+      if (peak_start > last_leaf) {
+        /* bagging rhs peaks */
+        memcpy(proof[proof_len++], ctx->peak_bags[p], HASH_SIZE);
+        break;
+      }
+      memcpy(proof[proof_len++], ctx->peak_hashes[p], HASH_SIZE);
+    }
+    peak_start = peak_end;
+  }
+  *proof_max_len = proof_len;
+  return 0;
+}
+
+int mmr_gen_batch_proof(MMRContext *ctx, uint8_t proof[][HASH_SIZE],
+                        size_t *proof_max_len, const uint64_t positions[],
+                        size_t n) {
+  TRACE_BEGIN(ctx, MMR_OP_GEN_BATCH_PROOF);
+  int ret = do_gen_batch_proof(ctx, proof, proof_max_len, positions, n);
+  if (ret == 0) {
+    STATS_ADD(ctx, proof_items, *proof_max_len);
+  }
+  TRACE_END(ctx, MMR_OP_GEN_BATCH_PROOF, ret);
+  return ret;
+}
+
+/* generate merkle proof of leaves [start, end)
+ * see mmr.h for the layout of proof.
+ */
+static int do_gen_range_proof(MMRContext *ctx, uint8_t proof[][HASH_SIZE],
+                              size_t *proof_max_len, uint64_t start,
+                              uint64_t end) {
+  uint64_t leaf_count = leaf_count_from_mmr_size(ctx->mmr_size);
+  if (start >= end || end > leaf_count) {
+    return -1;
+  }
+  uint64_t peaks_buf[MMR_MAX_PEAKS];
+  MMRPeaks peaks = {peaks_buf, 0};
+  if (update_peaks_cache(ctx, &peaks) != 0) {
+    return -1;
+  }
+  size_t proof_len = 0;
+  uint64_t peak_start = 0;
+  for (size_t p = 0; p < peaks.len; p++) {
+    uint32_t peak_height = simple_log2(leaf_count ^ peak_start);
+    uint64_t peak_end = peak_start + ((uint64_t)1 << peak_height);
+    if (peak_end > start && peak_start < end) {
+      uint64_t first = start > peak_start ? start : peak_start;
+      uint64_t last = end < peak_end ? end : peak_end;
+      if (gen_peak_range_proof(ctx, proof, &proof_len, *proof_max_len, first,
+                               last, peak_height) != 0) {
+        return -1;
+      }
+    } else {
+      if (proof_len >= *proof_max_len) {
+        return -1;
+      }
+      if (peak_start >= end) {
+        /* bagging rhs peaks */
+        memcpy(proof[proof_len++], ctx->peak_bags[p], HASH_SIZE);
+        break;
+      }
+      memcpy(proof[proof_len++], ctx->peak_hashes[p], HASH_SIZE);
+    }
+    peak_start = peak_end;
+  }
+  *proof_max_len = proof_len;
+  return 0;
+}
+
+/* generate merkle proof of the contiguous leaves [start, end)
+ * the covered nodes of each height are contiguous, so only the siblings on
+ * the left and right boundary are put into proof, at most two per height.
+ * the layout is the same as mmr_gen_batch_proof of the leaves' positions, so
+ * either verifier accepts it.
+ * return -1 if proof length is not enough to receive the proof, the range is
+ * empty or out of the mmr, or failed to read the store
+ * proof: a array of 32 bytes buf to receive merkle proof
+ * proof_max_len: length of proof buf, will be set to the actual len of proof.
+ * start: leaf index of the first leaf
+ * end: leaf index after the last leaf
+ */
+int mmr_gen_range_proof(MMRContext *ctx, uint8_t proof[][HASH_SIZE],
+                        size_t *proof_max_len, uint64_t start, uint64_t end) {
+  TRACE_BEGIN(ctx, MMR_OP_GEN_RANGE_PROOF);
+  int ret = do_gen_range_proof(ctx, proof, proof_max_len, start, end);
+  if (ret == 0) {
+    STATS_ADD(ctx, proof_items, *proof_max_len);
+  }
+  TRACE_END(ctx, MMR_OP_GEN_RANGE_PROOF, ret);
+  return ret;
+}
+
+/* generate proof that the mmr of new_size extends the mmr of old_size
+ * see mmr.h for the layout of proof.
+ */
+static int do_gen_consistency_proof(MMRContext *ctx, uint8_t proof[][HASH_SIZE],
+                                    size_t *proof_max_len, uint64_t old_size,
+                                    uint64_t new_size) {
+  if (old_size == 0 || old_size > new_size || new_size > ctx->mmr_size ||
+      mmr_size_to_leaf_count(old_size) == UINT64_MAX ||
+      mmr_size_to_leaf_count(new_size) == UINT64_MAX) {
+    return -1;
+  }
+  /* the old peaks, then the siblings from the last old peak to its peak in
+   * new_size which are not old peaks */
+  uint64_t nodes_pos[MMR_MAX_PEAKS * 2];
+  size_t old_len = mmr_peaks_from_size(old_size, nodes_pos);
+  uint64_t pos = nodes_pos[old_len - 1];
+  uint64_t sib_pos[MMR_MAX_PEAKS];
+  size_t sib_len;
+  if (proof_path(new_size, &pos, sib_pos, MMR_MAX_PEAKS, &sib_len) != 0) {
+    return -1;
+  }
+  size_t proof_len = old_len;
+  for (size_t i = 0; i < sib_len; i++) {
+    if (sib_pos[i] >= old_size) {
+      nodes_pos[proof_len++] = sib_pos[i];
+    }
+  }
+  if (proof_len > *proof_max_len ||
+      read_nodes(ctx, nodes_pos, proof_len, proof) != 0) {
+    return -1;
+  }
+  /* bagging the peaks on the right of pos */
+  uint64_t peaks_buf[MMR_MAX_PEAKS];
+  MMRPeaks peaks = {peaks_buf, mmr_peaks_from_size(new_size, peaks_buf)};
+  size_t rhs = 0;
+  while (rhs < peaks.len && peaks.peaks[rhs] != pos) {
+    rhs++;
+  }
+  if (rhs == peaks.len) {
+    return -1;
+  }
+  rhs++;
+  if (rhs == peaks.len) {
+    *proof_max_len = proof_len;
+    return 0;
+  }
+  if (proof_len >= *proof_max_len) {
+    return -1;
+  }
+  if (new_size == ctx->mmr_size) {
+    if (update_peaks_cache(ctx, &peaks) != 0) {
+      return -1;
+    }
+    memcpy(proof[proof_len++], ctx->peak_bags[rhs], HASH_SIZE);
+  } else {
+    uint8_t peak_hashes[MMR_MAX_PEAKS][HASH_SIZE];
+    size_t n = peaks.len - rhs;
+    if (read_nodes(ctx, &peaks.peaks[rhs], n, peak_hashes) != 0) {
+      return -1;
+    }
+    uint8_t *bag = proof[proof_len++];
+    memcpy(bag, peak_hashes[n - 1], HASH_SIZE);
+    for (size_t i = n - 1; i > 0; i--) {
+      MERGE(ctx, bag, bag, peak_hashes[i - 1]);
+    }
+  }
+  *proof_max_len = proof_len;
+  return 0;
+}
+
+int mmr_gen_consistency_proof(MMRContext *ctx, uint8_t proof[][HASH_SIZE],
+                              size_t *proof_max_len, uint64_t old_size,
+                              uint64_t new_size) {
+  TRACE_BEGIN(ctx, MMR_OP_GEN_CONSISTENCY_PROOF);
+  int ret = do_gen_consistency_proof(ctx, proof, proof_max_len, old_size,
+                                     new_size);
+  if (ret == 0) {
+    STATS_ADD(ctx, proof_items, *proof_max_len);
+  }
+  TRACE_END(ctx, MMR_OP_GEN_CONSISTENCY_PROOF, ret);
+  return ret;
+}
+
+static int compare_pos(const void *a, const void *b) {
+  uint64_t x = *(const uint64_t *)a;
+  uint64_t y = *(const uint64_t *)b;
+  return x < y ? -1 : x > y;
+}
+
+/* list the nodes read by the proofs of positions
+ * return -1 if a position is not in mmr_size or nodes_len is not enough
+ * nodes_pos: a buf to receive the positions sorted ascending without
+ * duplicates, 64 * (n + 1) is always enough
+ * nodes_len: length of nodes_pos, will be set to the number of positions
+ */
+int mmr_proof_nodes(uint64_t mmr_size, const uint64_t positions[], size_t n,
+                    uint64_t nodes_pos[], size_t *nodes_len) {
+  uint64_t peaks[MMR_MAX_PEAKS];
+  size_t peaks_len = mmr_peaks_from_size(mmr_size, peaks);
+  /* bit i is set if peak i is read by a proof */
+  uint64_t peaks_read = 0;
+  size_t len = 0;
+  for (size_t i = 0; i < n; i++) {
+    uint64_t pos = positions[i];
+    if (pos >= mmr_size) {
+      return -1;
+    }
+    size_t path_len;
+    if (proof_path(mmr_size, &pos, &nodes_pos[len], *nodes_len - len,
+                   &path_len) != 0) {
+      return -1;
+    }
+    len += path_len;
+    /* a proof reads all peaks but its own */
+    for (size_t p = 0; p < peaks_len; p++) {
+      if (peaks[p] != pos) {
+        peaks_read |= (uint64_t)1 << p;
+      }
+    }
+  }
+  for (size_t p = 0; p < peaks_len; p++) {
+    if ((peaks_read >> p) & 1) {
+      if (len >= *nodes_len) {
+        return -1;
+      }
+      nodes_pos[len++] = peaks[p];
+    }
+  }
+  qsort(nodes_pos, len, sizeof(uint64_t), compare_pos);
+  size_t unique = 0;
+  for (size_t i = 0; i < len; i++) {
+    if (unique == 0 || nodes_pos[unique - 1] != nodes_pos[i]) {
+      nodes_pos[unique++] = nodes_pos[i];
+    }
+  }
+  *nodes_len = unique;
+  return 0;
+}
+
+/* return the hash of pos in the fetched nodes, NULL if it's missing */
+static uint8_t *find_node(const uint64_t nodes_pos[],
+                          uint8_t nodes[][HASH_SIZE], size_t nodes_len,
+                          uint64_t pos) {
+  size_t lo = 0;
+  size_t hi = nodes_len;
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+    if (nodes_pos[mid] < pos) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  return lo < nodes_len && nodes_pos[lo] == pos ? nodes[lo] : NULL;
+}
+
+/* assemble merkle proof from the nodes listed by mmr_proof_nodes
+ * the proof is the same as mmr_gen_proof at mmr_size
+ * return -1 if proof length is not enough or a node is missing
+ * ctx: merge functions to bag the rhs peaks
+ * pos: position of leaf
+ * nodes_pos: positions of the fetched nodes, sorted ascending
+ * nodes: hashes of the fetched nodes
+ * nodes_len: length of nodes_pos and nodes
+ * proof: a array of 32 bytes buf to receive merkle proof
+ * proof_max_len: length of proof buf, will be set to the actual len of proof.
+ */
+int mmr_assemble_proof(MMRVerifyContext *ctx, uint64_t mmr_size, uint64_t pos,
+                       const uint64_t nodes_pos[], uint8_t nodes[][HASH_SIZE],
+                       size_t nodes_len, uint8_t proof[][HASH_SIZE],
+                       size_t *proof_max_len) {
+  if (pos >= mmr_size) {
+    return -1;
+  }
+  uint64_t path[MMR_MAX_PEAKS];
+  size_t proof_len;
+  if (proof_path(mmr_size, &pos, path, *proof_max_len, &proof_len) != 0) {
+    return -1;
+  }
+  uint64_t peaks[MMR_MAX_PEAKS];
+  size_t peaks_len = mmr_peaks_from_size(mmr_size, peaks);
+  size_t left_len = 0;
+  while (left_len < peaks_len && peaks[left_len] < pos) {
+    left_len++;
+  }
+  size_t rhs = left_len < peaks_len ? left_len + 1 : peaks_len;
+  if (proof_len + (rhs < peaks_len) + left_len > *proof_max_len) {
+    return -1;
+  }
+  for (size_t i = 0; i < proof_len; i++) {
+    uint8_t *node = find_node(nodes_pos, nodes, nodes_len, path[i]);
+    if (node == NULL) {
+      return -1;
+    }
+    memcpy(proof[i], node, HASH_SIZE);
+  }
+  /* bagging rhs peaks from right to left */
+  if (rhs < peaks_len) {
+    uint8_t *bag = proof[proof_len++];
+    for (size_t i = peaks_len; i-- > rhs;) {
+      uint8_t *peak = find_node(nodes_pos, nodes, nodes_len, peaks[i]);
+      if (peak == NULL) {
+        return -1;
+      }
+      if (i == peaks_len - 1) {
+        memcpy(bag, peak, HASH_SIZE);
+      } else {
+        MERGE(ctx, bag, bag, peak);
+      }
+    }
+  }
+  /* left peaks from right to left */
+  for (size_t i = left_len; i-- > 0;) {
+    uint8_t *peak = find_node(nodes_pos, nodes, nodes_len, peaks[i]);
+    if (peak == NULL) {
+      return -1;
+    }
+    memcpy(proof[proof_len++], peak, HASH_SIZE);
   }
   *proof_max_len = proof_len;
   return 0;
@@ -386,9 +1481,51 @@ int mmr_initialize_verify_context(MMRVerifyContext *ctx,
                                               uint8_t right[HASH_SIZE],
                                               uint8_t left[HASH_SIZE])) {
   ctx->merge = merge;
+  ctx->merge_many = NULL;
+  INIT_STATS(ctx);
   return 0;
 }
 
+/* set a multi-lane merge function for MMRVerifyContext
+ * see mmr_set_merge_many
+ */
+void mmr_set_verify_merge_many(MMRVerifyContext *ctx,
+                               void(merge_many)(uint8_t *dst[],
+                                                uint8_t *left[],
+                                                uint8_t *right[], size_t n)) {
+  ctx->merge_many = merge_many;
+}
+
+#ifdef MMR_ENABLE_STATS
+void mmr_set_verify_hooks(MMRVerifyContext *ctx, const MMRHooks *hooks) {
+  ctx->hooks = *hooks;
+}
+#endif
+
+static void proof_stream_init(MMRProofStream *stream, MMRVerifyContext *ctx,
+                              uint64_t mmr_size, uint8_t leaf_hash[HASH_SIZE],
+                              uint64_t pos) {
+  stream->ctx = ctx;
+  memcpy(stream->hash, leaf_hash, HASH_SIZE);
+  stream->height = mmr_spec_pos_height_and_leaf(pos, &stream->leaf_index);
+  uint64_t leaf_count = leaf_count_from_mmr_size(mmr_size);
+  stream->peak_height = leaf_peak_height(stream->leaf_index, leaf_count);
+  /* bagging with left peaks only if the peak is the last peak */
+  stream->bagging_left =
+      stream->leaf_index < leaf_count &&
+      stream->peak_height == mmr_spec_trailing_zeros(leaf_count);
+}
+
+static void compute_proof_root(MMRVerifyContext *ctx,
+                               uint8_t root_hash[HASH_SIZE], uint64_t mmr_size,
+                               uint8_t leaf_hash[HASH_SIZE], uint64_t pos,
+                               uint8_t proof[][HASH_SIZE], size_t proof_len) {
+  MMRProofStream stream;
+  proof_stream_init(&stream, ctx, mmr_size, leaf_hash, pos);
+  mmr_proof_stream_feed(&stream, proof, proof_len);
+  memcpy(root_hash, stream.hash, HASH_SIZE);
+}
+
 /* compute root from merkle proof
  * root_hash: a 32 bytes buf to receive root hash
  * mmr_size: size of the mmr to generate this proof
@@ -401,30 +1538,505 @@ void mmr_compute_proof_root(MMRVerifyContext *ctx, uint8_t root_hash[HASH_SIZE],
                             uint64_t mmr_size, uint8_t leaf_hash[HASH_SIZE],
                             uint64_t pos, uint8_t proof[][HASH_SIZE],
                             size_t proof_len) {
-  MMRHeightPos left_peak = left_peak_height_pos(mmr_size);
-  uint64_t peaks_buf[left_peak.height];
-  struct MMRPeaks peaks = get_peaks(peaks_buf, left_peak, mmr_size);
-  // start from leaf_hash
-  memcpy(root_hash, leaf_hash, HASH_SIZE);
-  // calculate peak's merkle root
-  size_t i = compute_peak_root(ctx, root_hash, peaks, &pos, proof, proof_len);
+  TRACE_BEGIN(ctx, MMR_OP_VERIFY);
+  compute_proof_root(ctx, root_hash, mmr_size, leaf_hash, pos, proof,
+                     proof_len);
+  TRACE_END(ctx, MMR_OP_VERIFY, 0);
+}
 
-  // bagging peaks
-  // bagging with left peaks if pos is last peak(last pos)
-  int bagging_left = pos == mmr_size - 1;
-  while (i < proof_len) {
-    uint8_t *pitem = proof[i++];
-    if (bagging_left) {
-      ctx->merge(root_hash, root_hash, pitem);
+static int do_verify_proof_by_leaf_index(MMRVerifyContext *ctx,
+                                         uint8_t root_hash[HASH_SIZE],
+                                         uint64_t leaf_count,
+                                         uint8_t leaf_hash[HASH_SIZE],
+                                         uint64_t leaf_index,
+                                         uint8_t proof[][HASH_SIZE],
+                                         size_t proof_len) {
+  if (leaf_index >= leaf_count) {
+    return -1;
+  }
+  uint8_t computed_root[HASH_SIZE];
+  compute_proof_root(ctx, computed_root, mmr_spec_mmr_size(leaf_count),
+                     leaf_hash, mmr_spec_leaf_index_to_pos(leaf_index), proof,
+                     proof_len);
+  return memcmp(computed_root, root_hash, HASH_SIZE) == 0 ? 0 : -1;
+}
+
+/* verify merkle proof of a leaf by its index
+ * return 0 if the proof is valid, otherwise return -1
+ * root_hash: 32 bytes root hash of the mmr
+ * leaf_count: leaf count of the mmr to generate this proof
+ * leaf_hash: 32 bytes hash of leaf
+ * leaf_index: index of the leaf
+ * proof: an array of 32 bytes hash
+ * proof_len: length of proof
+ */
+int mmr_verify_proof_by_leaf_index(MMRVerifyContext *ctx,
+                                   uint8_t root_hash[HASH_SIZE],
+                                   uint64_t leaf_count,
+                                   uint8_t leaf_hash[HASH_SIZE],
+                                   uint64_t leaf_index,
+                                   uint8_t proof[][HASH_SIZE],
+                                   size_t proof_len) {
+  TRACE_BEGIN(ctx, MMR_OP_VERIFY);
+  int ret = do_verify_proof_by_leaf_index(ctx, root_hash, leaf_count,
+                                          leaf_hash, leaf_index, proof,
+                                          proof_len);
+  TRACE_END(ctx, MMR_OP_VERIFY, ret);
+  return ret;
+}
+
+/* start to compute root from merkle proof item by item
+ * the proof is fed in chunks of any size as it arrives, items are merged
+ * where they are and never buffered, so the chunks can point into a receive
+ * buffer. feeding a whole proof is the same as mmr_compute_proof_root.
+ * stream: the state, at most a few words and one hash
+ * mmr_size: size of the mmr to generate this proof
+ * leaf_hash: 32 bytes hash of leaf
+ * pos: position of the leaf
+ */
+void mmr_proof_stream_init(MMRProofStream *stream, MMRVerifyContext *ctx,
+                           uint64_t mmr_size, uint8_t leaf_hash[HASH_SIZE],
+                           uint64_t pos) {
+  /* the trace ends at mmr_proof_stream_finish */
+  TRACE_BEGIN(ctx, MMR_OP_VERIFY);
+  proof_stream_init(stream, ctx, mmr_size, leaf_hash, pos);
+}
+
+/* feed the next items of proof
+ * items: an array of 32 bytes hash, the next n items of proof
+ * n: length of items, may be 0
+ */
+void mmr_proof_stream_feed(MMRProofStream *stream, uint8_t items[][HASH_SIZE],
+                           size_t n) {
+  MMRVerifyContext *ctx = stream->ctx;
+  for (size_t i = 0; i < n; i++) {
+    uint8_t *pitem = items[i];
+    if (stream->height < stream->peak_height) {
+      // verify merkle path
+      if ((stream->leaf_index >> stream->height) & 1) {
+        // we are on right branch
+        MERGE(ctx, stream->hash, pitem, stream->hash);
+      } else {
+        // we are on left branch
+        MERGE(ctx, stream->hash, stream->hash, pitem);
+      }
+      stream->height += 1;
+    } else if (stream->bagging_left) {
+      MERGE(ctx, stream->hash, stream->hash, pitem);
     } else {
       // we are not in the last peak, so bag with right peaks first
       // notice the right peaks is already bagging into one hash in proof,
       // so after this merge, the remain proofs are always left peaks.
-      bagging_left = 1;
-      ctx->merge(root_hash, pitem, root_hash);
+      stream->bagging_left = 1;
+      MERGE(ctx, stream->hash, pitem, stream->hash);
+    }
+  }
+}
+
+/* finish a stream after the last item of proof is fed
+ * root_hash: a 32 bytes buf to receive root hash
+ */
+void mmr_proof_stream_finish(MMRProofStream *stream,
+                             uint8_t root_hash[HASH_SIZE]) {
+  memcpy(root_hash, stream->hash, HASH_SIZE);
+  TRACE_END(stream->ctx, MMR_OP_VERIFY, 0);
+}
+
+/* compute root from merkle proof of multiple leaves
+ * see mmr_gen_batch_proof for the layout of proof.
+ * return -1 if positions or proof are invalid
+ * root_hash: a 32 bytes buf to receive root hash
+ * mmr_size: size of the mmr to generate this proof
+ * positions: positions of leaves, sorted ascending without duplicates
+ * leaves: 32 bytes hashes of leaves, used as working buf and overwritten
+ * n: length of positions and leaves
+ * proof: an array of 32 bytes hash
+ * proof_len: length of proof
+ */
+static int do_compute_batch_proof_root(MMRVerifyContext *ctx,
+                                       uint8_t root_hash[HASH_SIZE],
+                                       uint64_t mmr_size,
+                                       const uint64_t positions[],
+                                       uint8_t leaves[][HASH_SIZE], size_t n,
+                                       uint8_t proof[][HASH_SIZE],
+                                       size_t proof_len) {
+  if (check_leaf_positions(mmr_size, positions, n) != 0) {
+    return -1;
+  }
+  uint64_t leaf_count = leaf_count_from_mmr_size(mmr_size);
+  uint64_t last_leaf = ancestor_index(positions, NULL, n - 1, 0);
+  /* hashes of peaks, the last one may be the bagged rhs peaks */
+  uint8_t *peak_hashes[MMR_MAX_PEAKS];
+  size_t peaks_len = 0;
+  size_t proof_i = 0;
+  size_t i = 0;
+  uint64_t peak_start = 0;
+  while (peak_start < leaf_count) {
+    uint32_t peak_height = simple_log2(leaf_count ^ peak_start);
+    uint64_t peak_end = peak_start + ((uint64_t)1 << peak_height);
+    /* leaves are before the position of the first leaf of the next peak */
+    uint64_t end_pos = mmr_spec_leaf_index_to_pos(peak_end);
+    size_t first = i;
+    while (i < n && positions[i] < end_pos) {
+      i++;
+    }
+    if (first < i) {
+      if (compute_peak_batch_root(ctx, &positions[first], &leaves[first],
+                                  i - first, peak_height, proof, &proof_i,
+                                  proof_len) != 0) {
+        return -1;
+      }
+      peak_hashes[peaks_len++] = leaves[first];
+    } else {
+      if (proof_i >= proof_len) {
+        return -1;
+      }
+      peak_hashes[peaks_len++] = proof[proof_i++];
+      if (peak_start > last_leaf) {
+        /* bagged rhs peaks */
+        break;
+      }
+    }
+    peak_start = peak_end;
+  }
+  if (proof_i != proof_len) {
+    return -1;
+  }
+  /* bagging peaks from right to left */
+  STATS_ADD(ctx, peaks_bagged, peaks_len);
+  memcpy(root_hash, peak_hashes[--peaks_len], HASH_SIZE);
+  while (peaks_len > 0) {
+    MERGE(ctx, root_hash, root_hash, peak_hashes[--peaks_len]);
+  }
+  return 0;
+}
+
+int mmr_compute_batch_proof_root(MMRVerifyContext *ctx,
+                                 uint8_t root_hash[HASH_SIZE],
+                                 uint64_t mmr_size, const uint64_t positions[],
+                                 uint8_t leaves[][HASH_SIZE], size_t n,
+                                 uint8_t proof[][HASH_SIZE],
+                                 size_t proof_len) {
+  TRACE_BEGIN(ctx, MMR_OP_VERIFY_BATCH);
+  int ret = do_compute_batch_proof_root(ctx, root_hash, mmr_size, positions,
+                                        leaves, n, proof, proof_len);
+  TRACE_END(ctx, MMR_OP_VERIFY_BATCH, ret);
+  return ret;
+}
+
+/* verify merkle proof of multiple leaves
+ * return 0 if the proof is valid, otherwise return -1
+ * root_hash: 32 bytes root hash of the mmr
+ * see mmr_compute_batch_proof_root for other arguments
+ */
+int mmr_verify_batch_proof(MMRVerifyContext *ctx, uint8_t root_hash[HASH_SIZE],
+                           uint64_t mmr_size, const uint64_t positions[],
+                           uint8_t leaves[][HASH_SIZE], size_t n,
+                           uint8_t proof[][HASH_SIZE], size_t proof_len) {
+  uint8_t computed_root[HASH_SIZE];
+  if (mmr_compute_batch_proof_root(ctx, computed_root, mmr_size, positions,
+                                   leaves, n, proof, proof_len) != 0) {
+    return -1;
+  }
+  return memcmp(computed_root, root_hash, HASH_SIZE) == 0 ? 0 : -1;
+}
+
+static int do_compute_range_proof_root(MMRVerifyContext *ctx,
+                                       uint8_t root_hash[HASH_SIZE],
+                                       uint64_t mmr_size, uint64_t start,
+                                       uint8_t leaves[][HASH_SIZE], size_t n,
+                                       uint8_t proof[][HASH_SIZE],
+                                       size_t proof_len) {
+  uint64_t leaf_count = leaf_count_from_mmr_size(mmr_size);
+  if (mmr_spec_mmr_size(leaf_count) != mmr_size || n == 0 ||
+      start >= leaf_count || n > leaf_count - start) {
+    return -1;
+  }
+  uint64_t end = start + n;
+  /* hashes of peaks, the last one may be the bagged rhs peaks */
+  uint8_t *peak_hashes[MMR_MAX_PEAKS];
+  size_t peaks_len = 0;
+  size_t proof_i = 0;
+  uint64_t peak_start = 0;
+  while (peak_start < leaf_count) {
+    uint32_t peak_height = simple_log2(leaf_count ^ peak_start);
+    uint64_t peak_end = peak_start + ((uint64_t)1 << peak_height);
+    if (peak_end > start && peak_start < end) {
+      uint64_t first = start > peak_start ? start : peak_start;
+      uint64_t last = end < peak_end ? end : peak_end;
+      if (compute_peak_range_root(ctx, &leaves[first - start], first, last,
+                                  peak_height, proof, &proof_i,
+                                  proof_len) != 0) {
+        return -1;
+      }
+      peak_hashes[peaks_len++] = leaves[first - start];
+    } else {
+      if (proof_i >= proof_len) {
+        return -1;
+      }
+      peak_hashes[peaks_len++] = proof[proof_i++];
+      if (peak_start >= end) {
+        /* bagged rhs peaks */
+        break;
+      }
+    }
+    peak_start = peak_end;
+  }
+  if (proof_i != proof_len) {
+    return -1;
+  }
+  /* bagging peaks from right to left */
+  STATS_ADD(ctx, peaks_bagged, peaks_len);
+  memcpy(root_hash, peak_hashes[--peaks_len], HASH_SIZE);
+  while (peaks_len > 0) {
+    MERGE(ctx, root_hash, root_hash, peak_hashes[--peaks_len]);
+  }
+  return 0;
+}
+
+/* compute root from merkle proof of contiguous leaves
+ * see mmr_gen_range_proof for the layout of proof. the leaves are merged
+ * height by height in place, each node is merged once.
+ * return -1 if the range or proof are invalid
+ * root_hash: a 32 bytes buf to receive root hash
+ * mmr_size: size of the mmr to generate this proof
+ * start: leaf index of leaves[0]
+ * leaves: 32 bytes hashes of leaves, used as working buf and overwritten
+ * n: length of leaves
+ * proof: an array of 32 bytes hash
+ * proof_len: length of proof
+ */
+int mmr_compute_range_proof_root(MMRVerifyContext *ctx,
+                                 uint8_t root_hash[HASH_SIZE],
+                                 uint64_t mmr_size, uint64_t start,
+                                 uint8_t leaves[][HASH_SIZE], size_t n,
+                                 uint8_t proof[][HASH_SIZE],
+                                 size_t proof_len) {
+  TRACE_BEGIN(ctx, MMR_OP_VERIFY_RANGE);
+  int ret = do_compute_range_proof_root(ctx, root_hash, mmr_size, start,
+                                        leaves, n, proof, proof_len);
+  TRACE_END(ctx, MMR_OP_VERIFY_RANGE, ret);
+  return ret;
+}
+
+/* verify merkle proof of contiguous leaves
+ * return 0 if the proof is valid, otherwise return -1
+ * root_hash: 32 bytes root hash of the mmr
+ * see mmr_compute_range_proof_root for other arguments
+ */
+int mmr_verify_range_proof(MMRVerifyContext *ctx, uint8_t root_hash[HASH_SIZE],
+                           uint64_t mmr_size, uint64_t start,
+                           uint8_t leaves[][HASH_SIZE], size_t n,
+                           uint8_t proof[][HASH_SIZE], size_t proof_len) {
+  uint8_t computed_root[HASH_SIZE];
+  if (mmr_compute_range_proof_root(ctx, computed_root, mmr_size, start, leaves,
+                                   n, proof, proof_len) != 0) {
+    return -1;
+  }
+  return memcmp(computed_root, root_hash, HASH_SIZE) == 0 ? 0 : -1;
+}
+
+/* verify proof of mmr_gen_consistency_proof
+ * the old peaks are bagged into old_root, then the last old peak is merged
+ * to its peak in new_size and bagged with the other peaks into new_root.
+ */
+static int do_verify_consistency_proof(MMRVerifyContext *ctx,
+                                       uint8_t old_root[HASH_SIZE],
+                                       uint64_t old_size,
+                                       uint8_t new_root[HASH_SIZE],
+                                       uint64_t new_size,
+                                       uint8_t proof[][HASH_SIZE],
+                                       size_t proof_len) {
+  if (old_size == 0 || old_size > new_size ||
+      mmr_size_to_leaf_count(old_size) == UINT64_MAX ||
+      mmr_size_to_leaf_count(new_size) == UINT64_MAX) {
+    return -1;
+  }
+  uint64_t old_peaks[MMR_MAX_PEAKS];
+  size_t old_len = mmr_peaks_from_size(old_size, old_peaks);
+  if (proof_len < old_len) {
+    return -1;
+  }
+  uint8_t hash[HASH_SIZE];
+  memcpy(hash, proof[old_len - 1], HASH_SIZE);
+  for (size_t i = old_len - 1; i > 0; i--) {
+    MERGE(ctx, hash, hash, proof[i - 1]);
+  }
+  if (memcmp(hash, old_root, HASH_SIZE) != 0) {
+    return -1;
+  }
+  /* the left siblings of the path are old peaks, the others are in proof */
+  uint64_t pos = old_peaks[old_len - 1];
+  uint64_t peak_pos = pos;
+  uint64_t sib_pos[MMR_MAX_PEAKS];
+  size_t sib_len;
+  if (proof_path(new_size, &peak_pos, sib_pos, MMR_MAX_PEAKS, &sib_len) != 0) {
+    return -1;
+  }
+  memcpy(hash, proof[old_len - 1], HASH_SIZE);
+  size_t next = old_len;
+  for (size_t i = 0; i < sib_len; i++) {
+    uint8_t *item;
+    if (sib_pos[i] < old_size) {
+      size_t p = 0;
+      while (p < old_len && old_peaks[p] != sib_pos[i]) {
+        p++;
+      }
+      if (p == old_len) {
+        return -1;
+      }
+      item = proof[p];
+    } else {
+      if (next >= proof_len) {
+        return -1;
+      }
+      item = proof[next++];
+    }
+    if (sib_pos[i] < pos) {
+      // we are on right branch
+      MERGE(ctx, hash, item, hash);
+      pos += 1;
+    } else {
+      MERGE(ctx, hash, hash, item);
+      pos = sib_pos[i] + 1;
+    }
+  }
+  /* bagging with the rhs peaks, then the left peaks which are old peaks */
+  uint64_t peaks[MMR_MAX_PEAKS];
+  size_t peaks_len = mmr_peaks_from_size(new_size, peaks);
+  size_t peak = 0;
+  while (peak < peaks_len && peaks[peak] != pos) {
+    peak++;
+  }
+  if (peak == peaks_len) {
+    return -1;
+  }
+  if (peak + 1 < peaks_len) {
+    if (next >= proof_len) {
+      return -1;
+    }
+    MERGE(ctx, hash, proof[next++], hash);
+  }
+  if (next != proof_len || peak >= old_len) {
+    return -1;
+  }
+  for (size_t i = peak; i > 0; i--) {
+    MERGE(ctx, hash, hash, proof[i - 1]);
+  }
+  return memcmp(hash, new_root, HASH_SIZE) == 0 ? 0 : -1;
+}
+
+int mmr_verify_consistency_proof(MMRVerifyContext *ctx,
+                                 uint8_t old_root[HASH_SIZE],
+                                 uint64_t old_size,
+                                 uint8_t new_root[HASH_SIZE],
+                                 uint64_t new_size,
+                                 uint8_t proof[][HASH_SIZE],
+                                 size_t proof_len) {
+  TRACE_BEGIN(ctx, MMR_OP_VERIFY_CONSISTENCY);
+  int ret = do_verify_consistency_proof(ctx, old_root, old_size, new_root,
+                                        new_size, proof, proof_len);
+  TRACE_END(ctx, MMR_OP_VERIFY_CONSISTENCY, ret);
+  return ret;
+}
+
+/* verify independent merkle proofs against the same root
+ * up to MMR_MERGE_MANY_MAX proofs are verified together, each round merges
+ * the next node of every unfinished proof with one merge_many call.
+ */
+static int do_verify_many(MMRVerifyContext *ctx, uint8_t root_hash[HASH_SIZE],
+                          uint64_t mmr_size, const MMRVerifyItem items[],
+                          size_t n, uint8_t results[]) {
+  memset(results, 0, (n + 7) / 8);
+  uint64_t leaf_count = leaf_count_from_mmr_size(mmr_size);
+  if (mmr_size == 0 || mmr_spec_mmr_size(leaf_count) != mmr_size) {
+    return n == 0 ? 0 : -1;
+  }
+  /* the lowest mountain is the last one, it is bagged with left peaks only */
+  uint32_t last_peak_height = mmr_spec_trailing_zeros(leaf_count);
+  uint8_t hashes[MMR_MERGE_MANY_MAX][HASH_SIZE];
+  uint64_t leaf_index[MMR_MERGE_MANY_MAX];
+  uint32_t height[MMR_MERGE_MANY_MAX];
+  uint32_t peak_height[MMR_MERGE_MANY_MAX];
+  /* 0 on the merkle path, 1 before the rhs bag, 2 with left peaks */
+  int phase[MMR_MERGE_MANY_MAX];
+  size_t proof_index[MMR_MERGE_MANY_MAX];
+  uint8_t *dst[MMR_MERGE_MANY_MAX];
+  uint8_t *left[MMR_MERGE_MANY_MAX];
+  uint8_t *right[MMR_MERGE_MANY_MAX];
+  size_t valid = 0;
+  for (size_t start = 0; start < n; start += MMR_MERGE_MANY_MAX) {
+    size_t lanes = n - start < MMR_MERGE_MANY_MAX ? n - start
+                                                  : MMR_MERGE_MANY_MAX;
+    for (size_t l = 0; l < lanes; l++) {
+      const MMRVerifyItem *item = &items[start + l];
+      memcpy(hashes[l], item->leaf_hash, HASH_SIZE);
+      height[l] = mmr_spec_pos_height_and_leaf(item->pos, &leaf_index[l]);
+      peak_height[l] = leaf_index[l] < leaf_count
+                           ? leaf_peak_height(leaf_index[l], leaf_count)
+                           : 0;
+      phase[l] = 0;
+      proof_index[l] = 0;
+    }
+    for (;;) {
+      size_t m = 0;
+      for (size_t l = 0; l < lanes; l++) {
+        const MMRVerifyItem *item = &items[start + l];
+        if (proof_index[l] >= item->proof_len) {
+          continue;
+        }
+        uint8_t *pitem = item->proof[proof_index[l]++];
+        dst[m] = hashes[l];
+        if (phase[l] == 0 && height[l] < peak_height[l]) {
+          if ((leaf_index[l] >> height[l]) & 1) {
+            // we are on right branch
+            left[m] = pitem;
+            right[m] = hashes[l];
+          } else {
+            left[m] = hashes[l];
+            right[m] = pitem;
+          }
+          height[l]++;
+        } else {
+          if (phase[l] == 0) {
+            phase[l] = peak_height[l] == last_peak_height ? 2 : 1;
+          }
+          if (phase[l] == 2) {
+            left[m] = hashes[l];
+            right[m] = pitem;
+          } else {
+            // bag with the right peaks, the remain proofs are left peaks
+            phase[l] = 2;
+            left[m] = pitem;
+            right[m] = hashes[l];
+          }
+        }
+        m++;
+      }
+      if (m == 0) {
+        break;
+      }
+      MERGE_NODES(ctx, dst, left, right, m);
+    }
+    for (size_t l = 0; l < lanes; l++) {
+      size_t i = start + l;
+      if (items[i].pos < mmr_size &&
+          memcmp(hashes[l], root_hash, HASH_SIZE) == 0) {
+        results[i / 8] |= (uint8_t)(1 << (i % 8));
+        valid++;
+      }
     }
   }
-  return;
+  return valid == n ? 0 : -1;
+}
+
+int mmr_verify_many(MMRVerifyContext *ctx, uint8_t root_hash[HASH_SIZE],
+                    uint64_t mmr_size, const MMRVerifyItem items[], size_t n,
+                    uint8_t results[]) {
+  TRACE_BEGIN(ctx, MMR_OP_VERIFY_MANY);
+  int ret = do_verify_many(ctx, root_hash, mmr_size, items, n, results);
+  TRACE_END(ctx, MMR_OP_VERIFY_MANY, ret);
+  return ret;
 }
 
 /* compute a new root from last leaf's merkle proof
@@ -441,7 +2053,7 @@ void mmr_compute_proof_root(MMRVerifyContext *ctx, uint8_t root_hash[HASH_SIZE],
  * new_leaf_hash: 32 bytes hash of the next leaf
  * new_leaf_pos: the position and mmr_size of the new leaf.
  */
-void mmr_compute_new_root_from_last_leaf_proof(
+static void do_compute_new_root_from_last_leaf_proof(
     MMRVerifyContext *ctx, uint8_t root_hash[HASH_SIZE], uint64_t mmr_size,
     uint8_t leaf_hash[HASH_SIZE], uint64_t leaf_pos, uint8_t proof[][HASH_SIZE],
     size_t proof_len, uint8_t new_leaf_hash[HASH_SIZE],
@@ -450,38 +2062,351 @@ void mmr_compute_new_root_from_last_leaf_proof(
     memcpy(root_hash, new_leaf_hash, HASH_SIZE);
     return;
   }
-  uint32_t pos_height = pos_height_in_tree(new_leaf_pos.pos);
-  uint32_t next_height = pos_height_in_tree(new_leaf_pos.pos + 1);
-  if (next_height > pos_height) {
-    /* new leaf on right branch */
-    uint8_t new_proof[proof_len + 1][HASH_SIZE];
-    /* set peak's root and remain proof as new_proof */
-    memcpy(new_proof[0], leaf_hash, HASH_SIZE);
-    for (int i = 0; i < proof_len; i++) {
-      memcpy(new_proof[i + 1], proof[i], HASH_SIZE);
-    }
-    mmr_compute_proof_root(ctx, root_hash, new_leaf_pos.mmr_size, new_leaf_hash,
-                           new_leaf_pos.pos, new_proof, proof_len + 1);
+  uint64_t new_leaf_index;
+  mmr_spec_pos_height_and_leaf(new_leaf_pos.pos, &new_leaf_index);
+  if (new_leaf_index & 1) {
+    /* new leaf on right branch
+     * the last leaf is its sibling, and the proof of the last leaf is the
+     * rest of the new proof, so compute from their parent with the proof. */
+    uint8_t parent[HASH_SIZE];
+    MERGE(ctx, parent, leaf_hash, new_leaf_hash);
+    compute_proof_root(ctx, root_hash, new_leaf_pos.mmr_size, parent,
+                       new_leaf_pos.pos + 1, proof, proof_len);
   } else {
     /* new leaf on left branch
-     * 1. calculate peak's root from last leaf.
-     * 2. use peak's root and remain proof as new_proof, then compute_proof_root
+     * the new leaf is the last peak, so the root is the new leaf bagged with
+     * the peak of the last leaf then the remain proof, the left peaks.
      */
     assert(mmr_size + 1 == new_leaf_pos.mmr_size);
-    MMRHeightPos left_peak = left_peak_height_pos(mmr_size);
-    uint64_t peaks_buf[left_peak.height];
-    struct MMRPeaks peaks = get_peaks(peaks_buf, left_peak, mmr_size);
-    // start from leaf_hash
-    memcpy(root_hash, leaf_hash, HASH_SIZE);
+    uint8_t peak[HASH_SIZE];
+    memcpy(peak, leaf_hash, HASH_SIZE);
     size_t i =
-        compute_peak_root(ctx, root_hash, peaks, &leaf_pos, proof, proof_len);
-    /* set peak's root and remain proof as new_proof */
-    memcpy(proof[0], root_hash, HASH_SIZE);
-    for (int j = i; j < proof_len; j++) {
-      memcpy(proof[j - i + 1], proof[j], HASH_SIZE);
+        compute_peak_root(ctx, peak, mmr_size, &leaf_pos, proof, proof_len);
+    memcpy(root_hash, new_leaf_hash, HASH_SIZE);
+    MERGE(ctx, root_hash, root_hash, peak);
+    for (; i < proof_len; i++) {
+      MERGE(ctx, root_hash, root_hash, proof[i]);
     }
-    proof_len = proof_len + 1 - i;
-    mmr_compute_proof_root(ctx, root_hash, new_leaf_pos.mmr_size, new_leaf_hash,
-                           new_leaf_pos.pos, proof, proof_len);
   }
 }
+
+void mmr_compute_new_root_from_last_leaf_proof(
+    MMRVerifyContext *ctx, uint8_t root_hash[HASH_SIZE], uint64_t mmr_size,
+    uint8_t leaf_hash[HASH_SIZE], uint64_t leaf_pos, uint8_t proof[][HASH_SIZE],
+    size_t proof_len, uint8_t new_leaf_hash[HASH_SIZE],
+    MMRSizePos new_leaf_pos) {
+  TRACE_BEGIN(ctx, MMR_OP_NEW_ROOT);
+  do_compute_new_root_from_last_leaf_proof(ctx, root_hash, mmr_size, leaf_hash,
+                                           leaf_pos, proof, proof_len,
+                                           new_leaf_hash, new_leaf_pos);
+  TRACE_END(ctx, MMR_OP_NEW_ROOT, 0);
+}
+
+/* compute the new root and the proof of the new leaf from the last leaf's
+ * proof in one pass, see mmr.h.
+ */
+static int do_compute_new_root_and_proof(MMRVerifyContext *ctx,
+                                        uint8_t root_hash[HASH_SIZE],
+                                        uint64_t *mmr_size,
+                                        uint8_t leaf_hash[HASH_SIZE],
+                                        uint8_t proof[][HASH_SIZE],
+                                        size_t *proof_len,
+                                        size_t proof_max_len,
+                                        uint8_t new_leaf_hash[HASH_SIZE]) {
+  uint64_t leaf_count = mmr_size_to_leaf_count(*mmr_size);
+  if (leaf_count == UINT64_MAX) {
+    return -1;
+  }
+  /* the last leaf is the rightmost of the last peak, its siblings are on the
+   * left, then the left peaks from right to left */
+  uint32_t siblings = leaf_count == 0 ? 0 : mmr_spec_trailing_zeros(leaf_count);
+  uint32_t left_peaks =
+      leaf_count == 0 ? 0 : mmr_spec_count_ones(leaf_count) - 1;
+  if (*proof_len != siblings + left_peaks) {
+    return -1;
+  }
+  if (leaf_count & 1) {
+    /* the new leaf is on right branch, the last leaf is its sibling and the
+     * left peaks merged with them are the siblings of the next heights */
+    if (*proof_len >= proof_max_len) {
+      return -1;
+    }
+    memmove(proof[1], proof[0], *proof_len * HASH_SIZE);
+    memcpy(proof[0], leaf_hash, HASH_SIZE);
+    *proof_len += 1;
+    uint32_t height = mmr_spec_trailing_zeros(leaf_count + 1);
+    MERGE(ctx, root_hash, proof[0], new_leaf_hash);
+    for (size_t i = 1; i < *proof_len; i++) {
+      if (i < height) {
+        MERGE(ctx, root_hash, proof[i], root_hash);
+      } else {
+        MERGE(ctx, root_hash, root_hash, proof[i]);
+      }
+    }
+  } else {
+    /* the new leaf is the last peak, the peak of the last leaf becomes its
+     * first left peak */
+    if (siblings > 0) {
+      uint8_t *peak = proof[0];
+      MERGE(ctx, peak, proof[0], leaf_hash);
+      for (uint32_t i = 1; i < siblings; i++) {
+        MERGE(ctx, peak, proof[i], peak);
+      }
+      memmove(proof[1], proof[siblings], left_peaks * HASH_SIZE);
+      *proof_len = left_peaks + 1;
+    }
+    memcpy(root_hash, new_leaf_hash, HASH_SIZE);
+    for (size_t i = 0; i < *proof_len; i++) {
+      MERGE(ctx, root_hash, root_hash, proof[i]);
+    }
+  }
+  *mmr_size = mmr_spec_mmr_size(leaf_count + 1);
+  return 0;
+}
+
+int mmr_compute_new_root_and_proof(MMRVerifyContext *ctx,
+                                   uint8_t root_hash[HASH_SIZE],
+                                   uint64_t *mmr_size,
+                                   uint8_t leaf_hash[HASH_SIZE],
+                                   uint8_t proof[][HASH_SIZE],
+                                   size_t *proof_len, size_t proof_max_len,
+                                   uint8_t new_leaf_hash[HASH_SIZE]) {
+  TRACE_BEGIN(ctx, MMR_OP_NEW_ROOT);
+  int ret = do_compute_new_root_and_proof(ctx, root_hash, mmr_size, leaf_hash,
+                                          proof, proof_len, proof_max_len,
+                                          new_leaf_hash);
+  TRACE_END(ctx, MMR_OP_NEW_ROOT, ret);
+  return ret;
+}
+
+/* Accumulator API */
+
+/* Initialize an empty MMRAccumulator
+ * merge: a function to merge left node hash and right node hash
+ */
+int mmr_initialize_accumulator(MMRAccumulator *acc,
+                               void(merge)(uint8_t dst[HASH_SIZE],
+                                           uint8_t right[HASH_SIZE],
+                                           uint8_t left[HASH_SIZE])) {
+  acc->leaf_count = 0;
+  acc->merge = merge;
+  acc->merge_many = NULL;
+  return 0;
+}
+
+/* set a multi-lane merge function for MMRAccumulator
+ * see mmr_set_merge_many
+ */
+void mmr_acc_set_merge_many(MMRAccumulator *acc,
+                            void(merge_many)(uint8_t *dst[], uint8_t *left[],
+                                             uint8_t *right[], size_t n)) {
+  acc->merge_many = merge_many;
+}
+
+/* push the root of a complete subtree of height,
+ * leaf_count must be a multiple of 2^height. the new peak merges with the
+ * lowest peaks, one for each trailing one bit of leaf_count >> height.
+ */
+static void acc_push_peak(MMRAccumulator *acc, uint8_t node[HASH_SIZE],
+                          uint32_t height) {
+  size_t len = mmr_spec_count_ones(acc->leaf_count);
+  for (uint64_t count = acc->leaf_count >> height; count & 1; count >>= 1) {
+    len--;
+    acc->merge(node, acc->peaks[len], node);
+  }
+  memcpy(acc->peaks[len], node, HASH_SIZE);
+  acc->leaf_count += (uint64_t)1 << height;
+}
+
+/* push a leaf into accumulator
+ * leaf: a 32 bytes hash represented leaf
+ */
+int mmr_acc_push(MMRAccumulator *acc, uint8_t leaf[HASH_SIZE]) {
+  if (acc->leaf_count == UINT64_MAX) {
+    return -1;
+  }
+  uint8_t node[HASH_SIZE];
+  memcpy(node, leaf, HASH_SIZE);
+  acc_push_peak(acc, node, 0);
+  return 0;
+}
+
+/* push leaves into accumulator
+ * leaves: an array of 32 bytes hash represented leaves
+ * n: length of leaves
+ */
+int mmr_acc_push_batch(MMRAccumulator *acc, uint8_t leaves[][HASH_SIZE],
+                       size_t n) {
+  if (n > UINT64_MAX - acc->leaf_count) {
+    return -1;
+  }
+  /* build complete subtrees of up to 2 * MMR_MERGE_MANY_MAX leaves height by
+   * height, each height is one merge_many call. */
+  uint8_t bufs[2][MMR_MERGE_MANY_MAX][HASH_SIZE];
+  uint8_t *dst[MMR_MERGE_MANY_MAX];
+  uint8_t *left[MMR_MERGE_MANY_MAX];
+  uint8_t *right[MMR_MERGE_MANY_MAX];
+  size_t i = 0;
+  while (i < n) {
+    /* the subtree must start at a multiple of its leaves */
+    uint32_t height = 0;
+    while (height < simple_log2(2 * MMR_MERGE_MANY_MAX) &&
+           ((acc->leaf_count >> height) & 1) == 0 &&
+           ((size_t)2 << height) <= n - i) {
+      height++;
+    }
+    if (height == 0) {
+      mmr_acc_push(acc, leaves[i++]);
+      continue;
+    }
+    size_t lanes = (size_t)1 << (height - 1);
+    for (size_t j = 0; j < lanes; j++) {
+      dst[j] = bufs[0][j];
+      left[j] = leaves[i + 2 * j];
+      right[j] = leaves[i + 2 * j + 1];
+    }
+    merge_nodes(acc->merge, acc->merge_many, dst, left, right, lanes);
+    int cur = 0;
+    while (lanes > 1) {
+      lanes >>= 1;
+      for (size_t j = 0; j < lanes; j++) {
+        dst[j] = bufs[cur ^ 1][j];
+        left[j] = bufs[cur][2 * j];
+        right[j] = bufs[cur][2 * j + 1];
+      }
+      merge_nodes(acc->merge, acc->merge_many, dst, left, right, lanes);
+      cur ^= 1;
+    }
+    acc_push_peak(acc, bufs[cur][0], height);
+    i += (size_t)1 << height;
+  }
+  return 0;
+}
+
+/* get merkle root of accumulator,
+ * return -1 if accumulator is empty
+ * dst: a 32 bytes buf to receive merkle root
+ */
+int mmr_acc_get_root(MMRAccumulator *acc, uint8_t dst[HASH_SIZE]) {
+  size_t len = mmr_spec_count_ones(acc->leaf_count);
+  if (len == 0) {
+    return -1;
+  }
+  memcpy(dst, acc->peaks[--len], HASH_SIZE);
+  while (len > 0) {
+    acc->merge(dst, dst, acc->peaks[--len]);
+  }
+  return 0;
+}
+
+/* export the state of accumulator
+ * the state is the 8 bytes little endian leaf count followed by the peaks.
+ * return -1 if buf is not enough to receive the state
+ * buf: a buf to receive the state
+ * buf_len: length of buf, will be set to the actual len of state.
+ */
+int mmr_acc_export(MMRAccumulator *acc, uint8_t *buf, size_t *buf_len) {
+  size_t len = mmr_spec_count_ones(acc->leaf_count);
+  size_t state_len = 8 + len * HASH_SIZE;
+  if (*buf_len < state_len) {
+    return -1;
+  }
+  store_le64(buf, acc->leaf_count);
+  memcpy(buf + 8, acc->peaks, len * HASH_SIZE);
+  *buf_len = state_len;
+  return 0;
+}
+
+/* import a state exported by mmr_acc_export
+ * return -1 if the state is invalid, accumulator is not changed.
+ * buf: the state
+ * buf_len: length of the state
+ */
+int mmr_acc_import(MMRAccumulator *acc, const uint8_t *buf, size_t buf_len) {
+  if (buf_len < 8) {
+    return -1;
+  }
+  uint64_t leaf_count = load_le64(buf);
+  size_t len = mmr_spec_count_ones(leaf_count);
+  if (buf_len != 8 + len * HASH_SIZE) {
+    return -1;
+  }
+  acc->leaf_count = leaf_count;
+  memcpy(acc->peaks, buf + 8, len * HASH_SIZE);
+  return 0;
+}
+
+/* Root tracker API */
+
+/* Initialize a root tracker from the merkle proof of the last leaf
+ * the peaks are recovered from the proof and bagged, the tracker is only
+ * initialized if the root equals to root_hash.
+ * return -1 if mmr_size is invalid or the proof does not match root_hash
+ * merge: a function to merge left node hash and right node hash
+ * mmr_size: size of the mmr to generate the proof, 0 for an empty tracker
+ * leaf_hash: 32 bytes hash of the last leaf
+ * proof: an array of 32 bytes hash, the proof of the last leaf
+ * proof_len: length of proof
+ * root_hash: 32 bytes trusted root of the mmr
+ */
+int mmr_initialize_root_tracker(MMRRootTracker *tracker,
+                                void(merge)(uint8_t dst[HASH_SIZE],
+                                            uint8_t right[HASH_SIZE],
+                                            uint8_t left[HASH_SIZE]),
+                                uint64_t mmr_size, uint8_t leaf_hash[HASH_SIZE],
+                                uint8_t proof[][HASH_SIZE], size_t proof_len,
+                                uint8_t root_hash[HASH_SIZE]) {
+  MMRAccumulator *acc = &tracker->acc;
+  mmr_initialize_accumulator(acc, merge);
+  if (mmr_size == 0) {
+    return proof_len == 0 ? 0 : -1;
+  }
+  uint64_t leaf_count = leaf_count_from_mmr_size(mmr_size);
+  if (mmr_spec_mmr_size(leaf_count) != mmr_size) {
+    return -1;
+  }
+  /* the last leaf is a right child up to the peak of the last mountain, then
+   * the proof has the left peaks from right to left, no rhs peaks. */
+  uint32_t height = mmr_spec_trailing_zeros(leaf_count);
+  size_t len = mmr_spec_count_ones(leaf_count);
+  if (proof_len != height + len - 1) {
+    return -1;
+  }
+  uint8_t *peak = acc->peaks[len - 1];
+  memcpy(peak, leaf_hash, HASH_SIZE);
+  for (uint32_t i = 0; i < height; i++) {
+    merge(peak, proof[i], peak);
+  }
+  for (size_t i = 0; i + 1 < len; i++) {
+    memcpy(acc->peaks[len - 2 - i], proof[height + i], HASH_SIZE);
+  }
+  acc->leaf_count = leaf_count;
+  mmr_acc_get_root(acc, tracker->root);
+  if (memcmp(tracker->root, root_hash, HASH_SIZE) != 0) {
+    acc->leaf_count = 0;
+    return -1;
+  }
+  return 0;
+}
+
+/* push a leaf and update the root
+ * leaf: a 32 bytes hash represented leaf
+ */
+int mmr_tracker_push(MMRRootTracker *tracker, uint8_t leaf[HASH_SIZE]) {
+  if (mmr_acc_push(&tracker->acc, leaf) != 0) {
+    return -1;
+  }
+  return mmr_acc_get_root(&tracker->acc, tracker->root);
+}
+
+/* get the current root of tracker,
+ * return -1 if tracker is empty
+ * dst: a 32 bytes buf to receive merkle root
+ */
+int mmr_tracker_get_root(MMRRootTracker *tracker, uint8_t dst[HASH_SIZE]) {
+  if (tracker->acc.leaf_count == 0) {
+    return -1;
+  }
+  memcpy(dst, tracker->root, HASH_SIZE);
+  return 0;
+}
@@ -12,29 +12,185 @@
 #include "stdint.h"
 #include "stddef.h"
 #define HASH_SIZE 32
+/* max number of merges passed to a single merge_many call */
+#define MMR_MERGE_MANY_MAX 64
+/* max number of peaks, one peak for each bit of the leaf count */
+#define MMR_MAX_PEAKS 64
 
 /* types */
 
+/* storage backend of mmr nodes,
+ * callbacks return 0 on success, data is passed to every callback.
+ */
+typedef struct MMRStore {
+  void *data;
+  /* read the node at pos into dst */
+  int (*get)(void *data, uint64_t pos, uint8_t dst[HASH_SIZE]);
+  /* append a node, pos is the next position of mmr.
+   * after a failed push the nodes are appended again from mmr_size,
+   * so the store should accept a pos lower than its end. */
+  int (*append)(void *data, uint64_t pos, uint8_t elem[HASH_SIZE]);
+  /* optional, read n nodes at once, NULL to use get */
+  int (*batch_get)(void *data, const uint64_t *pos, size_t n,
+                   uint8_t dst[][HASH_SIZE]);
+  /* optional, drop the nodes from mmr_size, NULL if the store only needs the
+   * following appends from mmr_size */
+  int (*truncate)(void *data, uint64_t mmr_size);
+  /* nonzero if get and batch_get of the nodes under mmr_size are safe while
+   * another thread appends, required by mmr_snapshot */
+  int concurrent_get;
+} MMRStore;
+
+/* an entry of the top levels cache, see mmr_set_top_cache */
+typedef struct MMRCacheEntry {
+  /* position of the node, UINT64_MAX if the entry is empty */
+  uint64_t pos;
+  uint8_t hash[HASH_SIZE];
+} MMRCacheEntry;
+
+/* max levels under the peaks kept by the top levels cache */
+#define MMR_TOP_CACHE_MAX_LEVELS 16
+/* number of entries of a top levels cache, the entries of the levels under a
+ * peak of height h are at h * ((2 << levels) - 2) */
+#define MMR_TOP_CACHE_ENTRIES(levels)                                          \
+  ((size_t)MMR_MAX_PEAKS * (((size_t)2 << (levels)) - 2))
+
+/* stats and tracing
+ * define MMR_ENABLE_STATS for every translation unit including mmr.h to count
+ * the work of a context and to call hooks around its operations, the fields
+ * are not in the contexts otherwise. counters are plain integers, update them
+ * from one thread only like the context itself.
+ */
+#ifdef MMR_ENABLE_STATS
+typedef struct MMRStats {
+  /* merge calls, each lane of merge_many counts one */
+  uint64_t merges;
+  /* nodes read from tree_buf or the store */
+  uint64_t node_reads;
+  /* nodes found in the top levels cache */
+  uint64_t cache_hits;
+  /* hashes put into generated proofs */
+  uint64_t proof_items;
+  /* peaks merged into bags */
+  uint64_t peaks_bagged;
+} MMRStats;
+
+/* operations passed to the hooks */
+#define MMR_OP_PUSH 1
+#define MMR_OP_PUSH_BATCH 2
+#define MMR_OP_GET_ROOT 3
+#define MMR_OP_GEN_PROOF 4
+#define MMR_OP_GEN_BATCH_PROOF 5
+#define MMR_OP_GEN_RANGE_PROOF 6
+#define MMR_OP_TRUNCATE 7
+#define MMR_OP_VERIFY_BATCH 8
+#define MMR_OP_VERIFY_RANGE 9
+#define MMR_OP_VERIFY_MANY 10
+#define MMR_OP_GEN_CONSISTENCY_PROOF 11
+#define MMR_OP_VERIFY_CONSISTENCY 12
+/* single leaf proofs, a proof stream ends at mmr_proof_stream_finish */
+#define MMR_OP_VERIFY 13
+#define MMR_OP_NEW_ROOT 14
+
+typedef struct MMRHooks {
+  void *data;
+  /* optional, called before an operation */
+  void (*begin)(void *data, int op);
+  /* optional, called after an operation with its return value */
+  void (*end)(void *data, int op, int ret);
+} MMRHooks;
+#endif
+
+/* a context has a single writer, the thread calling push functions on it.
+ * other threads read through snapshots, see mmr_snapshot. */
 typedef struct MMRContext {
-  /* current mmr_size */
+  /* current mmr_size, advanced with release after the new nodes are written */
   uint64_t mmr_size;
   /* store tree internal nodes */
   uint8_t (*tree_buf)[HASH_SIZE];
   /* the size of tree_buf
    * a error will occur if mmr_size reach this */
   uint64_t tree_buf_size;
+  /* nodes backend, NULL to use tree_buf */
+  MMRStore *store;
+  /* peaks cache, valid if peaks_cache_size equals to mmr_size.
+   * peak_bags[i] is the bag of peaks i..n-1, so peak_bags[0] is the root.
+   * updated on the first read after a push, only new peaks are read. */
+  uint64_t peaks_cache_size;
+  uint8_t peak_hashes[MMR_MAX_PEAKS][HASH_SIZE];
+  uint8_t peak_bags[MMR_MAX_PEAKS][HASH_SIZE];
+  /* optional, nodes of the top levels under each peak read from the store,
+   * see mmr_set_top_cache */
+  MMRCacheEntry *top_cache;
+  uint32_t top_cache_levels;
   void (*merge)(uint8_t *dst, uint8_t *right, uint8_t *left);
+  /* optional, merge n independent nodes at once, NULL to use merge */
+  void (*merge_many)(uint8_t *dst[], uint8_t *left[], uint8_t *right[],
+                     size_t n);
+  /* set on snapshots, pushes and truncates return -1 */
+  int read_only;
+#ifdef MMR_ENABLE_STATS
+  MMRStats stats;
+  MMRHooks hooks;
+#endif
 } MMRContext;
 
 typedef struct MMRVerifyContext {
   void (*merge)(uint8_t *dst, uint8_t *right, uint8_t *left);
+  /* optional, merge n independent nodes at once, NULL to use merge */
+  void (*merge_many)(uint8_t *dst[], uint8_t *left[], uint8_t *right[],
+                     size_t n);
+#ifdef MMR_ENABLE_STATS
+  MMRStats stats;
+  MMRHooks hooks;
+#endif
 } MMRVerifyContext;
 
+/* peaks only accumulator, supports push and root without tree_buf */
+typedef struct MMRAccumulator {
+  /* number of leaves */
+  uint64_t leaf_count;
+  /* peaks from left to right, one for each bit of leaf_count */
+  uint8_t peaks[MMR_MAX_PEAKS][HASH_SIZE];
+  void (*merge)(uint8_t *dst, uint8_t *right, uint8_t *left);
+  /* optional, merge n independent nodes at once, NULL to use merge */
+  void (*merge_many)(uint8_t *dst[], uint8_t *left[], uint8_t *right[],
+                     size_t n);
+} MMRAccumulator;
+
+typedef struct MMRRootTracker {
+  MMRAccumulator acc;
+  /* root of acc, valid if acc.leaf_count is not 0 */
+  uint8_t root[HASH_SIZE];
+} MMRRootTracker;
+
+/* max length of an exported accumulator state */
+#define MMR_ACC_STATE_MAX_SIZE (8 + MMR_MAX_PEAKS * HASH_SIZE)
+
 typedef struct MMRSizePos {
   uint64_t mmr_size;
   uint64_t pos;
 } MMRSizePos;
 
+/* a merkle proof of one node, see mmr_compute_proof_root */
+typedef struct MMRVerifyItem {
+  uint8_t *leaf_hash;
+  uint64_t pos;
+  uint8_t (*proof)[HASH_SIZE];
+  size_t proof_len;
+} MMRVerifyItem;
+
+/* state of a proof being verified item by item, see mmr_proof_stream_init */
+typedef struct MMRProofStream {
+  MMRVerifyContext *ctx;
+  /* hash of the node computed so far */
+  uint8_t hash[HASH_SIZE];
+  uint64_t leaf_index;
+  uint32_t height;
+  uint32_t peak_height;
+  int bagging_left;
+} MMRProofStream;
+
 typedef struct MMRPeaks {
   uint64_t *peaks;
   size_t len;
@@ -47,12 +203,39 @@ typedef struct MMRHeightPos {
 
 /* MMR API */
 
+/* calculate peak positions from mmr_size,
+ * return the number of peaks.
+ * peaks: a buf to receive peak positions from left to right
+ */
+size_t mmr_peaks_from_size(uint64_t mmr_size, uint64_t peaks[MMR_MAX_PEAKS]);
+
+/* position math */
+
+/* calculate height of pos, leaves are height 0 */
+uint32_t mmr_pos_height(uint64_t pos);
+
+/* calculate position of a leaf from leaf index */
+uint64_t mmr_leaf_index_to_pos(uint64_t index);
+
+/* calculate leaf index from position of a leaf,
+ * return the index of the last leaf under pos if pos is not a leaf.
+ */
+uint64_t mmr_pos_to_leaf_index(uint64_t pos);
+
 /* calculate MMRSizePos from leaf index,
  * mmr_size is the size of mmr when index is the last leaf,
  * pos is the position of leaf in internal mmr.
  */
 MMRSizePos mmr_compute_pos_by_leaf_index(uint64_t index);
 
+/* calculate mmr_size from leaf count */
+uint64_t mmr_leaf_count_to_size(uint64_t leaf_count);
+
+/* calculate leaf count from mmr_size,
+ * return UINT64_MAX if mmr_size is not a size of mmr
+ */
+uint64_t mmr_size_to_leaf_count(uint64_t mmr_size);
+
 /* Initialize MMRContext
  * mmr_size: the current size of mmr, for a empty MMR it's 0
  * tree_buf: an array of 32bytes buf, used to store mmr internal nodes
@@ -67,19 +250,114 @@ int mmr_initialize_context(MMRContext *ctx, uint64_t mmr_size,
                                        uint8_t right[HASH_SIZE],
                                        uint8_t left[HASH_SIZE]));
 
+/* Initialize MMRContext with a store
+ * mmr_size: the current size of mmr, for a empty MMR it's 0
+ * store: the backend to read and append mmr internal nodes, the store must
+ * outlive the context.
+ * merge: a function to merge left node hash and right node hash
+ */
+int mmr_initialize_store_context(MMRContext *ctx, uint64_t mmr_size,
+                                 MMRStore *store,
+                                 void(merge)(uint8_t dst[HASH_SIZE],
+                                             uint8_t right[HASH_SIZE],
+                                             uint8_t left[HASH_SIZE]));
+
+/* load mmr_size of a context which may be pushed by another thread
+ * all nodes under the returned size are complete and never change.
+ */
+uint64_t mmr_snapshot_size(MMRContext *ctx);
+
+/* take a snapshot of a context for a reader thread
+ * the snapshot sees the mmr at mmr_snapshot_size(ctx), get_root and gen_proof
+ * on it need no lock while the writer keeps pushing to ctx. the snapshot has
+ * its own peaks cache, so reuse it for many proofs of the same size.
+ * the snapshot is read only, pushes and truncates on it return -1 since the
+ * store is shared with ctx.
+ * return -1 if the store of ctx doesn't set concurrent_get, the arena and
+ * blocked stores do, the mmr_file store remaps on growth and the sparse store
+ * moves its entries on pushes, so they don't
+ * snapshot: the context to receive the snapshot
+ */
+int mmr_snapshot(MMRContext *ctx, MMRContext *snapshot);
+
+/* set a multi-lane merge function
+ * merge_many: a function to merge n pairs of left and right node hashes into
+ * dst, n is never greater than MMR_MERGE_MANY_MAX. the merges of a call are
+ * independent, so SIMD hash kernels can compute them in parallel.
+ * set it to NULL to fallback to merge.
+ */
+void mmr_set_merge_many(MMRContext *ctx,
+                        void(merge_many)(uint8_t *dst[], uint8_t *left[],
+                                         uint8_t *right[], size_t n));
+
+/* set a cache of the top levels of every mountain
+ * nodes within levels heights under a peak are kept in cache after they are
+ * read from the store, so proofs of a large mmr only read the store for the
+ * lower levels. the peaks themselves are always cached, see peak_hashes.
+ * contexts without a store don't use the cache. a snapshot does not share the
+ * cache of its context.
+ * return -1 if levels is greater than MMR_TOP_CACHE_MAX_LEVELS
+ * cache: MMR_TOP_CACHE_ENTRIES(levels) entries, NULL to disable the cache
+ * levels: number of levels under the peaks to cache
+ */
+int mmr_set_top_cache(MMRContext *ctx, MMRCacheEntry cache[], uint32_t levels);
+
+#ifdef MMR_ENABLE_STATS
+/* set the hooks of a context, the hooks are copied.
+ * ctx->stats can be read or reset at any time from the writer thread.
+ */
+void mmr_set_hooks(MMRContext *ctx, const MMRHooks *hooks);
+#endif
+
 /* push a leaf into mmr
  * leaf: a 32 bytes hash represented leaf
  */
 int mmr_push(MMRContext *ctx, uint8_t leaf[HASH_SIZE]);
 
+/* push leaves into mmr
+ * positions of the new nodes are calculated from the leaf count, nodes are
+ * merged height by height after all leaves are stored. contexts with a store
+ * append the leaves one by one, so a failed push on a store may have pushed
+ * the first leaves, re-read mmr_size after a failure.
+ * return -1 if tree_buf is not enough to receive the leaves or the store
+ * failed
+ * leaves: an array of 32 bytes hash represented leaves
+ * n: length of leaves
+ */
+int mmr_push_batch(MMRContext *ctx, uint8_t leaves[][HASH_SIZE], size_t n);
+
+/* push leaves whose subtrees are already in tree_buf
+ * the nodes of the new leaves under and at height were written to their
+ * positions by the caller, e.g. by building each subtree in its own context
+ * over tree_buf + mmr_leaf_index_to_pos(first leaf of the subtree). only the
+ * nodes above height are merged.
+ * return -1 if the context has a store, the leaf count or n are not multiples
+ * of 2^height, or tree_buf is not enough
+ * n: number of the new leaves
+ * height: height of the subtrees
+ */
+int mmr_push_subtrees(MMRContext *ctx, uint64_t n, uint32_t height);
+
+/* truncate mmr to the first leaf_count leaves
+ * mmr_size is set back in O(1), the peaks cache is repaired by reading only
+ * the peaks which are not peaks before, O(log n). the nodes after mmr_size
+ * are overwritten by the following pushes, so snapshots larger than the new
+ * mmr_size must not be read after a truncate.
+ * return -1 if leaf_count is greater than the current leaf count, ctx is a
+ * snapshot, or the store failed to truncate
+ * leaf_count: number of leaves to keep
+ */
+int mmr_truncate(MMRContext *ctx, uint64_t leaf_count);
+
 /* get merkle root,
- * return -1 if mmr_size is 0
+ * return -1 if mmr_size is 0 or failed to read the store
  * dst: a 32 bytes buf to receive merkle root
  */
 int mmr_get_root(MMRContext *ctx, uint8_t dst[HASH_SIZE]);
 
 /* generate merkle proof
- * return -1 if proof length is not enough to receive the proof
+ * return -1 if proof length is not enough to receive the proof, or failed to
+ * read the store
  * proof: a array of 32 bytes buf to receive merkle proof
  * proof_max_len: length of proof buf, will be set to the actual len of proof.
  * pos: position of leaf
@@ -87,6 +365,101 @@ int mmr_get_root(MMRContext *ctx, uint8_t dst[HASH_SIZE]);
 int mmr_gen_proof(MMRContext *ctx, uint8_t proof[][HASH_SIZE],
                   size_t *proof_max_len, uint64_t pos);
 
+/* generate merkle proof of a leaf by its index
+ * return -1 if leaf_index is not in the mmr, see mmr_gen_proof
+ * leaf_index: index of leaf
+ */
+int mmr_gen_proof_by_leaf_index(MMRContext *ctx, uint8_t proof[][HASH_SIZE],
+                                size_t *proof_max_len, uint64_t leaf_index);
+
+/* generate merkle proof of multiple leaves
+ * siblings and peaks shared by the leaves are put into proof once, nodes the
+ * verifier can calculate from the leaves are skipped.
+ * the proof is built peak by peak from left to right:
+ * 1. for a peak contains leaves, siblings of the leaves height by height from
+ * left to right.
+ * 2. for a peak on the left of the last leaf without leaves, the peak hash.
+ * 3. peaks on the right of the last leaf, bagged into one hash.
+ * return -1 if proof length is not enough to receive the proof, positions are
+ * invalid or failed to read the store
+ * proof: a array of 32 bytes buf to receive merkle proof
+ * proof_max_len: length of proof buf, will be set to the actual len of proof.
+ * positions: positions of leaves, sorted ascending without duplicates
+ * n: length of positions
+ */
+int mmr_gen_batch_proof(MMRContext *ctx, uint8_t proof[][HASH_SIZE],
+                        size_t *proof_max_len, const uint64_t positions[],
+                        size_t n);
+
+/* generate merkle proof of the contiguous leaves [start, end)
+ * the covered nodes of each height are contiguous, so only the siblings on
+ * the left and right boundary are put into proof, at most two per height.
+ * the layout is the same as mmr_gen_batch_proof of the leaves' positions, so
+ * either verifier accepts it.
+ * return -1 if proof length is not enough to receive the proof, the range is
+ * empty or out of the mmr, or failed to read the store
+ * proof: a array of 32 bytes buf to receive merkle proof
+ * proof_max_len: length of proof buf, will be set to the actual len of proof.
+ * start: leaf index of the first leaf
+ * end: leaf index after the last leaf
+ */
+int mmr_gen_range_proof(MMRContext *ctx, uint8_t proof[][HASH_SIZE],
+                        size_t *proof_max_len, uint64_t start, uint64_t end);
+
+/* generate proof that the mmr of new_size extends the mmr of old_size
+ * the peaks of old_size are nodes of new_size. the last old peak is merged to
+ * its peak in new_size, the left siblings on the way are the other old peaks
+ * and the left peaks of new_size are the old peaks before them, so the proof
+ * holds O(log n) hashes:
+ * 1. the old peaks from left to right.
+ * 2. the siblings from the last old peak to its peak which are not old peaks,
+ * from the lowest.
+ * 3. peaks of new_size on the right of that peak, bagged into one hash.
+ * return -1 if proof length is not enough to receive the proof, the sizes
+ * are not mmr sizes, old_size is 0 or greater than new_size, new_size is
+ * greater than the mmr, or failed to read the store
+ * proof: a array of 32 bytes buf to receive the proof, 2 * MMR_MAX_PEAKS is
+ * always enough
+ * proof_max_len: length of proof buf, will be set to the actual len of proof.
+ * old_size: size of the old mmr
+ * new_size: size of the new mmr, at most the size of ctx
+ */
+int mmr_gen_consistency_proof(MMRContext *ctx, uint8_t proof[][HASH_SIZE],
+                              size_t *proof_max_len, uint64_t old_size,
+                              uint64_t new_size);
+
+/* two phase proof generation, for stores which fetch many nodes at once */
+
+/* list the nodes read by the proofs of positions
+ * fetch the nodes, in one request for a remote store, then assemble each
+ * proof with mmr_assemble_proof.
+ * return -1 if a position is not in mmr_size or nodes_len is not enough
+ * mmr_size: size of the mmr to generate the proofs
+ * positions: positions of the leaves to prove
+ * n: length of positions
+ * nodes_pos: a buf to receive the positions sorted ascending without
+ * duplicates, 64 * (n + 1) is always enough
+ * nodes_len: length of nodes_pos, will be set to the number of positions
+ */
+int mmr_proof_nodes(uint64_t mmr_size, const uint64_t positions[], size_t n,
+                    uint64_t nodes_pos[], size_t *nodes_len);
+
+/* assemble merkle proof from the nodes listed by mmr_proof_nodes
+ * the proof is the same as mmr_gen_proof at mmr_size, the rhs peaks are
+ * bagged with the merge function of ctx.
+ * return -1 if proof length is not enough or a node is missing
+ * pos: position of leaf
+ * nodes_pos: positions of the fetched nodes, sorted ascending
+ * nodes: hashes of the fetched nodes
+ * nodes_len: length of nodes_pos and nodes
+ * proof: a array of 32 bytes buf to receive merkle proof
+ * proof_max_len: length of proof buf, will be set to the actual len of proof.
+ */
+int mmr_assemble_proof(MMRVerifyContext *ctx, uint64_t mmr_size, uint64_t pos,
+                       const uint64_t nodes_pos[], uint8_t nodes[][HASH_SIZE],
+                       size_t nodes_len, uint8_t proof[][HASH_SIZE],
+                       size_t *proof_max_len);
+
 /* Initialize MMRVerifyContext
  * merge: a function to merge left node hash and right node hash
  */
@@ -95,6 +468,19 @@ int mmr_initialize_verify_context(MMRVerifyContext *ctx,
                                               uint8_t right[HASH_SIZE],
                                               uint8_t left[HASH_SIZE]));
 
+/* set a multi-lane merge function for MMRVerifyContext
+ * see mmr_set_merge_many
+ */
+void mmr_set_verify_merge_many(MMRVerifyContext *ctx,
+                               void(merge_many)(uint8_t *dst[],
+                                                uint8_t *left[],
+                                                uint8_t *right[], size_t n));
+
+#ifdef MMR_ENABLE_STATS
+/* set the hooks of a MMRVerifyContext, see mmr_set_hooks */
+void mmr_set_verify_hooks(MMRVerifyContext *ctx, const MMRHooks *hooks);
+#endif
+
 /* compute root from merkle proof
  * root_hash: a 32 bytes buf to receive root hash
  * mmr_size: size of the mmr to generate this proof
@@ -108,10 +494,141 @@ void mmr_compute_proof_root(MMRVerifyContext *ctx, uint8_t root_hash[HASH_SIZE],
                             uint64_t pos, uint8_t proof[][HASH_SIZE],
                             size_t proof_len);
 
+/* verify merkle proof of a leaf by its index
+ * return 0 if the proof is valid, otherwise return -1
+ * root_hash: 32 bytes root hash of the mmr
+ * leaf_count: leaf count of the mmr to generate this proof
+ * leaf_hash: 32 bytes hash of leaf
+ * leaf_index: index of the leaf
+ * proof: an array of 32 bytes hash
+ * proof_len: length of proof
+ */
+int mmr_verify_proof_by_leaf_index(MMRVerifyContext *ctx,
+                                   uint8_t root_hash[HASH_SIZE],
+                                   uint64_t leaf_count,
+                                   uint8_t leaf_hash[HASH_SIZE],
+                                   uint64_t leaf_index,
+                                   uint8_t proof[][HASH_SIZE],
+                                   size_t proof_len);
+
+/* start to compute root from merkle proof item by item
+ * the proof is fed in chunks of any size as it arrives, items are merged
+ * where they are and never buffered, so the chunks can point into a receive
+ * buffer. feeding a whole proof is the same as mmr_compute_proof_root.
+ * stream: the state, at most a few words and one hash
+ * mmr_size: size of the mmr to generate this proof
+ * leaf_hash: 32 bytes hash of leaf
+ * pos: position of the leaf
+ */
+void mmr_proof_stream_init(MMRProofStream *stream, MMRVerifyContext *ctx,
+                           uint64_t mmr_size, uint8_t leaf_hash[HASH_SIZE],
+                           uint64_t pos);
+
+/* feed the next items of proof
+ * items: an array of 32 bytes hash, the next n items of proof
+ * n: length of items, may be 0
+ */
+void mmr_proof_stream_feed(MMRProofStream *stream, uint8_t items[][HASH_SIZE],
+                           size_t n);
+
+/* finish a stream after the last item of proof is fed
+ * root_hash: a 32 bytes buf to receive root hash
+ */
+void mmr_proof_stream_finish(MMRProofStream *stream,
+                             uint8_t root_hash[HASH_SIZE]);
+
+/* compute root from merkle proof of multiple leaves
+ * see mmr_gen_batch_proof for the layout of proof.
+ * return -1 if positions or proof are invalid
+ * root_hash: a 32 bytes buf to receive root hash
+ * mmr_size: size of the mmr to generate this proof
+ * positions: positions of leaves, sorted ascending without duplicates
+ * leaves: 32 bytes hashes of leaves, used as working buf and overwritten
+ * n: length of positions and leaves
+ * proof: an array of 32 bytes hash
+ * proof_len: length of proof
+ */
+int mmr_compute_batch_proof_root(MMRVerifyContext *ctx,
+                                 uint8_t root_hash[HASH_SIZE],
+                                 uint64_t mmr_size, const uint64_t positions[],
+                                 uint8_t leaves[][HASH_SIZE], size_t n,
+                                 uint8_t proof[][HASH_SIZE], size_t proof_len);
+
+/* verify merkle proof of multiple leaves
+ * return 0 if the proof is valid, otherwise return -1
+ * root_hash: 32 bytes root hash of the mmr
+ * see mmr_compute_batch_proof_root for other arguments
+ */
+int mmr_verify_batch_proof(MMRVerifyContext *ctx, uint8_t root_hash[HASH_SIZE],
+                           uint64_t mmr_size, const uint64_t positions[],
+                           uint8_t leaves[][HASH_SIZE], size_t n,
+                           uint8_t proof[][HASH_SIZE], size_t proof_len);
+
+/* compute root from merkle proof of contiguous leaves
+ * see mmr_gen_range_proof for the layout of proof. the leaves are merged
+ * height by height in place, each node is merged once.
+ * return -1 if the range or proof are invalid
+ * root_hash: a 32 bytes buf to receive root hash
+ * mmr_size: size of the mmr to generate this proof
+ * start: leaf index of leaves[0]
+ * leaves: 32 bytes hashes of leaves, used as working buf and overwritten
+ * n: length of leaves
+ * proof: an array of 32 bytes hash
+ * proof_len: length of proof
+ */
+int mmr_compute_range_proof_root(MMRVerifyContext *ctx,
+                                 uint8_t root_hash[HASH_SIZE],
+                                 uint64_t mmr_size, uint64_t start,
+                                 uint8_t leaves[][HASH_SIZE], size_t n,
+                                 uint8_t proof[][HASH_SIZE], size_t proof_len);
+
+/* verify merkle proof of contiguous leaves
+ * return 0 if the proof is valid, otherwise return -1
+ * root_hash: 32 bytes root hash of the mmr
+ * see mmr_compute_range_proof_root for other arguments
+ */
+int mmr_verify_range_proof(MMRVerifyContext *ctx, uint8_t root_hash[HASH_SIZE],
+                           uint64_t mmr_size, uint64_t start,
+                           uint8_t leaves[][HASH_SIZE], size_t n,
+                           uint8_t proof[][HASH_SIZE], size_t proof_len);
+
+/* verify the mmr of new_size extends the mmr of old_size
+ * see mmr_gen_consistency_proof for the layout of proof.
+ * return 0 if the proof is valid, otherwise return -1
+ * old_root: 32 bytes root hash of the old mmr
+ * old_size: size of the old mmr
+ * new_root: 32 bytes root hash of the new mmr
+ * new_size: size of the new mmr
+ * proof: an array of 32 bytes hash
+ * proof_len: length of proof
+ */
+int mmr_verify_consistency_proof(MMRVerifyContext *ctx,
+                                 uint8_t old_root[HASH_SIZE],
+                                 uint64_t old_size,
+                                 uint8_t new_root[HASH_SIZE],
+                                 uint64_t new_size,
+                                 uint8_t proof[][HASH_SIZE], size_t proof_len);
+
+/* verify independent merkle proofs against the same root
+ * the merges of different proofs are interleaved, so merge_many of the
+ * context receives one node of up to MMR_MERGE_MANY_MAX proofs per call.
+ * return 0 if all proofs are valid, otherwise return -1
+ * root_hash: 32 bytes root hash of the mmr
+ * mmr_size: size of the mmr to generate the proofs
+ * items: leaf hashes, positions and proofs
+ * n: length of items
+ * results: a bitmap of (n + 7) / 8 bytes, bit i % 8 of results[i / 8] is set
+ * if items[i] is valid
+ */
+int mmr_verify_many(MMRVerifyContext *ctx, uint8_t root_hash[HASH_SIZE],
+                    uint64_t mmr_size, const MMRVerifyItem items[], size_t n,
+                    uint8_t results[]);
+
 /* compute a new root from last leaf's merkle proof
  * from merkle proof of leaf n to calculate merkle root of n + 1 leaves.
  * this is kinda triky, but by observe the MMR construction graph we know it is
  * possible. https://github.com/jjyr/merkle-mountain-range#construct
+ * proof is read in place, it is neither copied nor modified.
  *
  * root_hash: a 32 bytes buf to receive root hash
  * mmr_size: size of the mmr to generate this proof
@@ -128,4 +645,122 @@ void mmr_compute_new_root_from_last_leaf_proof(
     size_t proof_len, uint8_t new_leaf_hash[HASH_SIZE],
     MMRSizePos new_leaf_pos);
 
+/* compute the new root and the proof of the new leaf from last leaf's proof
+ * one pass over proof serves both, each node is merged once and the next
+ * proof is built in proof in place: the new leaf's siblings are the last leaf
+ * and the left peaks merged with it, or the left peaks are the peak of the
+ * last leaf and the remain proof. on return the new leaf is the last leaf of
+ * the new mmr, so the next leaf is chained with the same call.
+ * return -1 if mmr_size is not a size of mmr, proof_len is not the length of
+ * the last leaf's proof, or proof_max_len is not enough for the new proof
+ * root_hash: a 32 bytes buf to receive root hash of the new mmr
+ * mmr_size: size of the mmr to generate this proof, will be set to the size
+ * of the new mmr
+ * leaf_hash: 32 bytes hash of the last leaf, the proof of an empty mmr is
+ * empty and leaf_hash is not read
+ * proof: proof of the last leaf, will be set to the proof of the new leaf
+ * proof_len: length of proof, will be set to the length of the new proof
+ * proof_max_len: length of proof buf, one more than proof_len is enough
+ * new_leaf_hash: 32 bytes hash of the next leaf
+ */
+int mmr_compute_new_root_and_proof(MMRVerifyContext *ctx,
+                                   uint8_t root_hash[HASH_SIZE],
+                                   uint64_t *mmr_size,
+                                   uint8_t leaf_hash[HASH_SIZE],
+                                   uint8_t proof[][HASH_SIZE],
+                                   size_t *proof_len, size_t proof_max_len,
+                                   uint8_t new_leaf_hash[HASH_SIZE]);
+
+/* Accumulator API
+ * an accumulator keeps only the peaks of mmr, at most MMR_MAX_PEAKS hashes,
+ * the root is the same as a MMRContext with the same leaves.
+ */
+
+/* Initialize an empty MMRAccumulator
+ * merge: a function to merge left node hash and right node hash
+ */
+int mmr_initialize_accumulator(MMRAccumulator *acc,
+                               void(merge)(uint8_t dst[HASH_SIZE],
+                                           uint8_t right[HASH_SIZE],
+                                           uint8_t left[HASH_SIZE]));
+
+/* set a multi-lane merge function for MMRAccumulator
+ * see mmr_set_merge_many
+ */
+void mmr_acc_set_merge_many(MMRAccumulator *acc,
+                            void(merge_many)(uint8_t *dst[], uint8_t *left[],
+                                             uint8_t *right[], size_t n));
+
+/* push a leaf into accumulator
+ * leaf: a 32 bytes hash represented leaf
+ */
+int mmr_acc_push(MMRAccumulator *acc, uint8_t leaf[HASH_SIZE]);
+
+/* push leaves into accumulator
+ * complete subtrees are merged height by height.
+ * leaves: an array of 32 bytes hash represented leaves
+ * n: length of leaves
+ */
+int mmr_acc_push_batch(MMRAccumulator *acc, uint8_t leaves[][HASH_SIZE],
+                       size_t n);
+
+/* get merkle root of accumulator,
+ * return -1 if accumulator is empty
+ * dst: a 32 bytes buf to receive merkle root
+ */
+int mmr_acc_get_root(MMRAccumulator *acc, uint8_t dst[HASH_SIZE]);
+
+/* export the state of accumulator
+ * the state is the 8 bytes little endian leaf count followed by the peaks,
+ * at most MMR_ACC_STATE_MAX_SIZE bytes.
+ * return -1 if buf is not enough to receive the state
+ * buf: a buf to receive the state
+ * buf_len: length of buf, will be set to the actual len of state.
+ */
+int mmr_acc_export(MMRAccumulator *acc, uint8_t *buf, size_t *buf_len);
+
+/* import a state exported by mmr_acc_export
+ * return -1 if the state is invalid, accumulator is not changed.
+ * buf: the state
+ * buf_len: length of the state
+ */
+int mmr_acc_import(MMRAccumulator *acc, const uint8_t *buf, size_t buf_len);
+
+/* Root tracker API
+ * a root tracker is an accumulator which keeps the root up to date, a light
+ * client starts one from the proof of the last leaf and a trusted root, then
+ * follows new leaves without the tree. a push costs the merges of the peaks
+ * it completes plus one merge per peak to bag the root, no proof is copied.
+ */
+
+/* Initialize a root tracker from the merkle proof of the last leaf
+ * the peaks are recovered from the proof and bagged, the tracker is only
+ * initialized if the root equals to root_hash.
+ * return -1 if mmr_size is invalid or the proof does not match root_hash
+ * merge: a function to merge left node hash and right node hash
+ * mmr_size: size of the mmr to generate the proof, 0 for an empty tracker
+ * leaf_hash: 32 bytes hash of the last leaf
+ * proof: an array of 32 bytes hash, the proof of the last leaf
+ * proof_len: length of proof
+ * root_hash: 32 bytes trusted root of the mmr
+ */
+int mmr_initialize_root_tracker(MMRRootTracker *tracker,
+                                void(merge)(uint8_t dst[HASH_SIZE],
+                                            uint8_t right[HASH_SIZE],
+                                            uint8_t left[HASH_SIZE]),
+                                uint64_t mmr_size, uint8_t leaf_hash[HASH_SIZE],
+                                uint8_t proof[][HASH_SIZE], size_t proof_len,
+                                uint8_t root_hash[HASH_SIZE]);
+
+/* push a leaf and update the root
+ * leaf: a 32 bytes hash represented leaf
+ */
+int mmr_tracker_push(MMRRootTracker *tracker, uint8_t leaf[HASH_SIZE]);
+
+/* get the current root of tracker,
+ * return -1 if tracker is empty
+ * dst: a 32 bytes buf to receive merkle root
+ */
+int mmr_tracker_get_root(MMRRootTracker *tracker, uint8_t dst[HASH_SIZE]);
+
 #endif
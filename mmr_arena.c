@@ -0,0 +1,272 @@
+/* Mountain merkle range
+ * segmented arena store
+ *
+ * Copyright 2019 Jiang Jinyang <jjyruby@gmail.com>
+ * under MIT license
+ */
+
+#include "mmr_arena.h"
+#include "string.h"
+#include "sys/mman.h"
+
+#define HUGE_PAGE_SIZE ((size_t)2 << 20)
+/* pointers of the first segment directory */
+#define MIN_SEGMENTS_CAP 16
+
+/* a directory of cap segments has one more slot, which links the directory
+ * it replaced */
+static size_t directory_bytes(uint64_t cap) {
+  return (cap + 1) * sizeof(void *);
+}
+
+/* helper functions */
+
+static size_t round_up(size_t size, size_t align) {
+  return (size + align - 1) / align * align;
+}
+
+static size_t map_size(size_t size, int flags) {
+  return flags & MMR_ARENA_HUGE_PAGES ? round_up(size, HUGE_PAGE_SIZE) : size;
+}
+
+/* map len bytes aligned to a huge page, so transparent huge pages cover the
+ * whole segment */
+static void *map_huge_aligned(size_t len) {
+  uint8_t *p = mmap(NULL, len + HUGE_PAGE_SIZE, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (p == MAP_FAILED) {
+    return NULL;
+  }
+  size_t head = round_up((uintptr_t)p, HUGE_PAGE_SIZE) - (uintptr_t)p;
+  if (head > 0) {
+    munmap(p, head);
+  }
+  munmap(p + head + len, HUGE_PAGE_SIZE - head);
+#ifdef MADV_HUGEPAGE
+  madvise(p + head, len, MADV_HUGEPAGE);
+#endif
+  return p + head;
+}
+
+static void *default_alloc(void *data, size_t size, int flags) {
+  (void)data;
+  size_t len = map_size(size, flags);
+  void *p = NULL;
+  if (flags & MMR_ARENA_HUGE_PAGES) {
+#ifdef MAP_HUGETLB
+    p = mmap(NULL, len, PROT_READ | PROT_WRITE,
+             MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (p == MAP_FAILED) {
+      p = NULL;
+    }
+#endif
+    if (p == NULL) {
+      p = map_huge_aligned(len);
+    }
+  } else {
+    p = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS,
+             -1, 0);
+    if (p == MAP_FAILED) {
+      p = NULL;
+    }
+  }
+  /* the first touch places the pages on the node of this thread */
+  if (p != NULL && (flags & MMR_ARENA_NUMA_LOCAL)) {
+    memset(p, 0, len);
+  }
+  return p;
+}
+
+static void default_free(void *data, void *ptr, size_t size, int flags) {
+  (void)data;
+  munmap(ptr, map_size(size, flags));
+}
+
+static size_t segment_bytes(MMRArena *arena) {
+  return (size_t)HASH_SIZE << arena->segment_shift;
+}
+
+/* append a segment, the directory is doubled if it's full.
+ * the old directory is kept until mmr_arena_free, a reader may still index
+ * it, and linked from the new one */
+static int add_segment(MMRArena *arena) {
+  MMRArenaAllocator *allocator = &arena->allocator;
+  if (arena->segments_len == arena->segments_cap) {
+    uint64_t cap = arena->segments_cap == 0 ? MIN_SEGMENTS_CAP
+                                            : arena->segments_cap * 2;
+    uint8_t (**segments)[HASH_SIZE] =
+        allocator->alloc(allocator->data, directory_bytes(cap), 0);
+    if (segments == NULL) {
+      return -1;
+    }
+    if (arena->segments != NULL) {
+      memcpy(segments, arena->segments, arena->segments_len * sizeof(void *));
+    }
+    segments[cap] = (uint8_t(*)[HASH_SIZE])arena->segments;
+    __atomic_store_n(&arena->segments, segments, __ATOMIC_RELEASE);
+    arena->segments_cap = cap;
+  }
+  void *segment =
+      allocator->alloc(allocator->data, segment_bytes(arena), arena->flags);
+  if (segment == NULL) {
+    return -1;
+  }
+  arena->segments[arena->segments_len++] = segment;
+  return 0;
+}
+
+/* len is loaded and stored atomically, readers of snapshots check it
+ * while the writer appends */
+static uint64_t load_len(MMRArena *arena) {
+  return __atomic_load_n(&arena->len, __ATOMIC_ACQUIRE);
+}
+
+static void store_len(MMRArena *arena, uint64_t len) {
+  __atomic_store_n(&arena->len, len, __ATOMIC_RELEASE);
+}
+
+static uint8_t *node_at(MMRArena *arena, uint64_t pos) {
+  uint64_t mask = ((uint64_t)1 << arena->segment_shift) - 1;
+  uint8_t (**segments)[HASH_SIZE] =
+      __atomic_load_n(&arena->segments, __ATOMIC_ACQUIRE);
+  return segments[pos >> arena->segment_shift][pos & mask];
+}
+
+static int arena_get(void *data, uint64_t pos, uint8_t dst[HASH_SIZE]) {
+  MMRArena *arena = (MMRArena *)data;
+  if (pos >= load_len(arena)) {
+    return -1;
+  }
+  memcpy(dst, node_at(arena, pos), HASH_SIZE);
+  return 0;
+}
+
+static int arena_batch_get(void *data, const uint64_t *pos, size_t n,
+                           uint8_t dst[][HASH_SIZE]) {
+  MMRArena *arena = (MMRArena *)data;
+  for (size_t i = 0; i < n; i++) {
+    if (pos[i] >= load_len(arena)) {
+      return -1;
+    }
+    memcpy(dst[i], node_at(arena, pos[i]), HASH_SIZE);
+  }
+  return 0;
+}
+
+static int arena_append(void *data, uint64_t pos, uint8_t elem[HASH_SIZE]) {
+  MMRArena *arena = (MMRArena *)data;
+  if (pos > arena->len) {
+    return -1;
+  }
+  if ((pos >> arena->segment_shift) >= arena->segments_len &&
+      add_segment(arena) != 0) {
+    return -1;
+  }
+  memcpy(node_at(arena, pos), elem, HASH_SIZE);
+  store_len(arena, pos + 1);
+  return 0;
+}
+
+/* the segments are kept for the following pushes */
+static int arena_truncate(void *data, uint64_t mmr_size) {
+  MMRArena *arena = (MMRArena *)data;
+  if (mmr_size > arena->len) {
+    return -1;
+  }
+  store_len(arena, mmr_size);
+  return 0;
+}
+
+/* arena API */
+
+/* initialize an empty arena, nothing is allocated until the first push
+ * return -1 if segment_shift is greater than MMR_ARENA_MAX_SEGMENT_SHIFT
+ * segment_shift: log2 of the nodes of a segment
+ * flags: MMR_ARENA_HUGE_PAGES and MMR_ARENA_NUMA_LOCAL
+ * allocator: allocator hook, copied into the arena, NULL to map anonymous
+ * memory
+ */
+int mmr_arena_init(MMRArena *arena, uint32_t segment_shift, int flags,
+                   const MMRArenaAllocator *allocator) {
+  if (segment_shift > MMR_ARENA_MAX_SEGMENT_SHIFT) {
+    return -1;
+  }
+  if (allocator != NULL) {
+    arena->allocator = *allocator;
+  } else {
+    arena->allocator.data = NULL;
+    arena->allocator.alloc = default_alloc;
+    arena->allocator.free = default_free;
+  }
+  arena->segments = NULL;
+  arena->segments_len = 0;
+  arena->segments_cap = 0;
+  arena->segment_shift = segment_shift;
+  arena->flags = flags;
+  arena->len = 0;
+  arena->store.data = arena;
+  arena->store.get = arena_get;
+  arena->store.append = arena_append;
+  arena->store.batch_get = arena_batch_get;
+  arena->store.truncate = arena_truncate;
+  arena->store.concurrent_get = 1;
+  return 0;
+}
+
+/* allocate the segments of the first nodes positions ahead of the pushes
+ * return -1 if failed to allocate
+ */
+int mmr_arena_reserve(MMRArena *arena, uint64_t nodes) {
+  uint64_t segments =
+      (nodes + ((uint64_t)1 << arena->segment_shift) - 1) >>
+      arena->segment_shift;
+  while (arena->segments_len < segments) {
+    if (add_segment(arena) != 0) {
+      return -1;
+    }
+  }
+  return 0;
+}
+
+/* return the node at pos, or NULL if pos is not in the arena */
+uint8_t *mmr_arena_node(MMRArena *arena, uint64_t pos) {
+  return pos < load_len(arena) ? node_at(arena, pos) : NULL;
+}
+
+/* Initialize MMRContext on an arena
+ * mmr_size: the current size of mmr, the nodes under it must be in the arena
+ * merge: a function to merge left node hash and right node hash
+ */
+int mmr_arena_initialize_context(MMRContext *ctx, MMRArena *arena,
+                                 uint64_t mmr_size,
+                                 void(merge)(uint8_t dst[HASH_SIZE],
+                                             uint8_t right[HASH_SIZE],
+                                             uint8_t left[HASH_SIZE])) {
+  if (mmr_size > arena->len) {
+    return -1;
+  }
+  store_len(arena, mmr_size);
+  return mmr_initialize_store_context(ctx, mmr_size, &arena->store, merge);
+}
+
+/* free the segments and the directories, the arena is empty after it */
+void mmr_arena_free(MMRArena *arena) {
+  MMRArenaAllocator *allocator = &arena->allocator;
+  for (uint64_t i = 0; i < arena->segments_len; i++) {
+    allocator->free(allocator->data, arena->segments[i], segment_bytes(arena),
+                    arena->flags);
+  }
+  /* each directory links the half sized one it replaced */
+  uint8_t (**segments)[HASH_SIZE] = arena->segments;
+  uint64_t cap = arena->segments_cap;
+  while (segments != NULL) {
+    void *retired = segments[cap];
+    allocator->free(allocator->data, segments, directory_bytes(cap), 0);
+    segments = retired;
+    cap /= 2;
+  }
+  arena->segments = NULL;
+  arena->segments_len = 0;
+  arena->segments_cap = 0;
+  arena->len = 0;
+}
@@ -0,0 +1,91 @@
+/* Mountain merkle range
+ * segmented arena store
+ *
+ * Copyright 2019 Jiang Jinyang <jjyruby@gmail.com>
+ * under MIT license
+ */
+
+#ifndef MMR_ARENA_H
+#define MMR_ARENA_H
+
+#include "mmr.h"
+
+/* the arena owns its nodes and grows by one segment of 2^segment_shift nodes
+ * when a push reaches the end, the nodes are never moved, so a push never
+ * copies the tree and pointers to a node stay valid until the arena is freed.
+ * node pos is at segments[pos >> segment_shift][pos & mask].
+ * the segment directory is reallocated when it's full, readers of snapshots
+ * may still index the old one, so the old directories are only freed by
+ * mmr_arena_free.
+ */
+
+/* 2^16 nodes of 32 bytes, a segment is a 2MB huge page */
+#define MMR_ARENA_DEFAULT_SEGMENT_SHIFT 16
+#define MMR_ARENA_MAX_SEGMENT_SHIFT 32
+
+/* allocation flags, passed to the allocator */
+/* back segments with 2MB huge pages, the default allocator falls back to
+ * transparent huge pages if no huge page is reserved */
+#define MMR_ARENA_HUGE_PAGES 1
+/* place segments on the NUMA node of the allocating thread, the default
+ * allocator populates the pages on allocation so the first touch is local.
+ * use an allocator hook for a strict binding, e.g. numa_alloc_local */
+#define MMR_ARENA_NUMA_LOCAL 2
+
+typedef struct MMRArenaAllocator {
+  void *data;
+  /* return a buf of size bytes aligned to HASH_SIZE, NULL if failed */
+  void *(*alloc)(void *data, size_t size, int flags);
+  /* free a buf returned by alloc with the same size and flags */
+  void (*free)(void *data, void *ptr, size_t size, int flags);
+} MMRArenaAllocator;
+
+typedef struct MMRArena {
+  /* segment directory, segments_cap pointers, only the directory is
+   * reallocated when it's full. segments[segments_cap] links the directory
+   * it replaced */
+  uint8_t (**segments)[HASH_SIZE];
+  uint64_t segments_len;
+  uint64_t segments_cap;
+  uint32_t segment_shift;
+  int flags;
+  MMRArenaAllocator allocator;
+  /* nodes in the arena, may be greater than mmr_size during a push, stored
+   * with release for the readers of snapshots */
+  uint64_t len;
+  /* the store to use with mmr_initialize_store_context */
+  MMRStore store;
+} MMRArena;
+
+/* initialize an empty arena, nothing is allocated until the first push
+ * return -1 if segment_shift is greater than MMR_ARENA_MAX_SEGMENT_SHIFT
+ * segment_shift: log2 of the nodes of a segment
+ * flags: MMR_ARENA_HUGE_PAGES and MMR_ARENA_NUMA_LOCAL
+ * allocator: allocator hook, copied into the arena, NULL to map anonymous
+ * memory
+ */
+int mmr_arena_init(MMRArena *arena, uint32_t segment_shift, int flags,
+                   const MMRArenaAllocator *allocator);
+
+/* allocate the segments of the first nodes positions ahead of the pushes
+ * return -1 if failed to allocate
+ */
+int mmr_arena_reserve(MMRArena *arena, uint64_t nodes);
+
+/* return the node at pos, or NULL if pos is not in the arena */
+uint8_t *mmr_arena_node(MMRArena *arena, uint64_t pos);
+
+/* Initialize MMRContext on an arena
+ * mmr_size: the current size of mmr, the nodes under it must be in the arena
+ * merge: a function to merge left node hash and right node hash
+ */
+int mmr_arena_initialize_context(MMRContext *ctx, MMRArena *arena,
+                                 uint64_t mmr_size,
+                                 void(merge)(uint8_t dst[HASH_SIZE],
+                                             uint8_t right[HASH_SIZE],
+                                             uint8_t left[HASH_SIZE]));
+
+/* free the segments and the directories, the arena is empty after it */
+void mmr_arena_free(MMRArena *arena);
+
+#endif
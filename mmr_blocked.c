@@ -0,0 +1,186 @@
+/* Mountain merkle range
+ * subtree blocked store
+ *
+ * Copyright 2019 Jiang Jinyang <jjyruby@gmail.com>
+ * under MIT license
+ */
+
+#include "mmr_blocked.h"
+#include "mmr_spec.h"
+#include "string.h"
+
+/* nodes at the lowest height of a block */
+#define BLOCK_BASE_NODES (MMR_BLOCK_NODES / 2)
+
+/* helper functions */
+
+/* number of blocks of band, nodes of the band lowest height are
+ * max_leaves >> (7 * band) */
+static uint64_t band_blocks(uint64_t max_leaves, uint32_t band) {
+  uint32_t shift = band * MMR_BLOCK_LEVELS;
+  if (shift >= 64) {
+    return 0;
+  }
+  uint64_t base_nodes = max_leaves >> shift;
+  return (base_nodes + BLOCK_BASE_NODES - 1) / BLOCK_BASE_NODES;
+}
+
+static uint64_t total_blocks(uint64_t max_leaves) {
+  uint64_t blocks = 0;
+  for (uint32_t band = 0; band < MMR_BLOCK_MAX_BANDS; band++) {
+    blocks += band_blocks(max_leaves, band);
+  }
+  return blocks;
+}
+
+/* translate pos to the node index in blocks */
+static uint64_t node_index(MMRBlocked *blocked, uint64_t pos) {
+  uint64_t index;
+  uint32_t height = mmr_spec_pos_height_and_leaf(pos, &index);
+  /* index of the node among the nodes of its height */
+  index >>= height;
+  if (index >= (blocked->max_leaves >> height)) {
+    return UINT64_MAX;
+  }
+  uint32_t band = height / MMR_BLOCK_LEVELS;
+  uint32_t level = height % MMR_BLOCK_LEVELS;
+  /* a block has 64 >> level nodes at level */
+  uint32_t level_shift = MMR_BLOCK_LEVELS - 1 - level;
+  uint64_t block = blocked->band_offset[band] + (index >> level_shift);
+  uint64_t slot = MMR_BLOCK_NODES - (MMR_BLOCK_NODES >> level) +
+                  (index & (((uint64_t)1 << level_shift) - 1));
+  return block * MMR_BLOCK_NODES + slot;
+}
+
+/* len is loaded and stored atomically, readers of snapshots check it
+ * while the writer appends */
+static uint64_t load_len(MMRBlocked *blocked) {
+  return __atomic_load_n(&blocked->len, __ATOMIC_ACQUIRE);
+}
+
+static void store_len(MMRBlocked *blocked, uint64_t len) {
+  __atomic_store_n(&blocked->len, len, __ATOMIC_RELEASE);
+}
+
+static uint8_t *node_at(MMRBlocked *blocked, uint64_t index) {
+  return blocked->blocks[index / MMR_BLOCK_NODES][index % MMR_BLOCK_NODES];
+}
+
+static int blocked_get(void *data, uint64_t pos, uint8_t dst[HASH_SIZE]) {
+  MMRBlocked *blocked = (MMRBlocked *)data;
+  if (pos >= load_len(blocked)) {
+    return -1;
+  }
+  memcpy(dst, node_at(blocked, node_index(blocked, pos)), HASH_SIZE);
+  return 0;
+}
+
+static int blocked_batch_get(void *data, const uint64_t *pos, size_t n,
+                             uint8_t dst[][HASH_SIZE]) {
+  MMRBlocked *blocked = (MMRBlocked *)data;
+  for (size_t i = 0; i < n; i++) {
+    if (pos[i] >= load_len(blocked)) {
+      return -1;
+    }
+    memcpy(dst[i], node_at(blocked, node_index(blocked, pos[i])), HASH_SIZE);
+  }
+  return 0;
+}
+
+static int blocked_append(void *data, uint64_t pos, uint8_t elem[HASH_SIZE]) {
+  MMRBlocked *blocked = (MMRBlocked *)data;
+  if (pos > blocked->len) {
+    return -1;
+  }
+  uint64_t index = node_index(blocked, pos);
+  if (index == UINT64_MAX) {
+    return -1;
+  }
+  memcpy(node_at(blocked, index), elem, HASH_SIZE);
+  store_len(blocked, pos + 1);
+  return 0;
+}
+
+static int blocked_truncate(void *data, uint64_t mmr_size) {
+  MMRBlocked *blocked = (MMRBlocked *)data;
+  if (mmr_size > blocked->len) {
+    return -1;
+  }
+  store_len(blocked, mmr_size);
+  return 0;
+}
+
+/* blocked API */
+
+/* return the bytes of a blocks buffer to hold mmr of max_leaves */
+uint64_t mmr_blocked_buf_size(uint64_t max_leaves) {
+  return total_blocks(max_leaves) * MMR_BLOCK_SIZE;
+}
+
+/* initialize an empty blocked store
+ * return -1 if buf_size is less than mmr_blocked_buf_size(max_leaves)
+ * buf: blocks buffer, align it to MMR_BLOCK_SIZE to have a block per page
+ * buf_size: size of buf in bytes
+ * max_leaves: the max leaf count of the mmr
+ */
+int mmr_blocked_init(MMRBlocked *blocked, void *buf, uint64_t buf_size,
+                     uint64_t max_leaves) {
+  if (buf_size < mmr_blocked_buf_size(max_leaves)) {
+    return -1;
+  }
+  blocked->blocks = (uint8_t(*)[MMR_BLOCK_NODES][HASH_SIZE])buf;
+  blocked->max_leaves = max_leaves;
+  uint64_t offset = 0;
+  for (uint32_t band = 0; band < MMR_BLOCK_MAX_BANDS; band++) {
+    blocked->band_offset[band] = offset;
+    offset += band_blocks(max_leaves, band);
+  }
+  blocked->len = 0;
+  blocked->store.data = blocked;
+  blocked->store.get = blocked_get;
+  blocked->store.append = blocked_append;
+  blocked->store.batch_get = blocked_batch_get;
+  blocked->store.truncate = blocked_truncate;
+  blocked->store.concurrent_get = 1;
+  return 0;
+}
+
+/* return the index of pos in the buffer, counted in nodes,
+ * or UINT64_MAX if pos is beyond max_leaves
+ */
+uint64_t mmr_blocked_node_index(MMRBlocked *blocked, uint64_t pos) {
+  return node_index(blocked, pos);
+}
+
+/* copy nodes in postorder into the store, return -1 if they don't fit
+ * tree_buf: nodes of a mmr, indexed by position
+ * mmr_size: the size of the mmr in tree_buf
+ */
+int mmr_blocked_load(MMRBlocked *blocked, uint8_t tree_buf[][HASH_SIZE],
+                     uint64_t mmr_size) {
+  for (uint64_t pos = 0; pos < mmr_size; pos++) {
+    uint64_t index = node_index(blocked, pos);
+    if (index == UINT64_MAX) {
+      return -1;
+    }
+    memcpy(node_at(blocked, index), tree_buf[pos], HASH_SIZE);
+  }
+  store_len(blocked, mmr_size);
+  return 0;
+}
+
+/* Initialize MMRContext on a blocked store
+ * mmr_size: the current size of mmr, the nodes under it must be in the store
+ * merge: a function to merge left node hash and right node hash
+ */
+int mmr_blocked_initialize_context(MMRContext *ctx, MMRBlocked *blocked,
+                                   uint64_t mmr_size,
+                                   void(merge)(uint8_t dst[HASH_SIZE],
+                                               uint8_t right[HASH_SIZE],
+                                               uint8_t left[HASH_SIZE])) {
+  if (mmr_size > 0 && node_index(blocked, mmr_size - 1) == UINT64_MAX) {
+    return -1;
+  }
+  store_len(blocked, mmr_size);
+  return mmr_initialize_store_context(ctx, mmr_size, &blocked->store, merge);
+}
@@ -0,0 +1,81 @@
+/* Mountain merkle range
+ * subtree blocked store
+ *
+ * Copyright 2019 Jiang Jinyang <jjyruby@gmail.com>
+ * under MIT license
+ */
+
+#ifndef MMR_BLOCKED_H
+#define MMR_BLOCKED_H
+
+#include "mmr.h"
+
+/* layout:
+ *
+ * heights are split into bands of MMR_BLOCK_LEVELS, band b has the heights
+ * 7b..7b+6. a block holds a perfect subtree of a band, 64 nodes at its lowest
+ * height up to the one node at its highest, level by level, so a block is
+ * 127 nodes plus a pad, 4KB with 32 bytes hashes.
+ *
+ * the blocks of a band are in index order, the bands are one after another
+ * and are sized for max_leaves. a path from a leaf to its peak crosses one
+ * block per band, a proof touches O(log n / 7) pages instead of a page per
+ * height in the postorder layout of tree_buf.
+ *
+ * positions are translated to blocks by the store, contexts on it use the
+ * same positions and proofs as contexts on tree_buf.
+ */
+#define MMR_BLOCK_LEVELS 7
+#define MMR_BLOCK_NODES 128
+#define MMR_BLOCK_SIZE (MMR_BLOCK_NODES * HASH_SIZE)
+/* 64 heights of uint64_t leaf counts */
+#define MMR_BLOCK_MAX_BANDS ((64 + MMR_BLOCK_LEVELS - 1) / MMR_BLOCK_LEVELS)
+
+typedef struct MMRBlocked {
+  /* blocks buffer, allocate with mmr_blocked_buf_size */
+  uint8_t (*blocks)[MMR_BLOCK_NODES][HASH_SIZE];
+  uint64_t max_leaves;
+  /* first block of each band */
+  uint64_t band_offset[MMR_BLOCK_MAX_BANDS];
+  /* nodes in the store, may be greater than mmr_size during a push, stored
+   * with release for the readers of snapshots */
+  uint64_t len;
+  /* the store to use with mmr_initialize_store_context */
+  MMRStore store;
+} MMRBlocked;
+
+/* return the bytes of a blocks buffer to hold mmr of max_leaves */
+uint64_t mmr_blocked_buf_size(uint64_t max_leaves);
+
+/* initialize an empty blocked store
+ * return -1 if buf_size is less than mmr_blocked_buf_size(max_leaves)
+ * buf: blocks buffer, align it to MMR_BLOCK_SIZE to have a block per page
+ * buf_size: size of buf in bytes
+ * max_leaves: the max leaf count of the mmr
+ */
+int mmr_blocked_init(MMRBlocked *blocked, void *buf, uint64_t buf_size,
+                     uint64_t max_leaves);
+
+/* return the index of pos in the buffer, counted in nodes,
+ * or UINT64_MAX if pos is beyond max_leaves
+ */
+uint64_t mmr_blocked_node_index(MMRBlocked *blocked, uint64_t pos);
+
+/* copy nodes in postorder into the store, return -1 if they don't fit
+ * tree_buf: nodes of a mmr, indexed by position
+ * mmr_size: the size of the mmr in tree_buf
+ */
+int mmr_blocked_load(MMRBlocked *blocked, uint8_t tree_buf[][HASH_SIZE],
+                     uint64_t mmr_size);
+
+/* Initialize MMRContext on a blocked store
+ * mmr_size: the current size of mmr, the nodes under it must be in the store
+ * merge: a function to merge left node hash and right node hash
+ */
+int mmr_blocked_initialize_context(MMRContext *ctx, MMRBlocked *blocked,
+                                   uint64_t mmr_size,
+                                   void(merge)(uint8_t dst[HASH_SIZE],
+                                               uint8_t right[HASH_SIZE],
+                                               uint8_t left[HASH_SIZE]));
+
+#endif
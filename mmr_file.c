@@ -0,0 +1,269 @@
+/* Mountain merkle range
+ * file backed store
+ *
+ * Copyright 2019 Jiang Jinyang <jjyruby@gmail.com>
+ * under MIT license
+ */
+
+#include "mmr_file.h"
+#include "fcntl.h"
+#include "string.h"
+#include "sys/mman.h"
+#include "sys/stat.h"
+#include "unistd.h"
+
+#define MMR_FILE_MAGIC "MMRNODES"
+/* grow the file by at least this many nodes */
+#define MMR_FILE_GROW_NODES ((uint64_t)1 << 16)
+
+/* helper functions */
+
+static uint32_t load_le32(const uint8_t *p) {
+  return (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 |
+         (uint32_t)p[3] << 24;
+}
+
+static void store_le32(uint8_t *p, uint32_t v) {
+  for (int i = 0; i < 4; i++) {
+    p[i] = (uint8_t)(v >> (8 * i));
+  }
+}
+
+static uint64_t to_le64(uint64_t v) {
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+  return __builtin_bswap64(v);
+#else
+  return v;
+#endif
+}
+
+/* mmr_size is read and written as one word, so processes sharing the
+ * mapping never see a torn value, and the nodes of a push are visible
+ * before the size that covers them. */
+static uint64_t load_mmr_size(MMRFile *file) {
+  uint64_t *p = (uint64_t *)(file->map + 16);
+  return to_le64(__atomic_load_n(p, __ATOMIC_ACQUIRE));
+}
+
+static void store_mmr_size(MMRFile *file, uint64_t mmr_size) {
+  uint64_t *p = (uint64_t *)(file->map + 16);
+  __atomic_store_n(p, to_le64(mmr_size), __ATOMIC_RELEASE);
+}
+
+static uint64_t node_offset(uint64_t pos) {
+  return MMR_FILE_HEADER_SIZE + pos * HASH_SIZE;
+}
+
+static uint64_t mapped_nodes(MMRFile *file) {
+  return (file->map_size - MMR_FILE_HEADER_SIZE) / HASH_SIZE;
+}
+
+/* map the file at map_size, the old mapping is only unmapped once the new
+ * one is in place, so a failure leaves the file as it was */
+static int map_file(MMRFile *file, uint64_t map_size) {
+  int prot = PROT_READ;
+  if (file->flags & MMR_FILE_WRITE) {
+    prot |= PROT_WRITE;
+  }
+  void *map = mmap(NULL, map_size, prot, MAP_SHARED, file->fd, 0);
+  if (map == MAP_FAILED) {
+    return -1;
+  }
+  if (file->map != NULL) {
+    munmap(file->map, file->map_size);
+  }
+  file->map = (uint8_t *)map;
+  file->map_size = map_size;
+  return 0;
+}
+
+/* extend the file and the mapping to hold at least nodes */
+static int grow_file(MMRFile *file, uint64_t nodes) {
+  uint64_t capacity = mapped_nodes(file) * 2;
+  if (capacity < nodes + MMR_FILE_GROW_NODES) {
+    capacity = nodes + MMR_FILE_GROW_NODES;
+  }
+  uint64_t map_size = node_offset(capacity);
+  if (ftruncate(file->fd, (off_t)map_size) != 0) {
+    return -1;
+  }
+  return map_file(file, map_size);
+}
+
+static int file_get(void *data, uint64_t pos, uint8_t dst[HASH_SIZE]) {
+  MMRFile *file = (MMRFile *)data;
+  if (file->map == NULL || pos >= file->len) {
+    return -1;
+  }
+  memcpy(dst, file->map + node_offset(pos), HASH_SIZE);
+  return 0;
+}
+
+static int file_batch_get(void *data, const uint64_t *pos, size_t n,
+                          uint8_t dst[][HASH_SIZE]) {
+  MMRFile *file = (MMRFile *)data;
+  if (file->map == NULL) {
+    return -1;
+  }
+  for (size_t i = 0; i < n; i++) {
+    if (pos[i] >= file->len) {
+      return -1;
+    }
+    memcpy(dst[i], file->map + node_offset(pos[i]), HASH_SIZE);
+  }
+  return 0;
+}
+
+static int file_append(void *data, uint64_t pos, uint8_t elem[HASH_SIZE]) {
+  MMRFile *file = (MMRFile *)data;
+  if (file->map == NULL || !(file->flags & MMR_FILE_WRITE) ||
+      pos > file->len) {
+    return -1;
+  }
+  if (pos >= mapped_nodes(file) && grow_file(file, pos + 1) != 0) {
+    return -1;
+  }
+  memcpy(file->map + node_offset(pos), elem, HASH_SIZE);
+  file->len = pos + 1;
+  /* the push is complete if the next position is a leaf */
+  if (mmr_pos_height(pos + 1) == 0) {
+    store_mmr_size(file, pos + 1);
+  }
+  return 0;
+}
+
+static int file_truncate(void *data, uint64_t mmr_size) {
+  MMRFile *file = (MMRFile *)data;
+  if (file->map == NULL || !(file->flags & MMR_FILE_WRITE) ||
+      mmr_size > file->len) {
+    return -1;
+  }
+  file->len = mmr_size;
+  store_mmr_size(file, mmr_size);
+  return 0;
+}
+
+/* file API */
+
+/* open a file backed store
+ * return -1 if failed to open or the file is not a valid MMR file.
+ * path: path of the file
+ * flags: MMR_FILE_READ_ONLY, or MMR_FILE_WRITE optionally with MMR_FILE_CREATE
+ */
+int mmr_file_open(MMRFile *file, const char *path, int flags) {
+  int oflags = (flags & MMR_FILE_WRITE) ? O_RDWR : O_RDONLY;
+  if (flags & MMR_FILE_CREATE) {
+    if (!(flags & MMR_FILE_WRITE)) {
+      return -1;
+    }
+    oflags |= O_CREAT | O_TRUNC;
+  }
+  int fd = open(path, oflags, 0644);
+  if (fd < 0) {
+    return -1;
+  }
+  file->fd = fd;
+  file->flags = flags;
+  file->map = NULL;
+  file->map_size = 0;
+  if (flags & MMR_FILE_CREATE) {
+    uint8_t header[MMR_FILE_HEADER_SIZE];
+    memset(header, 0, MMR_FILE_HEADER_SIZE);
+    memcpy(header, MMR_FILE_MAGIC, 8);
+    store_le32(header + 8, MMR_FILE_VERSION);
+    store_le32(header + 12, HASH_SIZE);
+    if (write(fd, header, MMR_FILE_HEADER_SIZE) != MMR_FILE_HEADER_SIZE) {
+      close(fd);
+      return -1;
+    }
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0 || st.st_size < MMR_FILE_HEADER_SIZE ||
+      map_file(file, (uint64_t)st.st_size) != 0) {
+    close(fd);
+    return -1;
+  }
+  if (memcmp(file->map, MMR_FILE_MAGIC, 8) != 0 ||
+      load_le32(file->map + 8) != MMR_FILE_VERSION ||
+      load_le32(file->map + 12) != HASH_SIZE ||
+      load_mmr_size(file) > mapped_nodes(file)) {
+    munmap(file->map, file->map_size);
+    close(fd);
+    return -1;
+  }
+  /* nodes after mmr_size are from an incomplete push, overwrite them */
+  file->len = load_mmr_size(file);
+  file->store.data = file;
+  file->store.get = file_get;
+  file->store.append = file_append;
+  file->store.batch_get = file_batch_get;
+  file->store.truncate = file_truncate;
+  /* the map is replaced when the file grows */
+  file->store.concurrent_get = 0;
+  return 0;
+}
+
+/* return the mmr_size recorded in the file */
+uint64_t mmr_file_mmr_size(MMRFile *file) {
+  return file->map == NULL ? 0 : load_mmr_size(file);
+}
+
+/* Initialize MMRContext on a file at the recorded mmr_size
+ * merge: a function to merge left node hash and right node hash
+ */
+int mmr_file_initialize_context(MMRContext *ctx, MMRFile *file,
+                                void(merge)(uint8_t dst[HASH_SIZE],
+                                            uint8_t right[HASH_SIZE],
+                                            uint8_t left[HASH_SIZE])) {
+  return mmr_initialize_store_context(ctx, mmr_file_mmr_size(file),
+                                      &file->store, merge);
+}
+
+/* remap a file to see the nodes appended by another process,
+ * return the recorded mmr_size, or 0 if failed to remap
+ */
+uint64_t mmr_file_refresh(MMRFile *file) {
+  struct stat st;
+  if (file->map == NULL || fstat(file->fd, &st) != 0) {
+    return 0;
+  }
+  /* the old mapping is kept if the remap fails */
+  if ((uint64_t)st.st_size > file->map_size &&
+      map_file(file, (uint64_t)st.st_size) != 0) {
+    return 0;
+  }
+  uint64_t mmr_size = load_mmr_size(file);
+  if (!(file->flags & MMR_FILE_WRITE)) {
+    file->len = mmr_size;
+  }
+  return mmr_size;
+}
+
+/* flush the mapping to disk
+ * return -1 if failed
+ */
+int mmr_file_sync(MMRFile *file) {
+  if (file->map == NULL) {
+    return -1;
+  }
+  return msync(file->map, file->map_size, MS_SYNC) == 0 ? 0 : -1;
+}
+
+/* unmap and close a file, a writable file is truncated to its nodes */
+void mmr_file_close(MMRFile *file) {
+  /* the size is unknown without a mapping, keep the nodes then */
+  if (file->map != NULL) {
+    uint64_t mmr_size = load_mmr_size(file);
+    munmap(file->map, file->map_size);
+    if (file->flags & MMR_FILE_WRITE) {
+      /* a failed truncate only leaves trailing space, which is ignored */
+      int ret = ftruncate(file->fd, (off_t)node_offset(mmr_size));
+      (void)ret;
+    }
+  }
+  close(file->fd);
+  file->map = NULL;
+  file->map_size = 0;
+  file->len = 0;
+  file->fd = -1;
+}
@@ -0,0 +1,81 @@
+/* Mountain merkle range
+ * file backed store
+ *
+ * Copyright 2019 Jiang Jinyang <jjyruby@gmail.com>
+ * under MIT license
+ */
+
+#ifndef MMR_FILE_H
+#define MMR_FILE_H
+
+#include "mmr.h"
+
+/* file layout, integers are little endian:
+ *
+ * offset  size  field
+ * 0       8     magic "MMRNODES"
+ * 8       4     version
+ * 12      4     hash size
+ * 16      8     mmr_size
+ * 24      40    reserved, zero
+ * 64            nodes, HASH_SIZE bytes each, in position order
+ *
+ * mmr_size is only advanced when a push is complete, so a file is always a
+ * valid MMR even if the writer dies in the middle of a push. mmr_truncate sets
+ * it back, the nodes after it are overwritten by the following pushes.
+ */
+#define MMR_FILE_VERSION 1
+#define MMR_FILE_HEADER_SIZE 64
+
+/* open flags */
+#define MMR_FILE_READ_ONLY 0
+#define MMR_FILE_WRITE 1
+/* create the file, or truncate it to an empty MMR */
+#define MMR_FILE_CREATE 2
+
+typedef struct MMRFile {
+  int fd;
+  int flags;
+  /* mapping of the whole file, header included */
+  uint8_t *map;
+  uint64_t map_size;
+  /* nodes in the file, may be greater than mmr_size during a push */
+  uint64_t len;
+  /* the store to use with mmr_initialize_store_context */
+  MMRStore store;
+} MMRFile;
+
+/* open a file backed store
+ * the file is memory mapped, nothing is read until a node is accessed. a
+ * read only file can be mapped by many processes while one process appends.
+ * return -1 if failed to open or the file is not a valid MMR file.
+ * path: path of the file
+ * flags: MMR_FILE_READ_ONLY, or MMR_FILE_WRITE optionally with MMR_FILE_CREATE
+ */
+int mmr_file_open(MMRFile *file, const char *path, int flags);
+
+/* return the mmr_size recorded in the file */
+uint64_t mmr_file_mmr_size(MMRFile *file);
+
+/* Initialize MMRContext on a file at the recorded mmr_size
+ * merge: a function to merge left node hash and right node hash
+ */
+int mmr_file_initialize_context(MMRContext *ctx, MMRFile *file,
+                                void(merge)(uint8_t dst[HASH_SIZE],
+                                            uint8_t right[HASH_SIZE],
+                                            uint8_t left[HASH_SIZE]));
+
+/* remap a file to see the nodes appended by another process,
+ * return the recorded mmr_size, or 0 if failed to remap
+ */
+uint64_t mmr_file_refresh(MMRFile *file);
+
+/* flush the mapping to disk
+ * return -1 if failed
+ */
+int mmr_file_sync(MMRFile *file);
+
+/* unmap and close a file, a writable file is truncated to its nodes */
+void mmr_file_close(MMRFile *file);
+
+#endif
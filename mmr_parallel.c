@@ -0,0 +1,347 @@
+/* Mountain merkle range
+ * multi-threaded build
+ *
+ * Copyright 2019 Jiang Jinyang <jjyruby@gmail.com>
+ * under MIT license
+ */
+
+#include "mmr_parallel.h"
+#include "string.h"
+
+/* helper functions */
+
+typedef struct BuildJob {
+  MMRContext *ctx;
+  uint8_t (*leaves)[HASH_SIZE];
+  /* leaf index of leaves[0] */
+  uint64_t first_leaf;
+  uint32_t block_height;
+  size_t blocks;
+  /* next block to build, shared by the threads */
+  size_t next_block;
+  int failed;
+} BuildJob;
+
+/* build blocks until none remains,
+ * a block is a perfect subtree, its nodes are contiguous in the postorder and
+ * laid out the same as a mmr of the block leaves, so it is pushed into a
+ * context over its slice of tree_buf */
+static void *build_blocks(void *arg) {
+  BuildJob *job = (BuildJob *)arg;
+  uint64_t block_leaves = (uint64_t)1 << job->block_height;
+  for (;;) {
+    size_t block = __atomic_fetch_add(&job->next_block, 1, __ATOMIC_RELAXED);
+    if (block >= job->blocks) {
+      break;
+    }
+    uint64_t offset = block * block_leaves;
+    uint64_t start_pos = mmr_leaf_index_to_pos(job->first_leaf + offset);
+    MMRContext sub_ctx;
+    if (mmr_initialize_context(&sub_ctx, 0, &job->ctx->tree_buf[start_pos],
+                               2 * block_leaves - 1, job->ctx->merge) != 0) {
+      __atomic_store_n(&job->failed, 1, __ATOMIC_RELAXED);
+      break;
+    }
+    sub_ctx.merge_many = job->ctx->merge_many;
+    if (mmr_push_batch(&sub_ctx, &job->leaves[offset], block_leaves) != 0) {
+      __atomic_store_n(&job->failed, 1, __ATOMIC_RELAXED);
+      break;
+    }
+  }
+  return NULL;
+}
+
+/* run worker on nthreads threads, the calling thread is one of them, so
+ * nthreads - 1 are started and no work is left behind if one failed to
+ * start */
+static void run_threads(void *(*worker)(void *), void *job, size_t nthreads) {
+  if (nthreads > MMR_PARALLEL_MAX_THREADS) {
+    nthreads = MMR_PARALLEL_MAX_THREADS;
+  }
+  pthread_t threads[MMR_PARALLEL_MAX_THREADS - 1];
+  size_t started = 0;
+  for (; started + 1 < nthreads; started++) {
+    if (pthread_create(&threads[started], NULL, worker, job) != 0) {
+      break;
+    }
+  }
+  worker(job);
+  for (size_t i = 0; i < started; i++) {
+    pthread_join(threads[i], NULL);
+  }
+}
+
+static void *pool_thread(void *arg) {
+  MMRThreadPool *pool = (MMRThreadPool *)arg;
+  uint64_t generation = 0;
+  pthread_mutex_lock(&pool->lock);
+  for (;;) {
+    while (!pool->stop && pool->generation == generation) {
+      pthread_cond_wait(&pool->job_cond, &pool->lock);
+    }
+    if (pool->stop) {
+      break;
+    }
+    generation = pool->generation;
+    void *(*worker)(void *) = pool->worker;
+    void *job = pool->job;
+    pthread_mutex_unlock(&pool->lock);
+    worker(job);
+    pthread_mutex_lock(&pool->lock);
+    if (--pool->running == 0) {
+      pthread_cond_signal(&pool->done_cond);
+    }
+  }
+  pthread_mutex_unlock(&pool->lock);
+  return NULL;
+}
+
+/* run worker on the pool threads and the calling thread, return after all of
+ * them finished */
+static void run_pool(MMRThreadPool *pool, void *(*worker)(void *),
+                     void *job) {
+  if (pool == NULL || pool->len == 0) {
+    worker(job);
+    return;
+  }
+  pthread_mutex_lock(&pool->lock);
+  pool->worker = worker;
+  pool->job = job;
+  pool->generation++;
+  pool->running = pool->len;
+  pthread_cond_broadcast(&pool->job_cond);
+  pthread_mutex_unlock(&pool->lock);
+  worker(job);
+  pthread_mutex_lock(&pool->lock);
+  while (pool->running > 0) {
+    pthread_cond_wait(&pool->done_cond, &pool->lock);
+  }
+  pthread_mutex_unlock(&pool->lock);
+}
+
+typedef struct ForestJob {
+  MMRForest *forest;
+  uint8_t (*const *leaves)[HASH_SIZE];
+  const size_t *n;
+  /* next shard, shared by the threads */
+  size_t next_shard;
+  int failed;
+} ForestJob;
+
+static size_t next_shard(ForestJob *job) {
+  return __atomic_fetch_add(&job->next_shard, 1, __ATOMIC_RELAXED);
+}
+
+static void *push_shards(void *arg) {
+  ForestJob *job = (ForestJob *)arg;
+  for (size_t i = next_shard(job); i < job->forest->len; i = next_shard(job)) {
+    if (job->leaves[i] != NULL &&
+        mmr_push_batch(&job->forest->shards[i], job->leaves[i], job->n[i]) !=
+            0) {
+      __atomic_store_n(&job->failed, 1, __ATOMIC_RELAXED);
+    }
+  }
+  return NULL;
+}
+
+static void *root_shards(void *arg) {
+  ForestJob *job = (ForestJob *)arg;
+  MMRForest *forest = job->forest;
+  for (size_t i = next_shard(job); i < forest->len; i = next_shard(job)) {
+    if (forest->shards[i].mmr_size == 0) {
+      memset(forest->roots[i], 0, HASH_SIZE);
+    } else if (mmr_get_root(&forest->shards[i], forest->roots[i]) != 0) {
+      __atomic_store_n(&job->failed, 1, __ATOMIC_RELAXED);
+    }
+  }
+  return NULL;
+}
+
+/* MMR parallel API */
+
+int mmr_build_parallel(MMRContext *ctx, uint8_t leaves[][HASH_SIZE], size_t n,
+                       size_t nthreads) {
+  if (nthreads > MMR_PARALLEL_MAX_THREADS) {
+    nthreads = MMR_PARALLEL_MAX_THREADS;
+  }
+  if (ctx->store != NULL || nthreads <= 1) {
+    return mmr_push_batch(ctx, leaves, n);
+  }
+  /* the next leaf is at mmr_size, so its index is the leaf count */
+  uint64_t leaf_count = mmr_pos_to_leaf_index(ctx->mmr_size);
+  if (mmr_leaf_index_to_pos(leaf_count + n) > ctx->tree_buf_size) {
+    return -1;
+  }
+  /* the highest block height that still gives every thread enough blocks */
+  uint32_t block_height = 0;
+  while ((n >> (block_height + 1)) >=
+         nthreads * MMR_PARALLEL_BLOCKS_PER_THREAD) {
+    block_height++;
+  }
+  uint64_t block_leaves = (uint64_t)1 << block_height;
+  /* push leaves before the first aligned block */
+  size_t head = (size_t)(-leaf_count & (block_leaves - 1));
+  if (block_height == 0 || head >= n) {
+    return mmr_push_batch(ctx, leaves, n);
+  }
+  if (mmr_push_batch(ctx, leaves, head) != 0) {
+    return -1;
+  }
+  BuildJob job = {ctx, &leaves[head], leaf_count + head, block_height,
+                  (n - head) >> block_height, 0, 0};
+  run_threads(build_blocks, &job, nthreads);
+  if (job.failed) {
+    return -1;
+  }
+  /* merge the nodes above the blocks, then push the rest leaves */
+  uint64_t built = (uint64_t)job.blocks << block_height;
+  if (mmr_push_subtrees(ctx, built, block_height) != 0) {
+    return -1;
+  }
+  return mmr_push_batch(ctx, &leaves[head + built], n - head - built);
+}
+
+/* thread pool API */
+
+int mmr_thread_pool_init(MMRThreadPool *pool, size_t nthreads) {
+  if (nthreads > MMR_PARALLEL_MAX_THREADS) {
+    nthreads = MMR_PARALLEL_MAX_THREADS;
+  }
+  pool->len = 0;
+  pool->worker = NULL;
+  pool->job = NULL;
+  pool->generation = 0;
+  pool->running = 0;
+  pool->stop = 0;
+  if (pthread_mutex_init(&pool->lock, NULL) != 0) {
+    return -1;
+  }
+  if (pthread_cond_init(&pool->job_cond, NULL) != 0) {
+    pthread_mutex_destroy(&pool->lock);
+    return -1;
+  }
+  if (pthread_cond_init(&pool->done_cond, NULL) != 0) {
+    pthread_cond_destroy(&pool->job_cond);
+    pthread_mutex_destroy(&pool->lock);
+    return -1;
+  }
+  while (pool->len + 1 < nthreads &&
+         pthread_create(&pool->threads[pool->len], NULL, pool_thread, pool) ==
+             0) {
+    pool->len++;
+  }
+  return 0;
+}
+
+void mmr_thread_pool_free(MMRThreadPool *pool) {
+  pthread_mutex_lock(&pool->lock);
+  pool->stop = 1;
+  pthread_cond_broadcast(&pool->job_cond);
+  pthread_mutex_unlock(&pool->lock);
+  for (size_t i = 0; i < pool->len; i++) {
+    pthread_join(pool->threads[i], NULL);
+  }
+  pthread_cond_destroy(&pool->done_cond);
+  pthread_cond_destroy(&pool->job_cond);
+  pthread_mutex_destroy(&pool->lock);
+  pool->len = 0;
+}
+
+/* MMR forest API */
+
+int mmr_forest_init(MMRForest *forest, MMRContext shards[], size_t len,
+                    void(merge)(uint8_t dst[HASH_SIZE],
+                                uint8_t right[HASH_SIZE],
+                                uint8_t left[HASH_SIZE])) {
+  if (len == 0 || len > MMR_FOREST_MAX_SHARDS) {
+    return -1;
+  }
+  forest->shards = shards;
+  forest->len = len;
+  forest->top_valid = 0;
+  return mmr_initialize_context(&forest->top, 0, forest->top_tree,
+                                2 * MMR_FOREST_MAX_SHARDS, merge);
+}
+
+void mmr_forest_set_merge_many(MMRForest *forest,
+                               void(merge_many)(uint8_t *dst[], uint8_t *left[],
+                                                uint8_t *right[], size_t n)) {
+  mmr_set_merge_many(&forest->top, merge_many);
+}
+
+int mmr_forest_push(MMRForest *forest, uint8_t (*const leaves[])[HASH_SIZE],
+                    const size_t n[], MMRThreadPool *pool) {
+  ForestJob job = {forest, leaves, n, 0, 0};
+  forest->top_valid = 0;
+  run_pool(pool, push_shards, &job);
+  return job.failed ? -1 : 0;
+}
+
+int mmr_forest_get_root(MMRForest *forest, uint8_t dst[HASH_SIZE],
+                        MMRThreadPool *pool) {
+  ForestJob job = {forest, NULL, NULL, 0, 0};
+  forest->top_valid = 0;
+  run_pool(pool, root_shards, &job);
+  if (job.failed) {
+    return -1;
+  }
+  /* the top is small, rebuild it from the roots */
+  if (mmr_truncate(&forest->top, 0) != 0 ||
+      mmr_push_batch(&forest->top, forest->roots, forest->len) != 0 ||
+      mmr_get_root(&forest->top, dst) != 0) {
+    return -1;
+  }
+  forest->top_valid = 1;
+  return 0;
+}
+
+int mmr_forest_gen_proof(MMRForest *forest, size_t shard, uint64_t pos,
+                         uint8_t proof[][HASH_SIZE], size_t *proof_max_len) {
+  if (!forest->top_valid || shard >= forest->len ||
+      pos >= forest->shards[shard].mmr_size) {
+    return -1;
+  }
+  size_t shard_len = *proof_max_len;
+  if (mmr_gen_proof(&forest->shards[shard], proof, &shard_len, pos) != 0) {
+    return -1;
+  }
+  size_t top_len = *proof_max_len - shard_len;
+  if (mmr_gen_proof_by_leaf_index(&forest->top, &proof[shard_len], &top_len,
+                                  shard) != 0) {
+    return -1;
+  }
+  *proof_max_len = shard_len + top_len;
+  return 0;
+}
+
+int mmr_forest_verify_proof(MMRVerifyContext *ctx, uint8_t root_hash[HASH_SIZE],
+                            size_t shards, size_t shard,
+                            uint64_t shard_mmr_size,
+                            uint8_t leaf_hash[HASH_SIZE], uint64_t pos,
+                            uint8_t proof[][HASH_SIZE], size_t proof_len) {
+  if (shard >= shards || pos >= shard_mmr_size || mmr_pos_height(pos) != 0) {
+    return -1;
+  }
+  /* the shard proof is the siblings to the peak of pos, the bag of the rhs
+   * peaks if any, then the left peaks */
+  uint64_t peaks[MMR_MAX_PEAKS];
+  size_t peaks_len = mmr_peaks_from_size(shard_mmr_size, peaks);
+  size_t peak = 0;
+  while (peak < peaks_len && peaks[peak] < pos) {
+    peak++;
+  }
+  if (peak == peaks_len) {
+    return -1;
+  }
+  size_t shard_len = mmr_pos_height(peaks[peak]) +
+                     (peak + 1 < peaks_len ? 1 : 0) + peak;
+  if (shard_len > proof_len) {
+    return -1;
+  }
+  uint8_t shard_root[HASH_SIZE];
+  mmr_compute_proof_root(ctx, shard_root, shard_mmr_size, leaf_hash, pos,
+                         proof, shard_len);
+  return mmr_verify_proof_by_leaf_index(ctx, root_hash, shards, shard_root,
+                                        shard, &proof[shard_len],
+                                        proof_len - shard_len);
+}
@@ -0,0 +1,161 @@
+/* Mountain merkle range
+ * multi-threaded build
+ *
+ * Copyright 2019 Jiang Jinyang <jjyruby@gmail.com>
+ * under MIT license
+ */
+
+#ifndef MMR_PARALLEL_H
+#define MMR_PARALLEL_H
+
+#include "mmr.h"
+#include "pthread.h"
+
+/* at most this many threads, the calling thread included, work on a build */
+#define MMR_PARALLEL_MAX_THREADS 256
+/* each thread builds at least this many subtrees, so threads which finish
+ * early take the remaining ones */
+#define MMR_PARALLEL_BLOCKS_PER_THREAD 4
+
+/* push leaves with multiple threads
+ * the leaves are split into aligned perfect subtrees, each subtree is built by
+ * a thread directly at its positions in tree_buf, then the nodes above the
+ * subtrees are merged by the calling thread. tree_buf is the same as pushing
+ * the leaves one by one. contexts with a store push on the calling thread.
+ * merge and merge_many of the context are called from all threads.
+ * return -1 if tree_buf is not enough
+ * leaves: an array of 32 bytes hash represented leaves
+ * n: length of leaves
+ * nthreads: number of threads to use, 0 or 1 to push on the calling thread
+ */
+int mmr_build_parallel(MMRContext *ctx, uint8_t leaves[][HASH_SIZE], size_t n,
+                       size_t nthreads);
+
+/* thread pool
+ * the threads of a pool are started once and wait for jobs, so repeated
+ * forest pushes and roots don't pay for thread creation. a pool runs one job
+ * at a time, the calling thread works on it too.
+ */
+
+typedef struct MMRThreadPool {
+  pthread_t threads[MMR_PARALLEL_MAX_THREADS - 1];
+  /* number of started threads */
+  size_t len;
+  pthread_mutex_t lock;
+  pthread_cond_t job_cond;
+  pthread_cond_t done_cond;
+  /* the current job, a new job increases generation */
+  void *(*worker)(void *);
+  void *job;
+  uint64_t generation;
+  /* threads still working on the current job */
+  size_t running;
+  int stop;
+} MMRThreadPool;
+
+/* start the threads of a pool
+ * a pool of nthreads threads starts nthreads - 1 threads, fewer if a thread
+ * failed to start, the jobs still run on the calling thread then.
+ * return -1 if failed to initialize the lock
+ * nthreads: number of threads to work on a job, 0 or 1 to run the jobs on the
+ * calling thread
+ */
+int mmr_thread_pool_init(MMRThreadPool *pool, size_t nthreads);
+
+/* stop and join the threads of a pool */
+void mmr_thread_pool_free(MMRThreadPool *pool);
+
+/* forest of mmrs
+ * a forest holds one context per shard, the shard roots are the leaves of a
+ * top mmr in shard order and its root commits to the forest. an empty shard
+ * has a zero root. a leaf is proved by its shard proof followed by the top
+ * proof of the shard root.
+ * the shards are independent, each is pushed and bagged on one thread, so
+ * the contexts must not share a tree_buf or a store.
+ */
+
+/* at most this many shards in a forest */
+#define MMR_FOREST_MAX_SHARDS 256
+
+typedef struct MMRForest {
+  MMRContext *shards;
+  size_t len;
+  /* the top mmr over the shard roots, it points into the forest so a forest
+   * is not moved after init */
+  MMRContext top;
+  uint8_t top_tree[2 * MMR_FOREST_MAX_SHARDS][HASH_SIZE];
+  uint8_t roots[MMR_FOREST_MAX_SHARDS][HASH_SIZE];
+  /* the top is built from the current shard roots */
+  int top_valid;
+} MMRForest;
+
+/* initialize a forest over initialized contexts
+ * return -1 if len is 0 or greater than MMR_FOREST_MAX_SHARDS
+ * shards: contexts of the shards, kept by the forest
+ * len: number of shards
+ * merge: a function to merge the nodes of the top mmr
+ */
+int mmr_forest_init(MMRForest *forest, MMRContext shards[], size_t len,
+                    void(merge)(uint8_t dst[HASH_SIZE],
+                                uint8_t right[HASH_SIZE],
+                                uint8_t left[HASH_SIZE]));
+
+/* set the batched merge of the top mmr, see mmr_set_merge_many */
+void mmr_forest_set_merge_many(MMRForest *forest,
+                               void(merge_many)(uint8_t *dst[], uint8_t *left[],
+                                                uint8_t *right[], size_t n));
+
+/* push leaves to every shard, the shards are pushed in parallel
+ * a shard which fails is left as mmr_push_batch leaves it, the others are
+ * pushed. the forest root is stale until mmr_forest_get_root.
+ * return -1 if a shard failed to push
+ * leaves: leaves of each shard, NULL for a shard without leaves
+ * n: number of leaves of each shard
+ * pool: threads to push on, NULL to push on the calling thread
+ */
+int mmr_forest_push(MMRForest *forest, uint8_t (*const leaves[])[HASH_SIZE],
+                    const size_t n[], MMRThreadPool *pool);
+
+/* compute the forest root
+ * the shard roots are computed in parallel, then merged into the top mmr
+ * height by height with merge_many.
+ * return -1 if failed to read a shard
+ * dst: a 32 bytes buf to receive the forest root
+ * pool: threads to compute on, NULL to compute on the calling thread
+ */
+int mmr_forest_get_root(MMRForest *forest, uint8_t dst[HASH_SIZE],
+                        MMRThreadPool *pool);
+
+/* generate the proof of a leaf in a shard against the forest root
+ * proof is the mmr_gen_proof of the leaf in its shard, then the proof of the
+ * shard root in the top mmr.
+ * return -1 if the forest root is stale, pos is not in the shard, proof
+ * length is not enough, or the shard proof failed
+ * shard: index of the shard
+ * pos: position of the leaf in the shard
+ * proof: a array of 32 bytes buf to receive the proof
+ * proof_max_len: length of proof buf, will be set to the actual len of proof.
+ */
+int mmr_forest_gen_proof(MMRForest *forest, size_t shard, uint64_t pos,
+                         uint8_t proof[][HASH_SIZE], size_t *proof_max_len);
+
+/* verify a proof of mmr_forest_gen_proof
+ * the shard proof length follows from shard_mmr_size and pos, so the shard
+ * root and the forest root are computed in one pass over proof.
+ * return 0 if the proof is valid, otherwise return -1
+ * root_hash: 32 bytes forest root
+ * shards: number of shards of the forest
+ * shard: index of the shard
+ * shard_mmr_size: size of the shard to generate this proof
+ * leaf_hash: 32 bytes hash of leaf
+ * pos: position of the leaf in the shard
+ * proof: an array of 32 bytes hash
+ * proof_len: length of proof
+ */
+int mmr_forest_verify_proof(MMRVerifyContext *ctx, uint8_t root_hash[HASH_SIZE],
+                            size_t shards, size_t shard,
+                            uint64_t shard_mmr_size,
+                            uint8_t leaf_hash[HASH_SIZE], uint64_t pos,
+                            uint8_t proof[][HASH_SIZE], size_t proof_len);
+
+#endif
@@ -0,0 +1,248 @@
+/* Mountain merkle range
+ * serialized proofs
+ *
+ * Copyright 2019 Jiang Jinyang <jjyruby@gmail.com>
+ * under MIT license
+ */
+
+#include "mmr_proof.h"
+#include "stdint.h"
+#include "string.h"
+
+#define MMR_PROOF_MAGIC "MMRP"
+#define MMR_PROOF_KIND_MASK 3
+
+/* helper functions */
+
+static uint64_t load_le(const uint8_t *p, int bytes) {
+  uint64_t v = 0;
+  for (int i = bytes - 1; i >= 0; i--) {
+    v = (v << 8) | p[i];
+  }
+  return v;
+}
+
+static void store_le(uint8_t *p, uint64_t v, int bytes) {
+  for (int i = 0; i < bytes; i++) {
+    p[i] = (uint8_t)(v >> (8 * i));
+  }
+}
+
+/* offset of the first proof hash */
+static size_t items_offset(uint32_t kind, size_t count) {
+  size_t offset = MMR_PROOF_HEADER_SIZE;
+  if (kind == MMR_PROOF_BATCH) {
+    offset += count * 8;
+  }
+  return offset;
+}
+
+/* write the header and the proof hashes, the positions are left to batch */
+static int encode(uint8_t *buf, size_t *buf_len, uint32_t kind,
+                  uint64_t mmr_size, uint64_t pos, size_t count,
+                  uint8_t proof[][HASH_SIZE], size_t proof_len) {
+  if (count > UINT32_MAX || proof_len > UINT32_MAX) {
+    return -1;
+  }
+  size_t size = mmr_proof_encoded_size(kind, count, proof_len);
+  if (size > *buf_len) {
+    return -1;
+  }
+  memcpy(buf, MMR_PROOF_MAGIC, 4);
+  buf[4] = MMR_PROOF_VERSION;
+  buf[5] = HASH_SIZE;
+  store_le(buf + 6, kind, 2);
+  store_le(buf + 8, mmr_size, 8);
+  store_le(buf + 16, pos, 8);
+  store_le(buf + 24, count, 4);
+  store_le(buf + 28, proof_len, 4);
+  memcpy(buf + items_offset(kind, count), proof, proof_len * HASH_SIZE);
+  *buf_len = size;
+  return 0;
+}
+
+/* proof hashes of an encoded proof, the merge functions never write to their
+ * left and right inputs, so a read only buf is passed as is */
+static uint8_t (*encoded_items(const uint8_t *buf,
+                               const MMRProofHeader *header))[HASH_SIZE] {
+  const uint8_t *items = buf + items_offset(header->kind, header->count);
+  return (uint8_t(*)[HASH_SIZE])(uintptr_t)items;
+}
+
+/* proof API */
+
+/* return the encoded size of a proof
+ * kind: MMR_PROOF_SINGLE, MMR_PROOF_BATCH or MMR_PROOF_RANGE
+ * count: number of leaves proved
+ * items: length of proof
+ */
+size_t mmr_proof_encoded_size(uint32_t kind, size_t count, size_t items) {
+  return items_offset(kind, count) + items * HASH_SIZE;
+}
+
+/* encode a proof of mmr_gen_proof
+ * return -1 if buf is not enough
+ * buf_len: length of buf, will be set to the encoded length
+ */
+int mmr_encode_proof(uint8_t *buf, size_t *buf_len, uint64_t mmr_size,
+                     uint64_t pos, uint8_t proof[][HASH_SIZE],
+                     size_t proof_len) {
+  return encode(buf, buf_len, MMR_PROOF_SINGLE, mmr_size, pos, 1, proof,
+                proof_len);
+}
+
+/* encode a proof of mmr_gen_batch_proof
+ * return -1 if buf is not enough
+ * buf_len: length of buf, will be set to the encoded length
+ */
+int mmr_encode_batch_proof(uint8_t *buf, size_t *buf_len, uint64_t mmr_size,
+                           const uint64_t positions[], size_t n,
+                           uint8_t proof[][HASH_SIZE], size_t proof_len) {
+  if (encode(buf, buf_len, MMR_PROOF_BATCH, mmr_size, 0, n, proof,
+             proof_len) != 0) {
+    return -1;
+  }
+  for (size_t i = 0; i < n; i++) {
+    store_le(buf + MMR_PROOF_HEADER_SIZE + i * 8, positions[i], 8);
+  }
+  return 0;
+}
+
+/* encode a proof of mmr_gen_range_proof
+ * return -1 if buf is not enough
+ * buf_len: length of buf, will be set to the encoded length
+ */
+int mmr_encode_range_proof(uint8_t *buf, size_t *buf_len, uint64_t mmr_size,
+                           uint64_t start, size_t n,
+                           uint8_t proof[][HASH_SIZE], size_t proof_len) {
+  return encode(buf, buf_len, MMR_PROOF_RANGE, mmr_size, start, n, proof,
+                proof_len);
+}
+
+/* decode the header of an encoded proof
+ * return -1 if buf is not a valid proof, or shorter than the proof
+ */
+int mmr_decode_proof_header(const uint8_t *buf, size_t buf_len,
+                            MMRProofHeader *header) {
+  if (buf_len < MMR_PROOF_HEADER_SIZE ||
+      memcmp(buf, MMR_PROOF_MAGIC, 4) != 0 || buf[4] != MMR_PROOF_VERSION ||
+      buf[5] != HASH_SIZE) {
+    return -1;
+  }
+  uint32_t flags = (uint32_t)load_le(buf + 6, 2);
+  header->kind = flags & MMR_PROOF_KIND_MASK;
+  if ((flags & ~MMR_PROOF_KIND_MASK) != 0 || header->kind > MMR_PROOF_RANGE) {
+    return -1;
+  }
+  header->mmr_size = load_le(buf + 8, 8);
+  header->pos = load_le(buf + 16, 8);
+  header->count = (uint32_t)load_le(buf + 24, 4);
+  header->items = (uint32_t)load_le(buf + 28, 4);
+  if ((header->kind == MMR_PROOF_SINGLE && header->count != 1) ||
+      (header->kind == MMR_PROOF_BATCH && header->pos != 0)) {
+    return -1;
+  }
+  /* count and items are 32 bits, the size never overflows */
+  if (mmr_proof_encoded_size(header->kind, header->count, header->items) >
+      buf_len) {
+    return -1;
+  }
+  return 0;
+}
+
+/* decode an encoded proof into arrays
+ * return -1 if buf is not a valid proof or the arrays are not enough
+ * positions: a buf to receive the positions of a batch proof, NULL for other
+ * kinds
+ * positions_len: length of positions, will be set to count
+ * proof: a array of 32 bytes buf to receive the proof
+ * proof_max_len: length of proof buf, will be set to the actual len of proof.
+ */
+int mmr_decode_proof(const uint8_t *buf, size_t buf_len,
+                     MMRProofHeader *header, uint64_t positions[],
+                     size_t *positions_len, uint8_t proof[][HASH_SIZE],
+                     size_t *proof_max_len) {
+  if (mmr_decode_proof_header(buf, buf_len, header) != 0 ||
+      header->items > *proof_max_len) {
+    return -1;
+  }
+  if (header->kind == MMR_PROOF_BATCH) {
+    if (positions == NULL || header->count > *positions_len) {
+      return -1;
+    }
+    for (size_t i = 0; i < header->count; i++) {
+      positions[i] = load_le(buf + MMR_PROOF_HEADER_SIZE + i * 8, 8);
+    }
+    *positions_len = header->count;
+  }
+  memcpy(proof, encoded_items(buf, header), header->items * HASH_SIZE);
+  *proof_max_len = header->items;
+  return 0;
+}
+
+/* compute root from an encoded proof
+ * the hashes are read from buf in place, buf may be read only, unaligned
+ * memory. check the positions in header are the leaves expected.
+ * return -1 if buf is not a valid proof, n is not the count of the proof, or
+ * the batch or range proof is invalid
+ * header: receive the header of the proof, may be NULL
+ * leaves: hashes of the leaves proved, in the order of the proof, used as
+ * working buf and overwritten for a batch or range proof
+ * positions: a buf of n positions to decode the positions of a batch proof
+ * into, NULL for other kinds
+ * n: length of leaves
+ */
+int mmr_compute_encoded_proof_root(MMRVerifyContext *ctx,
+                                   uint8_t root_hash[HASH_SIZE],
+                                   const uint8_t *buf, size_t buf_len,
+                                   MMRProofHeader *header,
+                                   uint8_t leaves[][HASH_SIZE],
+                                   uint64_t positions[], size_t n) {
+  MMRProofHeader decoded;
+  if (header == NULL) {
+    header = &decoded;
+  }
+  if (mmr_decode_proof_header(buf, buf_len, header) != 0 ||
+      header->count != n) {
+    return -1;
+  }
+  uint8_t(*items)[HASH_SIZE] = encoded_items(buf, header);
+  if (header->kind == MMR_PROOF_SINGLE) {
+    mmr_compute_proof_root(ctx, root_hash, header->mmr_size, leaves[0],
+                           header->pos, items, header->items);
+    return 0;
+  }
+  if (header->kind == MMR_PROOF_RANGE) {
+    return mmr_compute_range_proof_root(ctx, root_hash, header->mmr_size,
+                                        header->pos, leaves, n, items,
+                                        header->items);
+  }
+  /* the positions are the only part converted */
+  if (positions == NULL) {
+    return -1;
+  }
+  for (size_t i = 0; i < n; i++) {
+    positions[i] = load_le(buf + MMR_PROOF_HEADER_SIZE + i * 8, 8);
+  }
+  return mmr_compute_batch_proof_root(ctx, root_hash, header->mmr_size,
+                                      positions, leaves, n, items,
+                                      header->items);
+}
+
+/* verify an encoded proof
+ * return 0 if the proof is valid, otherwise return -1
+ * see mmr_compute_encoded_proof_root, leaves are overwritten for a batch or
+ * range proof, positions is needed for a batch proof
+ */
+int mmr_verify_encoded_proof(MMRVerifyContext *ctx,
+                             uint8_t root_hash[HASH_SIZE], const uint8_t *buf,
+                             size_t buf_len, MMRProofHeader *header,
+                             uint8_t leaves[][HASH_SIZE], uint64_t positions[],
+                             size_t n) {
+  uint8_t computed_root[HASH_SIZE];
+  if (mmr_compute_encoded_proof_root(ctx, computed_root, buf, buf_len, header,
+                                     leaves, positions, n) != 0) {
+    return -1;
+  }
+  return memcmp(computed_root, root_hash, HASH_SIZE) == 0 ? 0 : -1;
+}
@@ -0,0 +1,128 @@
+/* Mountain merkle range
+ * serialized proofs
+ *
+ * Copyright 2019 Jiang Jinyang <jjyruby@gmail.com>
+ * under MIT license
+ */
+
+#ifndef MMR_PROOF_H
+#define MMR_PROOF_H
+
+#include "mmr.h"
+
+/* layout, integers are little endian:
+ *
+ * offset  size  field
+ * 0       4     magic "MMRP"
+ * 4       1     version
+ * 5       1     hash size
+ * 6       2     flags, the kind in the low 2 bits, other bits are zero
+ * 8       8     mmr_size
+ * 16      8     single: position of the leaf, range: index of the first leaf,
+ *               batch: zero
+ * 24      4     count, number of leaves proved
+ * 28      4     items, number of proof hashes
+ * 32            batch: count positions, 8 bytes each
+ *               proof hashes, HASH_SIZE bytes each
+ *
+ * there is no padding, the hashes are read from the buffer in place at any
+ * alignment.
+ */
+#define MMR_PROOF_VERSION 1
+#define MMR_PROOF_HEADER_SIZE 32
+
+/* kinds of proof */
+#define MMR_PROOF_SINGLE 0
+#define MMR_PROOF_BATCH 1
+#define MMR_PROOF_RANGE 2
+
+typedef struct MMRProofHeader {
+  uint32_t kind;
+  uint64_t mmr_size;
+  /* single: position of the leaf, range: index of the first leaf */
+  uint64_t pos;
+  uint32_t count;
+  uint32_t items;
+} MMRProofHeader;
+
+/* return the encoded size of a proof
+ * kind: MMR_PROOF_SINGLE, MMR_PROOF_BATCH or MMR_PROOF_RANGE
+ * count: number of leaves proved
+ * items: length of proof
+ */
+size_t mmr_proof_encoded_size(uint32_t kind, size_t count, size_t items);
+
+/* encode a proof of mmr_gen_proof
+ * return -1 if buf is not enough
+ * buf_len: length of buf, will be set to the encoded length
+ */
+int mmr_encode_proof(uint8_t *buf, size_t *buf_len, uint64_t mmr_size,
+                     uint64_t pos, uint8_t proof[][HASH_SIZE],
+                     size_t proof_len);
+
+/* encode a proof of mmr_gen_batch_proof
+ * return -1 if buf is not enough
+ * buf_len: length of buf, will be set to the encoded length
+ */
+int mmr_encode_batch_proof(uint8_t *buf, size_t *buf_len, uint64_t mmr_size,
+                           const uint64_t positions[], size_t n,
+                           uint8_t proof[][HASH_SIZE], size_t proof_len);
+
+/* encode a proof of mmr_gen_range_proof
+ * return -1 if buf is not enough
+ * buf_len: length of buf, will be set to the encoded length
+ */
+int mmr_encode_range_proof(uint8_t *buf, size_t *buf_len, uint64_t mmr_size,
+                           uint64_t start, size_t n,
+                           uint8_t proof[][HASH_SIZE], size_t proof_len);
+
+/* decode the header of an encoded proof
+ * return -1 if buf is not a valid proof, or shorter than the proof
+ */
+int mmr_decode_proof_header(const uint8_t *buf, size_t buf_len,
+                            MMRProofHeader *header);
+
+/* decode an encoded proof into arrays
+ * return -1 if buf is not a valid proof or the arrays are not enough
+ * positions: a buf to receive the positions of a batch proof, NULL for other
+ * kinds
+ * positions_len: length of positions, will be set to count
+ * proof: a array of 32 bytes buf to receive the proof
+ * proof_max_len: length of proof buf, will be set to the actual len of proof.
+ */
+int mmr_decode_proof(const uint8_t *buf, size_t buf_len,
+                     MMRProofHeader *header, uint64_t positions[],
+                     size_t *positions_len, uint8_t proof[][HASH_SIZE],
+                     size_t *proof_max_len);
+
+/* compute root from an encoded proof
+ * the hashes are read from buf in place, buf may be read only, unaligned
+ * memory. check the positions in header are the leaves expected.
+ * return -1 if buf is not a valid proof, n is not the count of the proof, or
+ * the batch or range proof is invalid
+ * header: receive the header of the proof, may be NULL
+ * leaves: hashes of the leaves proved, in the order of the proof, used as
+ * working buf and overwritten for a batch or range proof
+ * positions: a buf of n positions to decode the positions of a batch proof
+ * into, NULL for other kinds
+ * n: length of leaves
+ */
+int mmr_compute_encoded_proof_root(MMRVerifyContext *ctx,
+                                   uint8_t root_hash[HASH_SIZE],
+                                   const uint8_t *buf, size_t buf_len,
+                                   MMRProofHeader *header,
+                                   uint8_t leaves[][HASH_SIZE],
+                                   uint64_t positions[], size_t n);
+
+/* verify an encoded proof
+ * return 0 if the proof is valid, otherwise return -1
+ * see mmr_compute_encoded_proof_root, leaves are overwritten for a batch or
+ * range proof, positions is needed for a batch proof
+ */
+int mmr_verify_encoded_proof(MMRVerifyContext *ctx,
+                             uint8_t root_hash[HASH_SIZE], const uint8_t *buf,
+                             size_t buf_len, MMRProofHeader *header,
+                             uint8_t leaves[][HASH_SIZE], uint64_t positions[],
+                             size_t n);
+
+#endif
@@ -0,0 +1,262 @@
+/* Mountain merkle range
+ * pruned store of watched leaves
+ *
+ * Copyright 2019 Jiang Jinyang <jjyruby@gmail.com>
+ * under MIT license
+ */
+
+#include "mmr_sparse.h"
+#include "string.h"
+
+/* helper functions */
+
+static uint64_t slot_of(MMRSparse *sparse, uint64_t pos) {
+  return (pos * 0x9e3779b97f4a7c15ULL) & (sparse->capacity - 1);
+}
+
+/* return the entry of pos, or the empty entry to insert it */
+static MMRSparseEntry *find_entry(MMRSparse *sparse, uint64_t pos) {
+  uint64_t slot = slot_of(sparse, pos);
+  while (sparse->entries[slot].pos != UINT64_MAX &&
+         sparse->entries[slot].pos != pos) {
+    slot = (slot + 1) & (sparse->capacity - 1);
+  }
+  return &sparse->entries[slot];
+}
+
+static int insert_node(MMRSparse *sparse, uint64_t pos,
+                       uint8_t hash[HASH_SIZE]) {
+  MMRSparseEntry *entry = find_entry(sparse, pos);
+  if (entry->pos == UINT64_MAX) {
+    if (sparse->len + 1 > sparse->capacity - sparse->capacity / 8) {
+      return -1;
+    }
+    entry->pos = pos;
+    sparse->len++;
+  }
+  memcpy(entry->hash, hash, HASH_SIZE);
+  return 0;
+}
+
+/* remove pos, the following entries of the probe are shifted back so
+ * lookups never stop at the hole */
+static void remove_node(MMRSparse *sparse, uint64_t pos) {
+  uint64_t mask = sparse->capacity - 1;
+  MMRSparseEntry *entry = find_entry(sparse, pos);
+  if (entry->pos == UINT64_MAX) {
+    return;
+  }
+  uint64_t hole = (uint64_t)(entry - sparse->entries);
+  uint64_t slot = hole;
+  for (;;) {
+    slot = (slot + 1) & mask;
+    uint64_t moved = sparse->entries[slot].pos;
+    if (moved == UINT64_MAX) {
+      break;
+    }
+    /* an entry may fill the hole if the hole is on its probe */
+    uint64_t home = slot_of(sparse, moved);
+    if (((slot - home) & mask) >= ((slot - hole) & mask)) {
+      sparse->entries[hole] = sparse->entries[slot];
+      hole = slot;
+    }
+  }
+  sparse->entries[hole].pos = UINT64_MAX;
+  sparse->len--;
+}
+
+/* return the index of the first watched leaf not less than leaf_index */
+static size_t lower_bound(MMRSparse *sparse, uint64_t leaf_index) {
+  size_t lo = 0;
+  size_t hi = sparse->watched_len;
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+    if (sparse->watched[mid] < leaf_index) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  return lo;
+}
+
+/* return 1 if a watched leaf is under pos */
+static int watches_under(MMRSparse *sparse, uint64_t pos) {
+  uint32_t height = mmr_pos_height(pos);
+  uint64_t last_leaf = mmr_pos_to_leaf_index(pos);
+  uint64_t first_leaf = last_leaf + 1 - ((uint64_t)1 << height);
+  size_t i = lower_bound(sparse, first_leaf);
+  return i < sparse->watched_len && sparse->watched[i] <= last_leaf;
+}
+
+/* a node is kept if it's a watched leaf or a sibling on the path of a
+ * watched leaf, the peaks are kept until they are merged */
+static void prune_child(MMRSparse *sparse, uint64_t child, uint64_t sibling) {
+  if (mmr_pos_height(child) == 0 && watches_under(sparse, child)) {
+    return;
+  }
+  if (!watches_under(sparse, sibling)) {
+    remove_node(sparse, child);
+  }
+}
+
+/* collect the siblings from the leaf to its peak in mmr_size and the nodes
+ * on the path at the same heights, return the number of siblings */
+static uint64_t leaf_path(uint64_t mmr_size, uint64_t leaf_index,
+                          uint64_t sib_pos[], uint64_t path_pos[]) {
+  uint64_t pos = mmr_leaf_index_to_pos(leaf_index);
+  uint64_t len = 0;
+  for (uint32_t height = 0; height < 64; height++) {
+    uint64_t sib, parent;
+    if ((leaf_index >> height) & 1) {
+      sib = pos - (((uint64_t)2 << height) - 1);
+      parent = pos + 1;
+    } else {
+      sib = pos + (((uint64_t)2 << height) - 1);
+      parent = sib + 1;
+    }
+    if (parent >= mmr_size) {
+      break;
+    }
+    sib_pos[len] = sib;
+    path_pos[len] = pos;
+    len++;
+    pos = parent;
+  }
+  return len;
+}
+
+static int sparse_get(void *data, uint64_t pos, uint8_t dst[HASH_SIZE]) {
+  MMRSparse *sparse = (MMRSparse *)data;
+  MMRSparseEntry *entry = find_entry(sparse, pos);
+  if (pos >= sparse->next_pos || entry->pos == UINT64_MAX) {
+    return -1;
+  }
+  memcpy(dst, entry->hash, HASH_SIZE);
+  return 0;
+}
+
+static int sparse_append(void *data, uint64_t pos, uint8_t elem[HASH_SIZE]) {
+  MMRSparse *sparse = (MMRSparse *)data;
+  /* a failed push is appended again from mmr_size */
+  if (pos < sparse->mmr_size || pos > sparse->next_pos ||
+      insert_node(sparse, pos, elem) != 0) {
+    return -1;
+  }
+  sparse->next_pos = pos + 1;
+  if (mmr_pos_height(pos + 1) != 0) {
+    return 0;
+  }
+  /* the push is complete, the children of its parents are not peaks
+   * anymore. they are dropped only now so a failed push can be retried */
+  for (uint64_t p = sparse->mmr_size; p <= pos; p++) {
+    uint32_t height = mmr_pos_height(p);
+    if (height > 0) {
+      uint64_t left = p - ((uint64_t)1 << height);
+      uint64_t right = p - 1;
+      prune_child(sparse, left, right);
+      prune_child(sparse, right, left);
+    }
+  }
+  sparse->mmr_size = pos + 1;
+  return 0;
+}
+
+/* the dropped nodes of a smaller size are not kept */
+static int sparse_truncate(void *data, uint64_t mmr_size) {
+  MMRSparse *sparse = (MMRSparse *)data;
+  return mmr_size == sparse->mmr_size ? 0 : -1;
+}
+
+/* sparse API */
+
+/* initialize an empty sparse store
+ * return -1 if capacity is not a power of two
+ * entries: a buf of capacity entries to keep the nodes
+ * watched: a buf to keep watched_cap leaf indexes
+ */
+int mmr_sparse_init(MMRSparse *sparse, MMRSparseEntry entries[],
+                    uint64_t capacity, uint64_t watched[],
+                    size_t watched_cap) {
+  if (capacity == 0 || (capacity & (capacity - 1)) != 0) {
+    return -1;
+  }
+  for (uint64_t i = 0; i < capacity; i++) {
+    entries[i].pos = UINT64_MAX;
+  }
+  sparse->entries = entries;
+  sparse->capacity = capacity;
+  sparse->len = 0;
+  sparse->watched = watched;
+  sparse->watched_len = 0;
+  sparse->watched_cap = watched_cap;
+  sparse->mmr_size = 0;
+  sparse->next_pos = 0;
+  sparse->store.data = sparse;
+  sparse->store.get = sparse_get;
+  sparse->store.append = sparse_append;
+  sparse->store.batch_get = NULL;
+  sparse->store.truncate = sparse_truncate;
+  /* removing a node shifts the entries of its probe */
+  sparse->store.concurrent_get = 0;
+  return 0;
+}
+
+/* Initialize MMRContext on a sparse store at its size
+ * merge: a function to merge left node hash and right node hash
+ */
+int mmr_sparse_initialize_context(MMRContext *ctx, MMRSparse *sparse,
+                                  void(merge)(uint8_t dst[HASH_SIZE],
+                                              uint8_t right[HASH_SIZE],
+                                              uint8_t left[HASH_SIZE])) {
+  return mmr_initialize_store_context(ctx, sparse->mmr_size, &sparse->store,
+                                      merge);
+}
+
+/* watch a leaf, its proof can be generated as long as it is watched
+ * return -1 if watched is full, or the leaf is pushed and its siblings have
+ * been dropped
+ * leaf_index: index of the leaf, may be a leaf to be pushed
+ */
+int mmr_sparse_watch(MMRSparse *sparse, uint64_t leaf_index) {
+  size_t i = lower_bound(sparse, leaf_index);
+  if (i < sparse->watched_len && sparse->watched[i] == leaf_index) {
+    return 0;
+  }
+  if (sparse->watched_len >= sparse->watched_cap) {
+    return -1;
+  }
+  uint64_t sib_pos[64], path_pos[64];
+  uint64_t len = leaf_path(sparse->mmr_size, leaf_index, sib_pos, path_pos);
+  for (uint64_t h = 0; h < len; h++) {
+    if (find_entry(sparse, sib_pos[h])->pos == UINT64_MAX) {
+      return -1;
+    }
+  }
+  memmove(&sparse->watched[i + 1], &sparse->watched[i],
+          (sparse->watched_len - i) * sizeof(uint64_t));
+  sparse->watched[i] = leaf_index;
+  sparse->watched_len++;
+  return 0;
+}
+
+/* stop watching a leaf and drop the nodes only its proof needs
+ * return -1 if the leaf is not watched
+ */
+int mmr_sparse_unwatch(MMRSparse *sparse, uint64_t leaf_index) {
+  size_t i = lower_bound(sparse, leaf_index);
+  if (i >= sparse->watched_len || sparse->watched[i] != leaf_index) {
+    return -1;
+  }
+  memmove(&sparse->watched[i], &sparse->watched[i + 1],
+          (sparse->watched_len - i - 1) * sizeof(uint64_t));
+  sparse->watched_len--;
+  /* the leaf and its siblings below the peak, peaks are not on the path */
+  uint64_t sib_pos[64], path_pos[64];
+  uint64_t len = leaf_path(sparse->mmr_size, leaf_index, sib_pos, path_pos);
+  for (uint64_t h = 0; h < len; h++) {
+    prune_child(sparse, path_pos[h], sib_pos[h]);
+    prune_child(sparse, sib_pos[h], path_pos[h]);
+  }
+  return 0;
+}
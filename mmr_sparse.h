@@ -0,0 +1,77 @@
+/* Mountain merkle range
+ * pruned store of watched leaves
+ *
+ * Copyright 2019 Jiang Jinyang <jjyruby@gmail.com>
+ * under MIT license
+ */
+
+#ifndef MMR_SPARSE_H
+#define MMR_SPARSE_H
+
+#include "mmr.h"
+
+/* the store keeps the peaks, the watched leaves and the siblings on the paths
+ * from the watched leaves to their peaks, other nodes are dropped once a push
+ * merges them. a context on the store supports push, get_root and gen_proof
+ * of watched leaves with O(k log n) nodes for k watched leaves.
+ *
+ * a leaf is watched before it is pushed, or later if its siblings are still
+ * kept. the dropped nodes can't be read back, so mmr_truncate on the store
+ * fails, and proofs of leaves which are not watched fail to read the store.
+ */
+
+typedef struct MMRSparseEntry {
+  /* position of the node, UINT64_MAX if the entry is empty */
+  uint64_t pos;
+  uint8_t hash[HASH_SIZE];
+} MMRSparseEntry;
+
+typedef struct MMRSparse {
+  /* open addressing map of the kept nodes */
+  MMRSparseEntry *entries;
+  /* number of entries, a power of two */
+  uint64_t capacity;
+  /* number of kept nodes */
+  uint64_t len;
+  /* watched leaf indexes, sorted ascending */
+  uint64_t *watched;
+  size_t watched_len;
+  size_t watched_cap;
+  /* size of the completed pushes */
+  uint64_t mmr_size;
+  /* the next position to append */
+  uint64_t next_pos;
+  /* the store to use with mmr_initialize_store_context */
+  MMRStore store;
+} MMRSparse;
+
+/* initialize an empty sparse store
+ * return -1 if capacity is not a power of two
+ * entries: a buf of capacity entries to keep the nodes, the store fails to
+ * append once 7/8 of them are used
+ * watched: a buf to keep watched_cap leaf indexes
+ */
+int mmr_sparse_init(MMRSparse *sparse, MMRSparseEntry entries[],
+                    uint64_t capacity, uint64_t watched[], size_t watched_cap);
+
+/* Initialize MMRContext on a sparse store at its size
+ * merge: a function to merge left node hash and right node hash
+ */
+int mmr_sparse_initialize_context(MMRContext *ctx, MMRSparse *sparse,
+                                  void(merge)(uint8_t dst[HASH_SIZE],
+                                              uint8_t right[HASH_SIZE],
+                                              uint8_t left[HASH_SIZE]));
+
+/* watch a leaf, its proof can be generated as long as it is watched
+ * return -1 if watched is full, or the leaf is pushed and its siblings have
+ * been dropped
+ * leaf_index: index of the leaf, may be a leaf to be pushed
+ */
+int mmr_sparse_watch(MMRSparse *sparse, uint64_t leaf_index);
+
+/* stop watching a leaf and drop the nodes only its proof needs
+ * return -1 if the leaf is not watched
+ */
+int mmr_sparse_unwatch(MMRSparse *sparse, uint64_t leaf_index);
+
+#endif
@@ -0,0 +1,275 @@
+/* Mountain merkle range
+ * header only specialization
+ *
+ * Copyright 2019 Jiang Jinyang <jjyruby@gmail.com>
+ * under MIT license
+ */
+
+#ifndef MMR_SPEC_H
+#define MMR_SPEC_H
+
+#include "stdint.h"
+#include "stddef.h"
+#include "string.h"
+
+/* MMR_DEFINE(name, hash_size, merge_fn) defines an in-memory mmr of nodes of
+ * hash_size bytes, the merge function is called directly so the compiler can
+ * inline it, and the copies of nodes have a constant size.
+ *
+ * merge_fn: void merge_fn(uint8_t *dst, uint8_t *left, uint8_t *right), dst
+ * may be the same buf as left or right. define it static inline before
+ * MMR_DEFINE to have it inlined.
+ *
+ * defines:
+ *
+ * typedef struct name_ctx name_ctx;
+ * int name_initialize_context(name_ctx *ctx, uint64_t mmr_size,
+ *                             uint8_t (*tree_buf)[hash_size],
+ *                             uint64_t tree_buf_size);
+ * int name_push(name_ctx *ctx, uint8_t leaf[hash_size]);
+ * int name_get_root(name_ctx *ctx, uint8_t dst[hash_size]);
+ * int name_gen_proof(name_ctx *ctx, uint8_t proof[][hash_size],
+ *                    size_t *proof_max_len, uint64_t pos);
+ * void name_compute_proof_root(uint8_t root_hash[hash_size],
+ *                              uint64_t mmr_size,
+ *                              uint8_t leaf_hash[hash_size], uint64_t pos,
+ *                              uint8_t proof[][hash_size], size_t proof_len);
+ *
+ * they have the same arguments, return values and proof layout as the
+ * functions of MMRContext in mmr.h, with hash_size bytes hashes.
+ */
+
+/* position math, shared with mmr.c and mmr_blocked.c */
+
+/* return number of ones */
+static inline uint32_t mmr_spec_count_ones(uint64_t n) {
+#if defined(__GNUC__) || defined(__clang__)
+  return __builtin_popcountll(n);
+#else
+  uint32_t num_ones = 0;
+  while (n) {
+    n &= n - 1;
+    ++num_ones;
+  }
+  return num_ones;
+#endif
+}
+
+/* return number of bits to represent n */
+static inline uint32_t mmr_spec_bit_length(uint64_t n) {
+#if defined(__GNUC__) || defined(__clang__)
+  return n == 0 ? 0 : 64 - __builtin_clzll(n);
+#else
+  uint32_t len = 0;
+  for (uint32_t shift = 32; shift > 0; shift >>= 1) {
+    if (n >> shift) {
+      n >>= shift;
+      len += shift;
+    }
+  }
+  return len + (uint32_t)n;
+#endif
+}
+
+/* return number of trailing zeros, 64 if n is 0 */
+static inline uint32_t mmr_spec_trailing_zeros(uint64_t n) {
+#if defined(__GNUC__) || defined(__clang__)
+  return n == 0 ? 64 : __builtin_ctzll(n);
+#else
+  return mmr_spec_count_ones((n & (~n + 1)) - 1);
+#endif
+}
+
+/* calculate position of a leaf from leaf index */
+static inline uint64_t mmr_spec_leaf_index_to_pos(uint64_t index) {
+  /* each leaf before index contributes one position, plus the parent nodes
+   * of the complete subtrees on its left */
+  return 2 * index - mmr_spec_count_ones(index);
+}
+
+/* calculate mmr_size from leaf count, the next leaf is at mmr_size */
+static inline uint64_t mmr_spec_mmr_size(uint64_t leaf_count) {
+  return mmr_spec_leaf_index_to_pos(leaf_count);
+}
+
+/* height of pos, and the index of the last leaf under pos.
+ * x = pos + 1 counts the nodes up to pos. while x is not 2^m - 1, the
+ * perfect tree of 2^top - 1 nodes under the top bit of x is complete before
+ * pos, so it is skipped with its 2^(top - 1) leaves and x loses its top bit.
+ * pos is then the root of a perfect tree of height m - 1. there is no
+ * stepping, the loop runs at most once per bit of pos whatever the height.
+ */
+static inline uint32_t mmr_spec_pos_height_and_leaf(uint64_t pos,
+                                                    uint64_t *leaf_index) {
+  uint64_t x = pos + 1;
+  uint64_t leaves = 0;
+  while ((x & (x + 1)) != 0) {
+    uint32_t top = mmr_spec_bit_length(x) - 1;
+    x -= ((uint64_t)1 << top) - 1;
+    leaves += (uint64_t)1 << (top - 1);
+  }
+  uint32_t height = mmr_spec_bit_length(x) - 1;
+  *leaf_index = leaves + ((uint64_t)1 << height) - 1;
+  return height;
+}
+
+/* return the leaf count of mmr_size, or UINT64_MAX if mmr_size is invalid */
+static inline uint64_t mmr_spec_leaf_count(uint64_t mmr_size) {
+  uint64_t leaf_count;
+  /* the next leaf is at mmr_size */
+  if (mmr_spec_pos_height_and_leaf(mmr_size, &leaf_count) != 0) {
+    return UINT64_MAX;
+  }
+  return leaf_count;
+}
+
+/* position of the peak of the bit height in leaf_count */
+static inline uint64_t mmr_spec_peak_pos(uint64_t leaf_count,
+                                         uint32_t height) {
+  uint64_t last_leaf = ((leaf_count >> height) << height) - 1;
+  return mmr_spec_leaf_index_to_pos(last_leaf) + height;
+}
+
+#define MMR_DEFINE(name, hash_size, merge_fn)                                  \
+  typedef struct name##_ctx {                                                  \
+    uint64_t leaf_count;                                                       \
+    uint8_t (*tree_buf)[hash_size];                                            \
+    uint64_t tree_buf_size;                                                    \
+  } name##_ctx;                                                                \
+                                                                               \
+  static inline int name##_initialize_context(                                 \
+      name##_ctx *ctx, uint64_t mmr_size, uint8_t (*tree_buf)[hash_size],      \
+      uint64_t tree_buf_size) {                                                \
+    uint64_t leaf_count = mmr_spec_leaf_count(mmr_size);                       \
+    if (leaf_count == UINT64_MAX || mmr_size > tree_buf_size) {                \
+      return -1;                                                               \
+    }                                                                          \
+    ctx->leaf_count = leaf_count;                                              \
+    ctx->tree_buf = tree_buf;                                                  \
+    ctx->tree_buf_size = tree_buf_size;                                        \
+    return 0;                                                                  \
+  }                                                                            \
+                                                                               \
+  static inline int name##_push(name##_ctx *ctx, uint8_t leaf[hash_size]) {    \
+    uint64_t pos = mmr_spec_leaf_index_to_pos(ctx->leaf_count);                \
+    uint32_t merges = mmr_spec_trailing_zeros(ctx->leaf_count + 1);            \
+    if (pos + merges >= ctx->tree_buf_size) {                                  \
+      return -1;                                                               \
+    }                                                                          \
+    memcpy(ctx->tree_buf[pos], leaf, hash_size);                               \
+    for (uint32_t height = 0; height < merges; height++) {                     \
+      pos++;                                                                   \
+      uint64_t left_pos = pos - ((uint64_t)2 << height);                       \
+      merge_fn(ctx->tree_buf[pos], ctx->tree_buf[left_pos],                    \
+               ctx->tree_buf[pos - 1]);                                        \
+    }                                                                          \
+    ctx->leaf_count++;                                                         \
+    return 0;                                                                  \
+  }                                                                            \
+                                                                               \
+  /* bag the peaks of leaf_count under 2^height leaves into dst,               \
+   * return 0 if there is no such peak */                                      \
+  static inline int name##_bag_low_peaks(name##_ctx *ctx, uint32_t height,     \
+                                         uint8_t dst[hash_size]) {             \
+    uint64_t bits = ctx->leaf_count;                                           \
+    if (height < 64) {                                                         \
+      bits &= ((uint64_t)1 << height) - 1;                                     \
+    }                                                                          \
+    if (bits == 0) {                                                           \
+      return 0;                                                                \
+    }                                                                          \
+    uint32_t h = mmr_spec_trailing_zeros(bits);                                \
+    memcpy(dst, ctx->tree_buf[mmr_spec_peak_pos(ctx->leaf_count, h)],          \
+           hash_size);                                                         \
+    for (bits &= bits - 1; bits; bits &= bits - 1) {                           \
+      h = mmr_spec_trailing_zeros(bits);                                       \
+      uint64_t peak_pos = mmr_spec_peak_pos(ctx->leaf_count, h);               \
+      merge_fn(dst, dst, ctx->tree_buf[peak_pos]);                             \
+    }                                                                          \
+    return 1;                                                                  \
+  }                                                                            \
+                                                                               \
+  static inline int name##_get_root(name##_ctx *ctx, uint8_t dst[hash_size]) { \
+    return name##_bag_low_peaks(ctx, 64, dst) ? 0 : -1;                        \
+  }                                                                            \
+                                                                               \
+  static inline int name##_gen_proof(name##_ctx *ctx,                          \
+                                     uint8_t proof[][hash_size],               \
+                                     size_t *proof_max_len, uint64_t pos) {    \
+    uint64_t leaf_index;                                                       \
+    uint32_t height = mmr_spec_pos_height_and_leaf(pos, &leaf_index);          \
+    if (leaf_index >= ctx->leaf_count) {                                       \
+      return -1;                                                               \
+    }                                                                          \
+    uint32_t peak_height =                                                     \
+        mmr_spec_bit_length(leaf_index ^ ctx->leaf_count) - 1;                 \
+    size_t proof_len = 0;                                                      \
+    for (; height < peak_height; height++) {                                   \
+      if (proof_len >= *proof_max_len) {                                       \
+        return -1;                                                             \
+      }                                                                        \
+      uint64_t sib_offset = ((uint64_t)2 << height) - 1;                       \
+      if ((leaf_index >> height) & 1) {                                        \
+        /* we are on right branch */                                           \
+        memcpy(proof[proof_len++], ctx->tree_buf[pos - sib_offset],            \
+               hash_size);                                                     \
+        pos += 1;                                                              \
+      } else {                                                                 \
+        memcpy(proof[proof_len++], ctx->tree_buf[pos + sib_offset],            \
+               hash_size);                                                     \
+        pos += sib_offset + 1;                                                 \
+      }                                                                        \
+    }                                                                          \
+    uint64_t left_bits = ctx->leaf_count >> peak_height >> 1;                  \
+    size_t left_len = mmr_spec_count_ones(left_bits);                          \
+    if (proof_len >= *proof_max_len) {                                         \
+      return -1;                                                               \
+    }                                                                          \
+    /* bagging rhs peaks */                                                    \
+    proof_len += name##_bag_low_peaks(ctx, peak_height, proof[proof_len]);     \
+    /* put left peaks to proof, from right to left */                          \
+    if (proof_len + left_len > *proof_max_len) {                               \
+      return -1;                                                               \
+    }                                                                          \
+    for (uint32_t h = peak_height + 1; left_bits; h++, left_bits >>= 1) {      \
+      if (left_bits & 1) {                                                     \
+        memcpy(proof[proof_len++],                                             \
+               ctx->tree_buf[mmr_spec_peak_pos(ctx->leaf_count, h)],           \
+               hash_size);                                                     \
+      }                                                                        \
+    }                                                                          \
+    *proof_max_len = proof_len;                                                \
+    return 0;                                                                  \
+  }                                                                            \
+                                                                               \
+  static inline void name##_compute_proof_root(                                \
+      uint8_t root_hash[hash_size], uint64_t mmr_size,                         \
+      uint8_t leaf_hash[hash_size], uint64_t pos, uint8_t proof[][hash_size],  \
+      size_t proof_len) {                                                      \
+    uint64_t leaf_count = mmr_spec_leaf_count(mmr_size);                       \
+    uint64_t leaf_index;                                                       \
+    uint32_t height = mmr_spec_pos_height_and_leaf(pos, &leaf_index);          \
+    uint32_t peak_height =                                                     \
+        leaf_index < leaf_count                                                \
+            ? mmr_spec_bit_length(leaf_index ^ leaf_count) - 1                 \
+            : 0;                                                               \
+    memcpy(root_hash, leaf_hash, hash_size);                                   \
+    size_t i = 0;                                                              \
+    for (; height < peak_height && i < proof_len; height++) {                  \
+      if ((leaf_index >> height) & 1) {                                        \
+        merge_fn(root_hash, proof[i++], root_hash);                            \
+      } else {                                                                 \
+        merge_fn(root_hash, root_hash, proof[i++]);                            \
+      }                                                                        \
+    }                                                                          \
+    /* the last peak is only bagged with left peaks */                         \
+    if (i < proof_len &&                                                       \
+        peak_height != mmr_spec_trailing_zeros(leaf_count)) {                  \
+      merge_fn(root_hash, proof[i++], root_hash);                              \
+    }                                                                          \
+    for (; i < proof_len; i++) {                                               \
+      merge_fn(root_hash, root_hash, proof[i]);                                \
+    }                                                                          \
+  }
+
+#endif
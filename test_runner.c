@@ -1,7 +1,16 @@
 #include "blake2b.h"
 #include "mmr.h"
+#include "mmr_arena.h"
+#include "mmr_blocked.h"
+#include "mmr_file.h"
+#include "mmr_parallel.h"
+#include "mmr_proof.h"
+#include "mmr_sparse.h"
+#include "mmr_spec.h"
 #include <stdio.h>
+#include <pthread.h>
 #include <stdlib.h>
+#include <unistd.h>
 
 #define MMR_TREE_LEAVES 1000
 
@@ -45,6 +54,60 @@ void merge_hash(uint8_t dst[HASH_SIZE], uint8_t left_hash[HASH_SIZE],
   return;
 }
 
+static size_t merge_many_calls = 0;
+static size_t merge_many_lanes = 0;
+
+void merge_hash_many(uint8_t *dst[], uint8_t *left_hash[],
+                     uint8_t *right_hash[], size_t n) {
+  merge_many_calls++;
+  merge_many_lanes += n;
+  for (size_t i = 0; i < n; i++) {
+    merge_hash(dst[i], left_hash[i], right_hash[i]);
+  }
+}
+
+/* a store backed by an array, counts the calls */
+typedef struct TestStore {
+  uint8_t (*nodes)[HASH_SIZE];
+  uint64_t len;
+  uint64_t cap;
+  size_t gets;
+  size_t batch_gets;
+} TestStore;
+
+int test_store_get(void *data, uint64_t pos, uint8_t dst[HASH_SIZE]) {
+  TestStore *store = (TestStore *)data;
+  if (pos >= store->len) {
+    return -1;
+  }
+  store->gets++;
+  memcpy(dst, store->nodes[pos], HASH_SIZE);
+  return 0;
+}
+
+int test_store_append(void *data, uint64_t pos, uint8_t elem[HASH_SIZE]) {
+  TestStore *store = (TestStore *)data;
+  if (pos > store->len || pos >= store->cap) {
+    return -1;
+  }
+  memcpy(store->nodes[pos], elem, HASH_SIZE);
+  store->len = pos + 1;
+  return 0;
+}
+
+int test_store_batch_get(void *data, const uint64_t *pos, size_t n,
+                         uint8_t dst[][HASH_SIZE]) {
+  TestStore *store = (TestStore *)data;
+  store->batch_gets++;
+  for (size_t i = 0; i < n; i++) {
+    if (pos[i] >= store->len) {
+      return -1;
+    }
+    memcpy(dst[i], store->nodes[pos[i]], HASH_SIZE);
+  }
+  return 0;
+}
+
 /* initialize shared mmr tree */
 int initialize_shared_tree() {
   MMRContext ctx;
@@ -307,6 +370,1918 @@ int test_empty_proof() {
   return 0;
 }
 
+int test_push_batch() {
+  static uint8_t tree_buf[MMR_TREE_LEAVES * 2][HASH_SIZE];
+  static uint8_t leaves[MMR_TREE_LEAVES][HASH_SIZE];
+  for (uint64_t i = 0; i < MMR_TREE_LEAVES; i++) {
+    memset(leaves[i], 0, HASH_SIZE);
+    memcpy(leaves[i], &i, sizeof(uint64_t));
+  }
+  /* push leaves in batches of different sizes */
+  size_t batch_sizes[] = {1, 2, 3, 7, 64, 100, 1000};
+  for (int b = 0; b < (int)(sizeof(batch_sizes) / sizeof(size_t)); b++) {
+    MMRContext ctx;
+    int ret = mmr_initialize_context(&ctx, 0, tree_buf, MMR_TREE_LEAVES * 2,
+                                     merge_hash);
+    _assert(ret == 0);
+    size_t pushed = 0;
+    while (pushed < MMR_TREE_LEAVES) {
+      size_t n = batch_sizes[b];
+      if (n > MMR_TREE_LEAVES - pushed) {
+        n = MMR_TREE_LEAVES - pushed;
+      }
+      ret = mmr_push_batch(&ctx, &leaves[pushed], n);
+      _assert(ret == 0);
+      pushed += n;
+    }
+    _assert(ctx.mmr_size == shared_mmr_size);
+    ret = memcmp(tree_buf, shared_mmr_tree, shared_mmr_size * HASH_SIZE);
+    _assert(ret == 0);
+  }
+
+  /* return -1 if tree_buf is not enough */
+  MMRContext ctx;
+  int ret = mmr_initialize_context(&ctx, 0, tree_buf, 10, merge_hash);
+  _assert(ret == 0);
+  ret = mmr_push_batch(&ctx, leaves, 7);
+  _assert(ret == -1);
+  _assert(ctx.mmr_size == 0);
+  ret = mmr_push_batch(&ctx, leaves, 6);
+  _assert(ret == 0);
+  _assert(ctx.mmr_size == 10);
+  return 0;
+}
+
+int test_push_batch_merge_many() {
+  static uint8_t tree_buf[MMR_TREE_LEAVES * 2][HASH_SIZE];
+  static uint8_t leaves[MMR_TREE_LEAVES][HASH_SIZE];
+  for (uint64_t i = 0; i < MMR_TREE_LEAVES; i++) {
+    memset(leaves[i], 0, HASH_SIZE);
+    memcpy(leaves[i], &i, sizeof(uint64_t));
+  }
+  MMRContext ctx;
+  int ret = mmr_initialize_context(&ctx, 0, tree_buf, MMR_TREE_LEAVES * 2,
+                                   merge_hash);
+  _assert(ret == 0);
+  mmr_set_merge_many(&ctx, merge_hash_many);
+  merge_many_calls = 0;
+  merge_many_lanes = 0;
+  ret = mmr_push_batch(&ctx, leaves, MMR_TREE_LEAVES);
+  _assert(ret == 0);
+  _assert(ctx.mmr_size == shared_mmr_size);
+  ret = memcmp(tree_buf, shared_mmr_tree, shared_mmr_size * HASH_SIZE);
+  _assert(ret == 0);
+  /* all merges go through merge_many */
+  _assert(merge_many_lanes == shared_mmr_size - MMR_TREE_LEAVES);
+  _assert(merge_many_calls < merge_many_lanes);
+  return 0;
+}
+
+int test_peaks_from_size() {
+  uint64_t peaks[MMR_MAX_PEAKS];
+  size_t len = mmr_peaks_from_size(0, peaks);
+  _assert(len == 0);
+  len = mmr_peaks_from_size(1, peaks);
+  _assert(len == 1 && peaks[0] == 0);
+  /* the 11 leaves MMR in README */
+  len = mmr_peaks_from_size(19, peaks);
+  _assert(len == 3 && peaks[0] == 14 && peaks[1] == 17 && peaks[2] == 18);
+  len = mmr_peaks_from_size(22, peaks);
+  _assert(len == 2 && peaks[0] == 14 && peaks[1] == 21);
+
+  /* peaks split the mmr into complete subtrees, one for each bit of the leaf
+   * count */
+  for (uint64_t i = 0; i < MMR_TREE_LEAVES; i++) {
+    MMRSizePos pos = mmr_compute_pos_by_leaf_index(i);
+    len = mmr_peaks_from_size(pos.mmr_size, peaks);
+    _assert(len == __builtin_popcountll(i + 1));
+    _assert(peaks[len - 1] == pos.mmr_size - 1);
+    uint64_t leaves = 0;
+    for (size_t j = 0; j < len; j++) {
+      uint64_t tree_size = peaks[j] + 1 - (j == 0 ? 0 : peaks[j - 1] + 1);
+      leaves += (tree_size + 1) / 2;
+    }
+    _assert(leaves == i + 1);
+  }
+  return 0;
+}
+
+int test_pos_math() {
+  /* heights of the 11 leaves MMR in README */
+  uint32_t heights[] = {0, 0, 1, 0, 0, 1, 2, 0, 0, 1, 0,
+                        0, 1, 2, 3, 0, 0, 1, 0};
+  for (uint64_t pos = 0; pos < sizeof(heights) / sizeof(uint32_t); pos++) {
+    _assert(mmr_pos_height(pos) == heights[pos]);
+  }
+  _assert(mmr_pos_to_leaf_index(14) == 7);
+  _assert(mmr_pos_to_leaf_index(17) == 9);
+
+  uint64_t pos = 0;
+  for (uint64_t i = 0; i < MMR_TREE_LEAVES; i++) {
+    MMRSizePos size_pos = mmr_compute_pos_by_leaf_index(i);
+    _assert(size_pos.pos == pos);
+    _assert(mmr_leaf_index_to_pos(i) == pos);
+    _assert(mmr_pos_to_leaf_index(pos) == i);
+    /* the leaf is followed by the parents it completes */
+    for (uint32_t height = 0; pos < size_pos.mmr_size; height++, pos++) {
+      _assert(mmr_pos_height(pos) == height);
+      _assert(mmr_pos_to_leaf_index(pos) == i);
+    }
+  }
+
+  /* large positions */
+  uint64_t index = ((uint64_t)1 << 40) + 12345;
+  pos = mmr_leaf_index_to_pos(index);
+  _assert(mmr_pos_height(pos) == 0);
+  _assert(mmr_pos_to_leaf_index(pos) == index);
+  _assert(mmr_pos_height(((uint64_t)2 << 40) - 2) == 40);
+  return 0;
+}
+
+int test_leaf_index_api() {
+  /* sizes of the README MMR, the sizes between them are not complete */
+  for (uint64_t count = 0, size = 0; count <= MMR_TREE_LEAVES; count++) {
+    _assert(mmr_leaf_count_to_size(count) == size);
+    _assert(mmr_size_to_leaf_count(size) == count);
+    uint64_t next = mmr_leaf_count_to_size(count + 1);
+    for (uint64_t invalid = size + 2; invalid < next; invalid++) {
+      _assert(mmr_size_to_leaf_count(invalid) == UINT64_MAX);
+    }
+    size = next;
+  }
+  _assert(mmr_size_to_leaf_count(2) == UINT64_MAX);
+  uint64_t count = ((uint64_t)1 << 40) + 12345;
+  _assert(mmr_size_to_leaf_count(mmr_leaf_count_to_size(count)) == count);
+  _assert(mmr_compute_pos_by_leaf_index(count - 1).mmr_size ==
+          mmr_leaf_count_to_size(count));
+  /* the node of height h and index i in its height is pushed right after
+   * its last leaf ((i + 1) << h) - 1 */
+  for (uint32_t height = 20; height < 48; height++) {
+    uint64_t indexes[] = {0, 1, 2, 5, 1000};
+    for (size_t k = 0; k < sizeof(indexes) / sizeof(indexes[0]); k++) {
+      uint64_t last_leaf = ((indexes[k] + 1) << height) - 1;
+      uint64_t pos = mmr_leaf_index_to_pos(last_leaf) + height;
+      _assert(mmr_pos_height(pos) == height);
+      _assert(mmr_pos_to_leaf_index(pos) == last_leaf);
+      /* a left child is followed by a leaf, a right child by its parent */
+      _assert(mmr_pos_height(pos + 1) == (indexes[k] & 1 ? height + 1 : 0));
+    }
+    /* a peak of 2^h leaves ends at 2^(h + 1) - 2 */
+    _assert(mmr_pos_height(((uint64_t)2 << height) - 2) == height);
+  }
+
+  MMRContext ctx;
+  int ret =
+      mmr_initialize_context(&ctx, shared_mmr_size, shared_mmr_tree,
+                             MMR_TREE_LEAVES * MMR_TREE_LEAVES, merge_hash);
+  _assert(ret == 0);
+  MMRVerifyContext verify_ctx;
+  ret = mmr_initialize_verify_context(&verify_ctx, merge_hash);
+  _assert(ret == 0);
+  uint8_t root[HASH_SIZE];
+  ret = mmr_get_root(&ctx, root);
+  _assert(ret == 0);
+  uint8_t proof[MMR_TREE_LEAVES][HASH_SIZE];
+  size_t proof_len;
+  for (uint64_t i = 0; i < MMR_TREE_LEAVES; i++) {
+    proof_len = MMR_TREE_LEAVES;
+    ret = mmr_gen_proof_by_leaf_index(&ctx, proof, &proof_len, i);
+    _assert(ret == 0);
+    uint8_t leaf[HASH_SIZE];
+    memset(leaf, 0, HASH_SIZE);
+    memcpy(leaf, &i, sizeof(uint64_t));
+    ret = mmr_verify_proof_by_leaf_index(&verify_ctx, root, MMR_TREE_LEAVES,
+                                         leaf, i, proof, proof_len);
+    _assert(ret == 0);
+    /* the index is bound by the proof */
+    uint64_t other = (i + 1) % MMR_TREE_LEAVES;
+    ret = mmr_verify_proof_by_leaf_index(&verify_ctx, root, MMR_TREE_LEAVES,
+                                         leaf, other, proof, proof_len);
+    _assert(ret != 0);
+  }
+  proof_len = MMR_TREE_LEAVES;
+  ret = mmr_gen_proof_by_leaf_index(&ctx, proof, &proof_len, MMR_TREE_LEAVES);
+  _assert(ret != 0);
+  uint8_t leaf[HASH_SIZE];
+  memset(leaf, 0, HASH_SIZE);
+  ret = mmr_verify_proof_by_leaf_index(&verify_ctx, root, MMR_TREE_LEAVES,
+                                       leaf, MMR_TREE_LEAVES, proof, 0);
+  _assert(ret != 0);
+  return 0;
+}
+
+int test_store() {
+  static uint8_t nodes[MMR_TREE_LEAVES * 2][HASH_SIZE];
+  TestStore test_store = {nodes, 0, MMR_TREE_LEAVES * 2, 0, 0};
+  MMRStore store = {.data = &test_store,
+                    .get = test_store_get,
+                    .append = test_store_append,
+                    .batch_get = NULL,
+                    .truncate = NULL};
+  MMRContext ctx;
+  int ret = mmr_initialize_store_context(&ctx, 0, &store, merge_hash);
+  _assert(ret == 0);
+  static uint8_t leaves[MMR_TREE_LEAVES][HASH_SIZE];
+  for (uint64_t i = 0; i < MMR_TREE_LEAVES; i++) {
+    memset(leaves[i], 0, HASH_SIZE);
+    memcpy(leaves[i], &i, sizeof(uint64_t));
+  }
+  ret = mmr_push_batch(&ctx, leaves, MMR_TREE_LEAVES / 2);
+  _assert(ret == 0);
+  for (uint64_t i = MMR_TREE_LEAVES / 2; i < MMR_TREE_LEAVES; i++) {
+    ret = mmr_push(&ctx, leaves[i]);
+    _assert(ret == 0);
+  }
+  _assert(ctx.mmr_size == shared_mmr_size);
+  _assert(test_store.len == shared_mmr_size);
+  ret = memcmp(nodes, shared_mmr_tree, shared_mmr_size * HASH_SIZE);
+  _assert(ret == 0);
+
+  /* root and proofs match the flat tree_buf */
+  MMRContext flat_ctx;
+  ret = mmr_initialize_context(&flat_ctx, shared_mmr_size, shared_mmr_tree,
+                               MMR_TREE_LEAVES * MMR_TREE_LEAVES, merge_hash);
+  _assert(ret == 0);
+  uint8_t root[HASH_SIZE], flat_root[HASH_SIZE];
+  _assert(mmr_get_root(&ctx, root) == 0);
+  _assert(mmr_get_root(&flat_ctx, flat_root) == 0);
+  _assert(memcmp(root, flat_root, HASH_SIZE) == 0);
+  store.batch_get = test_store_batch_get;
+  for (uint64_t i = 0; i < MMR_TREE_LEAVES; i += 7) {
+    uint8_t proof[64][HASH_SIZE], flat_proof[64][HASH_SIZE];
+    size_t proof_len = 64, flat_proof_len = 64;
+    uint64_t pos = mmr_leaf_index_to_pos(i);
+    _assert(mmr_gen_proof(&ctx, proof, &proof_len, pos) == 0);
+    _assert(mmr_gen_proof(&flat_ctx, flat_proof, &flat_proof_len, pos) == 0);
+    _assert(proof_len == flat_proof_len);
+    _assert(memcmp(proof, flat_proof, proof_len * HASH_SIZE) == 0);
+  }
+  _assert(test_store.batch_gets > 0);
+
+  /* errors of the store are returned */
+  test_store.cap = test_store.len;
+  _assert(mmr_push(&ctx, leaves[0]) == -1);
+  _assert(ctx.mmr_size == shared_mmr_size);
+  test_store.len = 0;
+  /* a new context, the peaks are not cached yet */
+  ret = mmr_initialize_store_context(&ctx, shared_mmr_size, &store,
+                                     merge_hash);
+  _assert(ret == 0);
+  _assert(mmr_get_root(&ctx, root) == -1);
+  uint8_t proof[64][HASH_SIZE];
+  size_t proof_len = 64;
+  _assert(mmr_gen_proof(&ctx, proof, &proof_len, 0) == -1);
+  return 0;
+}
+
+int test_peaks_cache() {
+  static uint8_t nodes[MMR_TREE_LEAVES * 2][HASH_SIZE];
+  TestStore test_store = {nodes, 0, MMR_TREE_LEAVES * 2, 0, 0};
+  MMRStore store = {.data = &test_store,
+                    .get = test_store_get,
+                    .append = test_store_append,
+                    .batch_get = NULL,
+                    .truncate = NULL};
+  MMRContext ctx;
+  int ret = mmr_initialize_store_context(&ctx, 0, &store, merge_hash);
+  _assert(ret == 0);
+  for (uint64_t i = 0; i < MMR_TREE_LEAVES; i++) {
+    uint8_t leaf[HASH_SIZE] = {0};
+    memcpy(leaf, &i, sizeof(uint64_t));
+    _assert(mmr_push(&ctx, leaf) == 0);
+    /* root from the cache matches the bagging of the flat tree */
+    MMRContext flat_ctx;
+    ret = mmr_initialize_context(&flat_ctx, ctx.mmr_size, shared_mmr_tree,
+                                 MMR_TREE_LEAVES * MMR_TREE_LEAVES,
+                                 merge_hash);
+    _assert(ret == 0);
+    uint8_t root[HASH_SIZE], flat_root[HASH_SIZE];
+    _assert(mmr_get_root(&ctx, root) == 0);
+    _assert(mmr_get_root(&flat_ctx, flat_root) == 0);
+    _assert(memcmp(root, flat_root, HASH_SIZE) == 0);
+    /* only the new peaks are read, at most the new leaf and its parents */
+    size_t gets = test_store.gets;
+    _assert(mmr_get_root(&ctx, root) == 0);
+    _assert(test_store.gets == gets);
+    uint64_t leaf_pos = mmr_leaf_index_to_pos(i);
+    uint8_t proof[64][HASH_SIZE], flat_proof[64][HASH_SIZE];
+    size_t proof_len = 64, flat_proof_len = 64;
+    _assert(mmr_gen_proof(&ctx, proof, &proof_len, leaf_pos / 2) == 0);
+    _assert(mmr_gen_proof(&flat_ctx, flat_proof, &flat_proof_len,
+                          leaf_pos / 2) == 0);
+    _assert(proof_len == flat_proof_len);
+    _assert(memcmp(proof, flat_proof, proof_len * HASH_SIZE) == 0);
+  }
+  return 0;
+}
+
+int test_build_parallel() {
+  static uint8_t leaves[MMR_TREE_LEAVES][HASH_SIZE];
+  for (uint64_t i = 0; i < MMR_TREE_LEAVES; i++) {
+    memset(leaves[i], 0, HASH_SIZE);
+    memcpy(leaves[i], &i, sizeof(uint64_t));
+  }
+  static uint8_t tree_buf[MMR_TREE_LEAVES * 2][HASH_SIZE];
+  size_t threads[] = {0, 2, 3, 8, 64};
+  uint64_t heads[] = {0, 1, 13, 256};
+  for (size_t t = 0; t < sizeof(threads) / sizeof(threads[0]); t++) {
+    for (size_t h = 0; h < sizeof(heads) / sizeof(heads[0]); h++) {
+      MMRContext ctx;
+      int ret = mmr_initialize_context(&ctx, 0, tree_buf, MMR_TREE_LEAVES * 2,
+                                       merge_hash);
+      _assert(ret == 0);
+      /* start from a non empty mmr */
+      _assert(mmr_push_batch(&ctx, leaves, heads[h]) == 0);
+      ret = mmr_build_parallel(&ctx, &leaves[heads[h]],
+                               MMR_TREE_LEAVES - heads[h], threads[t]);
+      _assert(ret == 0);
+      _assert(ctx.mmr_size == shared_mmr_size);
+      ret = memcmp(tree_buf, shared_mmr_tree, shared_mmr_size * HASH_SIZE);
+      _assert(ret == 0);
+    }
+  }
+  /* tree_buf is not enough */
+  MMRContext ctx;
+  int ret = mmr_initialize_context(&ctx, 0, tree_buf, shared_mmr_size - 1,
+                                   merge_hash);
+  _assert(ret == 0);
+  _assert(mmr_build_parallel(&ctx, leaves, MMR_TREE_LEAVES, 4) == -1);
+  _assert(ctx.mmr_size == 0);
+  return 0;
+}
+
+#define FOREST_SHARDS 8
+#define FOREST_SHARD_LEAVES 200
+
+int test_forest() {
+  static uint8_t trees[FOREST_SHARDS][FOREST_SHARD_LEAVES * 2][HASH_SIZE];
+  static uint8_t leaves[FOREST_SHARDS][FOREST_SHARD_LEAVES][HASH_SIZE];
+  for (uint64_t s = 0; s < FOREST_SHARDS; s++) {
+    for (uint64_t i = 0; i < FOREST_SHARD_LEAVES; i++) {
+      uint64_t value = s * 1000 + i;
+      memset(leaves[s][i], 0, HASH_SIZE);
+      memcpy(leaves[s][i], &value, sizeof(uint64_t));
+    }
+  }
+  /* shard 0 stays empty */
+  size_t first[FOREST_SHARDS] = {0, 1, 7, 100, 13, 64, 3, 150};
+  size_t second[FOREST_SHARDS] = {0, 0, 9, 100, 1, 64, 120, 50};
+  size_t threads[] = {0, 4};
+  for (size_t t = 0; t < sizeof(threads) / sizeof(threads[0]); t++) {
+    MMRContext shards[FOREST_SHARDS];
+    for (size_t s = 0; s < FOREST_SHARDS; s++) {
+      _assert(mmr_initialize_context(&shards[s], 0, trees[s],
+                                     FOREST_SHARD_LEAVES * 2,
+                                     merge_hash) == 0);
+    }
+    static MMRForest forest;
+    _assert(mmr_forest_init(&forest, shards, 0, merge_hash) == -1);
+    _assert(mmr_forest_init(&forest, shards, FOREST_SHARDS, merge_hash) == 0);
+    mmr_forest_set_merge_many(&forest, merge_hash_many);
+    /* the pool threads are reused by every push and root */
+    static MMRThreadPool pool;
+    _assert(mmr_thread_pool_init(&pool, threads[t]) == 0);
+    _assert(pool.len == (threads[t] > 1 ? threads[t] - 1 : 0));
+    MMRThreadPool *thread_pool = threads[t] > 1 ? &pool : NULL;
+    uint8_t(*first_leaves[FOREST_SHARDS])[HASH_SIZE];
+    uint8_t(*second_leaves[FOREST_SHARDS])[HASH_SIZE];
+    for (size_t s = 0; s < FOREST_SHARDS; s++) {
+      first_leaves[s] = leaves[s];
+      second_leaves[s] = second[s] > 0 ? &leaves[s][first[s]] : NULL;
+    }
+    _assert(mmr_forest_push(&forest, first_leaves, first, thread_pool) == 0);
+    uint8_t root[HASH_SIZE];
+    _assert(mmr_forest_get_root(&forest, root, thread_pool) == 0);
+    _assert(mmr_forest_push(&forest, second_leaves, second, thread_pool) == 0);
+    /* the root is stale after a push */
+    uint8_t proof[MMR_MAX_PEAKS * 2][HASH_SIZE];
+    size_t proof_len = MMR_MAX_PEAKS * 2;
+    _assert(mmr_forest_gen_proof(&forest, 1, 0, proof, &proof_len) == -1);
+    _assert(mmr_forest_get_root(&forest, root, thread_pool) == 0);
+
+    /* the top mmr over the shard roots pushed one by one */
+    uint8_t roots[FOREST_SHARDS][HASH_SIZE];
+    uint64_t sizes[FOREST_SHARDS];
+    for (size_t s = 0; s < FOREST_SHARDS; s++) {
+      MMRContext ctx;
+      static uint8_t tree[FOREST_SHARD_LEAVES * 2][HASH_SIZE];
+      mmr_initialize_context(&ctx, 0, tree, FOREST_SHARD_LEAVES * 2,
+                             merge_hash);
+      memset(roots[s], 0, HASH_SIZE);
+      for (size_t i = 0; i < first[s] + second[s]; i++) {
+        _assert(mmr_push(&ctx, leaves[s][i]) == 0);
+      }
+      _assert(ctx.mmr_size == shards[s].mmr_size);
+      sizes[s] = ctx.mmr_size;
+      if (ctx.mmr_size > 0) {
+        _assert(mmr_get_root(&ctx, roots[s]) == 0);
+      }
+    }
+    MMRContext top_ctx;
+    uint8_t top_tree[FOREST_SHARDS * 2][HASH_SIZE];
+    mmr_initialize_context(&top_ctx, 0, top_tree, FOREST_SHARDS * 2,
+                           merge_hash);
+    for (size_t s = 0; s < FOREST_SHARDS; s++) {
+      _assert(mmr_push(&top_ctx, roots[s]) == 0);
+    }
+    uint8_t expected_root[HASH_SIZE];
+    _assert(mmr_get_root(&top_ctx, expected_root) == 0);
+    _assert(memcmp(root, expected_root, HASH_SIZE) == 0);
+
+    MMRVerifyContext verify_ctx;
+    mmr_initialize_verify_context(&verify_ctx, merge_hash);
+    for (size_t s = 1; s < FOREST_SHARDS; s++) {
+      uint64_t count = first[s] + second[s];
+      uint64_t picks[] = {0, count / 2, count - 1};
+      for (size_t k = 0; k < 3; k++) {
+        uint64_t pos = mmr_leaf_index_to_pos(picks[k]);
+        proof_len = MMR_MAX_PEAKS * 2;
+        _assert(mmr_forest_gen_proof(&forest, s, pos, proof, &proof_len) == 0);
+        _assert(mmr_forest_verify_proof(&verify_ctx, root, FOREST_SHARDS, s,
+                                        sizes[s], leaves[s][picks[k]], pos,
+                                        proof, proof_len) == 0);
+        /* a proof binds its shard and leaf */
+        _assert(mmr_forest_verify_proof(&verify_ctx, root, FOREST_SHARDS,
+                                        (s + 1) % FOREST_SHARDS, sizes[s],
+                                        leaves[s][picks[k]], pos, proof,
+                                        proof_len) != 0);
+        _assert(mmr_forest_verify_proof(&verify_ctx, root, FOREST_SHARDS, s,
+                                        sizes[s], leaves[s][picks[k] ^ 1],
+                                        pos, proof, proof_len) != 0);
+        _assert(mmr_forest_verify_proof(&verify_ctx, root, FOREST_SHARDS, s,
+                                        sizes[s], leaves[s][picks[k]], pos,
+                                        proof, proof_len - 1) != 0);
+      }
+    }
+    /* the empty shard has no leaf to prove */
+    proof_len = MMR_MAX_PEAKS * 2;
+    _assert(mmr_forest_gen_proof(&forest, 0, 0, proof, &proof_len) == -1);
+    _assert(mmr_forest_gen_proof(&forest, FOREST_SHARDS, 0, proof,
+                                 &proof_len) == -1);
+    mmr_thread_pool_free(&pool);
+  }
+  return 0;
+}
+
+int test_verify_many() {
+  MMRContext ctx;
+  int ret = mmr_initialize_context(&ctx, shared_mmr_size, shared_mmr_tree,
+                                   MMR_TREE_LEAVES * MMR_TREE_LEAVES,
+                                   merge_hash);
+  _assert(ret == 0);
+  uint8_t root[HASH_SIZE];
+  _assert(mmr_get_root(&ctx, root) == 0);
+  static uint8_t leaves[MMR_TREE_LEAVES][HASH_SIZE];
+  static uint8_t proofs[MMR_TREE_LEAVES][64][HASH_SIZE];
+  static MMRVerifyItem items[MMR_TREE_LEAVES];
+  for (uint64_t i = 0; i < MMR_TREE_LEAVES; i++) {
+    memset(leaves[i], 0, HASH_SIZE);
+    memcpy(leaves[i], &i, sizeof(uint64_t));
+    items[i].leaf_hash = leaves[i];
+    items[i].pos = mmr_leaf_index_to_pos(i);
+    items[i].proof = proofs[i];
+    items[i].proof_len = 64;
+    _assert(mmr_gen_proof(&ctx, proofs[i], &items[i].proof_len,
+                          items[i].pos) == 0);
+  }
+  MMRVerifyContext verify_ctx;
+  mmr_initialize_verify_context(&verify_ctx, merge_hash);
+  mmr_set_verify_merge_many(&verify_ctx, merge_hash_many);
+  uint8_t results[(MMR_TREE_LEAVES + 7) / 8];
+  merge_many_calls = 0;
+  merge_many_lanes = 0;
+  ret = mmr_verify_many(&verify_ctx, root, shared_mmr_size, items,
+                        MMR_TREE_LEAVES, results);
+  _assert(ret == 0);
+  for (size_t i = 0; i < MMR_TREE_LEAVES; i++) {
+    _assert((results[i / 8] >> (i % 8)) & 1);
+  }
+  /* merges of different proofs share the calls */
+  _assert(merge_many_lanes > merge_many_calls * 32);
+
+  /* invalid proofs are reported in the bitmap */
+  leaves[3][0] ^= 1;
+  proofs[100][2][5] ^= 1;
+  items[500].pos = items[501].pos;
+  items[999].proof_len--;
+  ret = mmr_verify_many(&verify_ctx, root, shared_mmr_size, items,
+                        MMR_TREE_LEAVES, results);
+  _assert(ret == -1);
+  for (size_t i = 0; i < MMR_TREE_LEAVES; i++) {
+    int valid = i != 3 && i != 100 && i != 500 && i != 999;
+    _assert(((results[i / 8] >> (i % 8)) & 1) == valid);
+    /* the same result as verifying one by one */
+    uint8_t proof_root[HASH_SIZE];
+    mmr_compute_proof_root(&verify_ctx, proof_root, shared_mmr_size,
+                           items[i].leaf_hash, items[i].pos, items[i].proof,
+                           items[i].proof_len);
+    _assert((memcmp(proof_root, root, HASH_SIZE) == 0) == valid);
+  }
+  return 0;
+}
+
+typedef struct SnapshotReader {
+  MMRContext *ctx;
+  int *done;
+  size_t proofs;
+  int failed;
+} SnapshotReader;
+
+static void *read_snapshots(void *arg) {
+  SnapshotReader *reader = (SnapshotReader *)arg;
+  MMRVerifyContext verify_ctx;
+  mmr_initialize_verify_context(&verify_ctx, merge_hash);
+  uint64_t seed = (uint64_t)(uintptr_t)arg;
+  while (!__atomic_load_n(reader->done, __ATOMIC_ACQUIRE)) {
+    MMRContext snapshot;
+    if (mmr_snapshot(reader->ctx, &snapshot) != 0) {
+      reader->failed = 1;
+      break;
+    }
+    if (snapshot.mmr_size == 0) {
+      continue;
+    }
+    /* the root of the snapshot is the root of the same size in the shared
+     * tree, and a proof of the snapshot verifies against it */
+    MMRContext expected_ctx;
+    mmr_initialize_context(&expected_ctx, snapshot.mmr_size, shared_mmr_tree,
+                           MMR_TREE_LEAVES * MMR_TREE_LEAVES, merge_hash);
+    uint8_t root[HASH_SIZE], expected_root[HASH_SIZE];
+    if (mmr_get_root(&snapshot, root) != 0 ||
+        mmr_get_root(&expected_ctx, expected_root) != 0 ||
+        memcmp(root, expected_root, HASH_SIZE) != 0) {
+      reader->failed = 1;
+      break;
+    }
+    seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+    uint64_t pos = (seed >> 16) % snapshot.mmr_size;
+    uint8_t proof[64][HASH_SIZE], proof_root[HASH_SIZE];
+    size_t proof_len = 64;
+    if (mmr_gen_proof(&snapshot, proof, &proof_len, pos) != 0) {
+      reader->failed = 1;
+      break;
+    }
+    mmr_compute_proof_root(&verify_ctx, proof_root, snapshot.mmr_size,
+                           shared_mmr_tree[pos], pos, proof, proof_len);
+    if (memcmp(proof_root, root, HASH_SIZE) != 0) {
+      reader->failed = 1;
+      break;
+    }
+    reader->proofs++;
+  }
+  return NULL;
+}
+
+/* push the shared tree to an empty ctx while readers take snapshots */
+static int push_with_snapshot_readers(MMRContext *ctx) {
+  _assert(mmr_snapshot_size(ctx) == 0);
+  int done = 0;
+  SnapshotReader readers[4];
+  pthread_t threads[4];
+  for (size_t i = 0; i < 4; i++) {
+    readers[i] = (SnapshotReader){ctx, &done, 0, 0};
+    _assert(pthread_create(&threads[i], NULL, read_snapshots, &readers[i]) ==
+            0);
+  }
+  /* the writer pushes without a lock */
+  for (uint64_t i = 0; i < MMR_TREE_LEAVES; i++) {
+    uint8_t leaf[HASH_SIZE] = {0};
+    memcpy(leaf, &i, sizeof(uint64_t));
+    _assert(mmr_push(ctx, leaf) == 0);
+    if (i % 100 == 0) {
+      uint8_t root[HASH_SIZE];
+      _assert(mmr_get_root(ctx, root) == 0);
+    }
+  }
+  __atomic_store_n(&done, 1, __ATOMIC_RELEASE);
+  for (size_t i = 0; i < 4; i++) {
+    pthread_join(threads[i], NULL);
+    _assert(readers[i].failed == 0);
+  }
+  _assert(mmr_snapshot_size(ctx) == shared_mmr_size);
+  return 0;
+}
+
+int test_snapshot() {
+  static uint8_t tree_buf[MMR_TREE_LEAVES * 2][HASH_SIZE];
+  MMRContext ctx;
+  int ret = mmr_initialize_context(&ctx, 0, tree_buf, MMR_TREE_LEAVES * 2,
+                                   merge_hash);
+  _assert(ret == 0);
+  _assert(push_with_snapshot_readers(&ctx) == 0);
+  /* a snapshot never grows */
+  MMRContext snapshot;
+  _assert(mmr_snapshot(&ctx, &snapshot) == 0);
+  _assert(snapshot.mmr_size == shared_mmr_size);
+  uint8_t leaf[HASH_SIZE] = {0};
+  _assert(mmr_push(&snapshot, leaf) == -1);
+  /* nor shrinks, the nodes are shared with the writer */
+  _assert(mmr_truncate(&snapshot, 0) == -1);
+  _assert(snapshot.mmr_size == shared_mmr_size);
+
+  /* the arena grows its directory and segments under the readers */
+  MMRArena arena;
+  _assert(mmr_arena_init(&arena, 4, 0, NULL) == 0);
+  _assert(mmr_arena_initialize_context(&ctx, &arena, 0, merge_hash) == 0);
+  _assert(push_with_snapshot_readers(&ctx) == 0);
+  mmr_arena_free(&arena);
+  return 0;
+}
+
+int test_root_tracker() {
+  MMRVerifyContext verify_ctx;
+  mmr_initialize_verify_context(&verify_ctx, merge_hash);
+  uint64_t starts[] = {1, 2, 3, 7, 8, 100, 511};
+  for (size_t s = 0; s < sizeof(starts) / sizeof(starts[0]); s++) {
+    MMRSizePos last = mmr_compute_pos_by_leaf_index(starts[s] - 1);
+    MMRContext ctx;
+    int ret = mmr_initialize_context(&ctx, last.mmr_size, shared_mmr_tree,
+                                     MMR_TREE_LEAVES * MMR_TREE_LEAVES,
+                                     merge_hash);
+    _assert(ret == 0);
+    uint8_t root[HASH_SIZE], tracker_root[HASH_SIZE];
+    _assert(mmr_get_root(&ctx, root) == 0);
+    uint8_t proof[64][HASH_SIZE];
+    size_t proof_len = 64;
+    _assert(mmr_gen_proof(&ctx, proof, &proof_len, last.pos) == 0);
+    MMRRootTracker tracker;
+    ret = mmr_initialize_root_tracker(&tracker, merge_hash, last.mmr_size,
+                                      shared_mmr_tree[last.pos], proof,
+                                      proof_len, root);
+    _assert(ret == 0);
+    _assert(mmr_tracker_get_root(&tracker, tracker_root) == 0);
+    _assert(memcmp(tracker_root, root, HASH_SIZE) == 0);
+    /* follow the next leaves */
+    for (uint64_t i = starts[s]; i < starts[s] + 40; i++) {
+      uint8_t leaf[HASH_SIZE] = {0};
+      memcpy(leaf, &i, sizeof(uint64_t));
+      _assert(mmr_tracker_push(&tracker, leaf) == 0);
+      ctx.mmr_size = mmr_compute_pos_by_leaf_index(i).mmr_size;
+      _assert(mmr_get_root(&ctx, root) == 0);
+      _assert(mmr_tracker_get_root(&tracker, tracker_root) == 0);
+      _assert(memcmp(tracker_root, root, HASH_SIZE) == 0);
+    }
+    /* the proof must match the trusted root */
+    root[0] ^= 1;
+    ret = mmr_initialize_root_tracker(&tracker, merge_hash, last.mmr_size,
+                                      shared_mmr_tree[last.pos], proof,
+                                      proof_len, root);
+    _assert(ret == -1);
+    _assert(mmr_tracker_get_root(&tracker, tracker_root) == -1);
+  }
+  /* an empty tracker */
+  MMRRootTracker tracker;
+  uint8_t root[HASH_SIZE];
+  _assert(mmr_initialize_root_tracker(&tracker, merge_hash, 0, NULL, NULL, 0,
+                                      NULL) == 0);
+  _assert(mmr_tracker_get_root(&tracker, root) == -1);
+  _assert(mmr_tracker_push(&tracker, shared_mmr_tree[0]) == 0);
+  _assert(mmr_tracker_get_root(&tracker, root) == 0);
+  _assert(memcmp(root, shared_mmr_tree[0], HASH_SIZE) == 0);
+  return 0;
+}
+
+int test_compute_new_root_from_proof_many() {
+  MMRContext ctx;
+  int ret = mmr_initialize_context(&ctx, 0, shared_mmr_tree,
+                                   MMR_TREE_LEAVES * MMR_TREE_LEAVES,
+                                   merge_hash);
+  _assert(ret == 0);
+  MMRVerifyContext verify_ctx;
+  mmr_initialize_verify_context(&verify_ctx, merge_hash);
+  for (uint64_t i = 0; i + 1 < 300; i++) {
+    MMRSizePos last = mmr_compute_pos_by_leaf_index(i);
+    MMRSizePos next = mmr_compute_pos_by_leaf_index(i + 1);
+    ctx.mmr_size = last.mmr_size;
+    uint8_t proof[64][HASH_SIZE], proof_copy[64][HASH_SIZE];
+    size_t proof_len = 64;
+    _assert(mmr_gen_proof(&ctx, proof, &proof_len, last.pos) == 0);
+    memcpy(proof_copy, proof, proof_len * HASH_SIZE);
+    uint8_t new_root[HASH_SIZE], root[HASH_SIZE];
+    mmr_compute_new_root_from_last_leaf_proof(
+        &verify_ctx, new_root, last.mmr_size, shared_mmr_tree[last.pos],
+        last.pos, proof, proof_len, shared_mmr_tree[next.pos], next);
+    ctx.mmr_size = next.mmr_size;
+    _assert(mmr_get_root(&ctx, root) == 0);
+    _assert(memcmp(new_root, root, HASH_SIZE) == 0);
+    /* the proof is not modified */
+    _assert(memcmp(proof, proof_copy, proof_len * HASH_SIZE) == 0);
+  }
+  return 0;
+}
+
+static inline void merge_spec32(uint8_t *dst, uint8_t *left, uint8_t *right) {
+  blake2b_state blake2b_ctx;
+  blake2b_init(&blake2b_ctx, 32);
+  blake2b_update(&blake2b_ctx, left, 32);
+  blake2b_update(&blake2b_ctx, right, 32);
+  blake2b_final(&blake2b_ctx, dst, 32);
+}
+
+static inline void merge_spec64(uint8_t *dst, uint8_t *left, uint8_t *right) {
+  blake2b_state blake2b_ctx;
+  blake2b_init(&blake2b_ctx, 64);
+  blake2b_update(&blake2b_ctx, left, 64);
+  blake2b_update(&blake2b_ctx, right, 64);
+  blake2b_final(&blake2b_ctx, dst, 64);
+}
+
+MMR_DEFINE(mmr32, 32, merge_spec32)
+MMR_DEFINE(mmr64, 64, merge_spec64)
+
+int test_spec() {
+  /* the 32 bytes variant is the same as MMRContext */
+  static uint8_t tree32[MMR_TREE_LEAVES * 2][32];
+  mmr32_ctx ctx32;
+  _assert(mmr32_initialize_context(&ctx32, 0, tree32, MMR_TREE_LEAVES * 2) ==
+          0);
+  _assert(mmr32_initialize_context(&ctx32, 2, tree32, MMR_TREE_LEAVES * 2) ==
+          -1);
+  _assert(mmr32_initialize_context(&ctx32, 0, tree32, MMR_TREE_LEAVES * 2) ==
+          0);
+  for (uint64_t i = 0; i < MMR_TREE_LEAVES; i++) {
+    uint8_t leaf[32] = {0};
+    memcpy(leaf, &i, sizeof(uint64_t));
+    _assert(mmr32_push(&ctx32, leaf) == 0);
+  }
+  _assert(memcmp(tree32, shared_mmr_tree, shared_mmr_size * 32) == 0);
+  MMRContext ctx;
+  int ret = mmr_initialize_context(&ctx, shared_mmr_size, shared_mmr_tree,
+                                   MMR_TREE_LEAVES * MMR_TREE_LEAVES,
+                                   merge_hash);
+  _assert(ret == 0);
+  uint8_t root[HASH_SIZE], spec_root[32];
+  _assert(mmr_get_root(&ctx, root) == 0);
+  _assert(mmr32_get_root(&ctx32, spec_root) == 0);
+  _assert(memcmp(root, spec_root, HASH_SIZE) == 0);
+  for (uint64_t pos = 0; pos < shared_mmr_size; pos += 13) {
+    uint8_t proof[64][HASH_SIZE], spec_proof[64][32];
+    size_t proof_len = 64, spec_proof_len = 64;
+    _assert(mmr_gen_proof(&ctx, proof, &proof_len, pos) == 0);
+    _assert(mmr32_gen_proof(&ctx32, spec_proof, &spec_proof_len, pos) == 0);
+    _assert(proof_len == spec_proof_len);
+    _assert(memcmp(proof, spec_proof, proof_len * HASH_SIZE) == 0);
+    mmr32_compute_proof_root(spec_root, shared_mmr_size, tree32[pos], pos,
+                             spec_proof, spec_proof_len);
+    _assert(memcmp(root, spec_root, HASH_SIZE) == 0);
+  }
+
+  /* the 64 bytes variant verifies its own proofs at every size */
+  static uint8_t tree64[MMR_TREE_LEAVES][64];
+  mmr64_ctx ctx64;
+  _assert(mmr64_initialize_context(&ctx64, 0, tree64, MMR_TREE_LEAVES) == 0);
+  uint8_t root64[64], proof_root64[64];
+  _assert(mmr64_get_root(&ctx64, root64) == -1);
+  for (uint64_t i = 0; i < MMR_TREE_LEAVES / 2; i++) {
+    uint8_t leaf[64];
+    memset(leaf, (int)(i & 0xff), 64);
+    memcpy(leaf, &i, sizeof(uint64_t));
+    _assert(mmr64_push(&ctx64, leaf) == 0);
+    _assert(mmr64_get_root(&ctx64, root64) == 0);
+    uint64_t mmr_size = mmr_leaf_index_to_pos(i + 1);
+    uint64_t pos = mmr_leaf_index_to_pos(i * 7 % (i + 1));
+    uint8_t proof[64][64];
+    size_t proof_len = 64;
+    _assert(mmr64_gen_proof(&ctx64, proof, &proof_len, pos) == 0);
+    mmr64_compute_proof_root(proof_root64, mmr_size, tree64[pos], pos, proof,
+                             proof_len);
+    _assert(memcmp(root64, proof_root64, 64) == 0);
+    if (proof_len > 0) {
+      proof[proof_len - 1][63] ^= 1;
+      mmr64_compute_proof_root(proof_root64, mmr_size, tree64[pos], pos,
+                               proof, proof_len);
+      _assert(memcmp(root64, proof_root64, 64) != 0);
+    }
+  }
+  /* tree_buf is full */
+  uint8_t leaf[64] = {0};
+  ctx64.tree_buf_size = mmr_leaf_index_to_pos(ctx64.leaf_count);
+  _assert(mmr64_push(&ctx64, leaf) == -1);
+  return 0;
+}
+
+int test_range_proof() {
+  MMRContext ctx;
+  int ret = mmr_initialize_context(&ctx, shared_mmr_size, shared_mmr_tree,
+                                   MMR_TREE_LEAVES * MMR_TREE_LEAVES,
+                                   merge_hash);
+  _assert(ret == 0);
+  uint8_t root[HASH_SIZE];
+  _assert(mmr_get_root(&ctx, root) == 0);
+  MMRVerifyContext verify_ctx;
+  mmr_initialize_verify_context(&verify_ctx, merge_hash);
+  mmr_set_verify_merge_many(&verify_ctx, merge_hash_many);
+  uint64_t ranges[][2] = {{0, 1},     {0, 1000}, {999, 1000}, {1, 2},
+                          {3, 4},     {5, 300},  {511, 513},  {512, 992},
+                          {100, 900}, {992, 999}, {0, 512},   {497, 998}};
+  static uint64_t positions[MMR_TREE_LEAVES];
+  static uint8_t leaves[MMR_TREE_LEAVES][HASH_SIZE];
+  for (size_t r = 0; r < sizeof(ranges) / sizeof(ranges[0]); r++) {
+    uint64_t start = ranges[r][0], end = ranges[r][1];
+    size_t n = end - start;
+    uint8_t proof[128][HASH_SIZE], batch_proof[128][HASH_SIZE];
+    size_t proof_len = 128, batch_proof_len = 128;
+    ret = mmr_gen_range_proof(&ctx, proof, &proof_len, start, end);
+    _assert(ret == 0);
+    /* the same as the batch proof of the range */
+    for (size_t i = 0; i < n; i++) {
+      positions[i] = mmr_leaf_index_to_pos(start + i);
+    }
+    ret = mmr_gen_batch_proof(&ctx, batch_proof, &batch_proof_len, positions,
+                              n);
+    _assert(ret == 0);
+    _assert(proof_len == batch_proof_len);
+    _assert(memcmp(proof, batch_proof, proof_len * HASH_SIZE) == 0);
+    /* each node above the leaves is merged once */
+    for (size_t i = 0; i < n; i++) {
+      memcpy(leaves[i], shared_mmr_tree[positions[i]], HASH_SIZE);
+    }
+    merge_many_lanes = 0;
+    ret = mmr_verify_range_proof(&verify_ctx, root, shared_mmr_size, start,
+                                 leaves, n, proof, proof_len);
+    _assert(ret == 0);
+    _assert(merge_many_lanes < n + 2 * 10);
+    /* a wrong leaf or proof fails */
+    for (size_t i = 0; i < n; i++) {
+      memcpy(leaves[i], shared_mmr_tree[positions[i]], HASH_SIZE);
+    }
+    leaves[n / 2][0] ^= 1;
+    ret = mmr_verify_range_proof(&verify_ctx, root, shared_mmr_size, start,
+                                 leaves, n, proof, proof_len);
+    _assert(ret == -1);
+    for (size_t i = 0; i < n; i++) {
+      memcpy(leaves[i], shared_mmr_tree[positions[i]], HASH_SIZE);
+    }
+    ret = mmr_verify_range_proof(&verify_ctx, root, shared_mmr_size, start,
+                                 leaves, n, proof, proof_len - 1);
+    _assert(ret == -1);
+  }
+  uint8_t proof[128][HASH_SIZE];
+  size_t proof_len = 128;
+  _assert(mmr_gen_range_proof(&ctx, proof, &proof_len, 5, 5) == -1);
+  _assert(mmr_gen_range_proof(&ctx, proof, &proof_len, 5, 1001) == -1);
+  proof_len = 2;
+  _assert(mmr_gen_range_proof(&ctx, proof, &proof_len, 5, 300) == -1);
+  return 0;
+}
+
+/* root of the first leaf_count leaves of the shared mmr */
+static void shared_root(uint64_t leaf_count, uint8_t root[HASH_SIZE]) {
+  MMRContext ctx;
+  mmr_initialize_context(&ctx, mmr_leaf_count_to_size(leaf_count),
+                         shared_mmr_tree, MMR_TREE_LEAVES * MMR_TREE_LEAVES,
+                         merge_hash);
+  mmr_get_root(&ctx, root);
+}
+
+int test_consistency_proof() {
+  MMRContext ctx;
+  int ret = mmr_initialize_context(&ctx, shared_mmr_size, shared_mmr_tree,
+                                   MMR_TREE_LEAVES * MMR_TREE_LEAVES,
+                                   merge_hash);
+  _assert(ret == 0);
+  MMRVerifyContext verify_ctx;
+  mmr_initialize_verify_context(&verify_ctx, merge_hash);
+  uint64_t counts[][2] = {{1, 1},   {1, 2},     {1, 1000},  {2, 3},
+                          {3, 4},   {3, 1000},  {7, 8},     {8, 9},
+                          {11, 19}, {100, 101}, {511, 512}, {512, 1000},
+                          {513, 999}, {600, 700}, {999, 1000}, {1000, 1000}};
+  for (size_t c = 0; c < sizeof(counts) / sizeof(counts[0]); c++) {
+    uint64_t old_size = mmr_leaf_count_to_size(counts[c][0]);
+    uint64_t new_size = mmr_leaf_count_to_size(counts[c][1]);
+    uint8_t old_root[HASH_SIZE], new_root[HASH_SIZE];
+    shared_root(counts[c][0], old_root);
+    shared_root(counts[c][1], new_root);
+    uint8_t proof[MMR_MAX_PEAKS * 2][HASH_SIZE];
+    size_t proof_len = MMR_MAX_PEAKS * 2;
+    ret = mmr_gen_consistency_proof(&ctx, proof, &proof_len, old_size,
+                                    new_size);
+    _assert(ret == 0);
+    /* old peaks, a sibling per height and a bag */
+    _assert(proof_len <= 2 * 10 + 1);
+    ret = mmr_verify_consistency_proof(&verify_ctx, old_root, old_size,
+                                       new_root, new_size, proof, proof_len);
+    _assert(ret == 0);
+    /* the same proof from a context of new_size */
+    MMRContext new_ctx;
+    mmr_initialize_context(&new_ctx, new_size, shared_mmr_tree,
+                           MMR_TREE_LEAVES * MMR_TREE_LEAVES, merge_hash);
+    uint8_t proof2[MMR_MAX_PEAKS * 2][HASH_SIZE];
+    size_t proof2_len = MMR_MAX_PEAKS * 2;
+    ret = mmr_gen_consistency_proof(&new_ctx, proof2, &proof2_len, old_size,
+                                    new_size);
+    _assert(ret == 0 && proof2_len == proof_len);
+    _assert(memcmp(proof, proof2, proof_len * HASH_SIZE) == 0);
+    /* tampered proofs and roots */
+    for (size_t i = 0; i < proof_len; i++) {
+      proof[i][0] ^= 1;
+      ret = mmr_verify_consistency_proof(&verify_ctx, old_root, old_size,
+                                         new_root, new_size, proof, proof_len);
+      _assert(ret != 0);
+      proof[i][0] ^= 1;
+    }
+    ret = mmr_verify_consistency_proof(&verify_ctx, new_root, old_size,
+                                       old_root, new_size, proof, proof_len);
+    _assert(ret != 0 || counts[c][0] == counts[c][1]);
+    if (proof_len > 0) {
+      ret = mmr_verify_consistency_proof(&verify_ctx, old_root, old_size,
+                                         new_root, new_size, proof,
+                                         proof_len - 1);
+      _assert(ret != 0);
+    }
+  }
+  /* invalid sizes */
+  uint8_t proof[MMR_MAX_PEAKS * 2][HASH_SIZE];
+  size_t proof_len = MMR_MAX_PEAKS * 2;
+  _assert(mmr_gen_consistency_proof(&ctx, proof, &proof_len, 0, 1) != 0);
+  _assert(mmr_gen_consistency_proof(&ctx, proof, &proof_len, 2, 3) != 0);
+  _assert(mmr_gen_consistency_proof(&ctx, proof, &proof_len, 4, 3) != 0);
+  _assert(mmr_gen_consistency_proof(&ctx, proof, &proof_len, 1,
+                                    shared_mmr_size + 1) != 0);
+  proof_len = 1;
+  _assert(mmr_gen_consistency_proof(&ctx, proof, &proof_len, 4,
+                                    shared_mmr_size) != 0);
+  return 0;
+}
+
+int test_new_root_and_proof() {
+  MMRContext ctx;
+  int ret = mmr_initialize_context(&ctx, shared_mmr_size, shared_mmr_tree,
+                                   MMR_TREE_LEAVES * MMR_TREE_LEAVES,
+                                   merge_hash);
+  _assert(ret == 0);
+  MMRVerifyContext verify_ctx;
+  mmr_initialize_verify_context(&verify_ctx, merge_hash);
+  /* chain every leaf from the empty mmr */
+  uint64_t mmr_size = 0;
+  uint8_t leaf[HASH_SIZE], new_leaf[HASH_SIZE];
+  memset(leaf, 0, HASH_SIZE);
+  uint8_t proof[MMR_MAX_PEAKS][HASH_SIZE];
+  size_t proof_len = 0;
+  for (uint64_t i = 0; i < MMR_TREE_LEAVES; i++) {
+    memset(new_leaf, 0, HASH_SIZE);
+    memcpy(new_leaf, &i, sizeof(uint64_t));
+    uint8_t root[HASH_SIZE], expected_root[HASH_SIZE];
+    ret = mmr_compute_new_root_and_proof(&verify_ctx, root, &mmr_size, leaf,
+                                         proof, &proof_len, MMR_MAX_PEAKS,
+                                         new_leaf);
+    _assert(ret == 0);
+    _assert(mmr_size == mmr_leaf_count_to_size(i + 1));
+    shared_root(i + 1, expected_root);
+    _assert(memcmp(root, expected_root, HASH_SIZE) == 0);
+    /* the proof is the proof of the new leaf */
+    MMRContext prefix_ctx;
+    mmr_initialize_context(&prefix_ctx, mmr_size, shared_mmr_tree,
+                           MMR_TREE_LEAVES * MMR_TREE_LEAVES, merge_hash);
+    uint8_t expected_proof[MMR_MAX_PEAKS][HASH_SIZE];
+    size_t expected_len = MMR_MAX_PEAKS;
+    ret = mmr_gen_proof_by_leaf_index(&prefix_ctx, expected_proof,
+                                      &expected_len, i);
+    _assert(ret == 0 && proof_len == expected_len);
+    _assert(memcmp(proof, expected_proof, proof_len * HASH_SIZE) == 0);
+    /* the same root as the unfused version */
+    if (i > 0) {
+      uint8_t unfused_root[HASH_SIZE];
+      uint8_t last_proof[MMR_MAX_PEAKS][HASH_SIZE];
+      size_t last_len = MMR_MAX_PEAKS;
+      MMRSizePos last = mmr_compute_pos_by_leaf_index(i - 1);
+      prefix_ctx.mmr_size = last.mmr_size;
+      ret = mmr_gen_proof(&prefix_ctx, last_proof, &last_len, last.pos);
+      _assert(ret == 0);
+      mmr_compute_new_root_from_last_leaf_proof(
+          &verify_ctx, unfused_root, last.mmr_size, leaf, last.pos,
+          last_proof, last_len, new_leaf, mmr_compute_pos_by_leaf_index(i));
+      _assert(memcmp(unfused_root, root, HASH_SIZE) == 0);
+    }
+    memcpy(leaf, new_leaf, HASH_SIZE);
+  }
+  /* invalid size, proof length and buf */
+  uint8_t root[HASH_SIZE];
+  mmr_size = 2;
+  proof_len = 0;
+  ret = mmr_compute_new_root_and_proof(&verify_ctx, root, &mmr_size, leaf,
+                                       proof, &proof_len, MMR_MAX_PEAKS,
+                                       new_leaf);
+  _assert(ret != 0 && mmr_size == 2);
+  mmr_size = shared_mmr_size;
+  proof_len = 3;
+  ret = mmr_compute_new_root_and_proof(&verify_ctx, root, &mmr_size, leaf,
+                                       proof, &proof_len, MMR_MAX_PEAKS,
+                                       new_leaf);
+  _assert(ret != 0);
+  /* 3 leaves, the proof of the last leaf is one left peak */
+  mmr_size = 4;
+  proof_len = 1;
+  ret = mmr_compute_new_root_and_proof(&verify_ctx, root, &mmr_size, leaf,
+                                       proof, &proof_len, 1, new_leaf);
+  _assert(ret != 0);
+  return 0;
+}
+
+int test_proof_stream() {
+  MMRContext ctx;
+  int ret = mmr_initialize_context(&ctx, shared_mmr_size, shared_mmr_tree,
+                                   MMR_TREE_LEAVES * MMR_TREE_LEAVES,
+                                   merge_hash);
+  _assert(ret == 0);
+  uint8_t root[HASH_SIZE];
+  _assert(mmr_get_root(&ctx, root) == 0);
+  MMRVerifyContext verify_ctx;
+  mmr_initialize_verify_context(&verify_ctx, merge_hash);
+  /* proofs of all leaves back to back, like a receive buffer */
+  static uint8_t buf[MMR_TREE_LEAVES * 24][HASH_SIZE];
+  static size_t proof_lens[MMR_TREE_LEAVES];
+  size_t buf_len = 0;
+  for (uint64_t i = 0; i < MMR_TREE_LEAVES; i++) {
+    proof_lens[i] = 24;
+    ret = mmr_gen_proof(&ctx, &buf[buf_len], &proof_lens[i],
+                        mmr_leaf_index_to_pos(i));
+    _assert(ret == 0);
+    buf_len += proof_lens[i];
+  }
+  /* feed the proofs in chunks of 1 to 3 items, chunks cross proofs */
+  size_t offset = 0;
+  for (uint64_t i = 0; i < MMR_TREE_LEAVES; i++) {
+    uint64_t pos = mmr_leaf_index_to_pos(i);
+    MMRProofStream stream;
+    mmr_proof_stream_init(&stream, &verify_ctx, shared_mmr_size,
+                          shared_mmr_tree[pos], pos);
+    size_t end = offset + proof_lens[i];
+    size_t chunk = i % 3;
+    while (offset < end) {
+      size_t n = chunk < end - offset ? chunk : end - offset;
+      mmr_proof_stream_feed(&stream, &buf[offset], n);
+      offset += n;
+      chunk = chunk % 3 + 1;
+    }
+    uint8_t stream_root[HASH_SIZE];
+    mmr_proof_stream_finish(&stream, stream_root);
+    _assert(memcmp(stream_root, root, HASH_SIZE) == 0);
+  }
+  _assert(offset == buf_len);
+  return 0;
+}
+
+int test_truncate() {
+  static uint8_t tree_buf[MMR_TREE_LEAVES * 2][HASH_SIZE];
+  memcpy(tree_buf, shared_mmr_tree, shared_mmr_size * HASH_SIZE);
+  MMRContext ctx;
+  int ret = mmr_initialize_context(&ctx, shared_mmr_size, tree_buf,
+                                   MMR_TREE_LEAVES * 2, merge_hash);
+  _assert(ret == 0);
+  uint8_t root[HASH_SIZE], expected_root[HASH_SIZE];
+  _assert(mmr_get_root(&ctx, root) == 0);
+  _assert(mmr_truncate(&ctx, MMR_TREE_LEAVES + 1) == -1);
+  uint64_t counts[] = {999, 998, 700, 512, 511, 3, 1, 0};
+  for (size_t c = 0; c < sizeof(counts) / sizeof(counts[0]); c++) {
+    _assert(mmr_truncate(&ctx, counts[c]) == 0);
+    _assert(ctx.mmr_size == mmr_leaf_index_to_pos(counts[c]));
+    if (counts[c] == 0) {
+      _assert(mmr_get_root(&ctx, root) == -1);
+      continue;
+    }
+    MMRContext expected_ctx;
+    ret = mmr_initialize_context(&expected_ctx, ctx.mmr_size, shared_mmr_tree,
+                                 MMR_TREE_LEAVES * MMR_TREE_LEAVES,
+                                 merge_hash);
+    _assert(ret == 0);
+    _assert(mmr_get_root(&ctx, root) == 0);
+    _assert(mmr_get_root(&expected_ctx, expected_root) == 0);
+    _assert(memcmp(root, expected_root, HASH_SIZE) == 0);
+  }
+  /* a reorg, push other leaves back to a previous size */
+  for (uint64_t i = 0; i < 700; i++) {
+    uint8_t leaf[HASH_SIZE] = {0};
+    memcpy(leaf, &i, sizeof(uint64_t));
+    _assert(mmr_push(&ctx, leaf) == 0);
+  }
+  _assert(mmr_get_root(&ctx, root) == 0);
+  _assert(mmr_truncate(&ctx, 600) == 0);
+  for (uint64_t i = 600; i < 700; i++) {
+    uint8_t leaf[HASH_SIZE] = {1};
+    memcpy(leaf + 8, &i, sizeof(uint64_t));
+    _assert(mmr_push(&ctx, leaf) == 0);
+  }
+  _assert(mmr_get_root(&ctx, root) == 0);
+  MMRContext fresh_ctx;
+  ret = mmr_initialize_context(&fresh_ctx, ctx.mmr_size, tree_buf,
+                               MMR_TREE_LEAVES * 2, merge_hash);
+  _assert(ret == 0);
+  _assert(mmr_get_root(&fresh_ctx, expected_root) == 0);
+  _assert(memcmp(root, expected_root, HASH_SIZE) == 0);
+
+  /* only the new peaks are read from a store */
+  static uint8_t nodes[MMR_TREE_LEAVES * 2][HASH_SIZE];
+  memcpy(nodes, shared_mmr_tree, shared_mmr_size * HASH_SIZE);
+  TestStore test_store = {nodes, shared_mmr_size, MMR_TREE_LEAVES * 2, 0, 0};
+  MMRStore store = {.data = &test_store,
+                    .get = test_store_get,
+                    .append = test_store_append,
+                    .batch_get = NULL,
+                    .truncate = NULL};
+  ret = mmr_initialize_store_context(&ctx, shared_mmr_size, &store,
+                                     merge_hash);
+  _assert(ret == 0);
+  _assert(mmr_get_root(&ctx, root) == 0);
+  size_t gets = test_store.gets;
+  /* 1000 leaves has peaks of 512 256 128 64 32 8, 996 keeps all but 8 */
+  _assert(mmr_truncate(&ctx, 996) == 0);
+  _assert(test_store.gets - gets == 1);
+  _assert(mmr_get_root(&ctx, root) == 0);
+  _assert(test_store.gets - gets == 1);
+  return 0;
+}
+
+int test_top_cache() {
+  static uint8_t nodes[MMR_TREE_LEAVES * 2][HASH_SIZE];
+  memcpy(nodes, shared_mmr_tree, shared_mmr_size * HASH_SIZE);
+  TestStore test_store = {nodes, shared_mmr_size, MMR_TREE_LEAVES * 2, 0, 0};
+  MMRStore store = {.data = &test_store,
+                    .get = test_store_get,
+                    .append = test_store_append,
+                    .batch_get = NULL,
+                    .truncate = NULL};
+  MMRContext ctx;
+  int ret = mmr_initialize_store_context(&ctx, shared_mmr_size, &store,
+                                         merge_hash);
+  _assert(ret == 0);
+  static MMRCacheEntry cache[MMR_TOP_CACHE_ENTRIES(3)];
+  _assert(mmr_set_top_cache(&ctx, cache, MMR_TOP_CACHE_MAX_LEVELS + 1) == -1);
+  _assert(mmr_set_top_cache(&ctx, cache, 3) == 0);
+  MMRContext flat_ctx;
+  ret = mmr_initialize_context(&flat_ctx, shared_mmr_size, shared_mmr_tree,
+                               MMR_TREE_LEAVES * MMR_TREE_LEAVES, merge_hash);
+  _assert(ret == 0);
+
+  uint8_t proof[64][HASH_SIZE], flat_proof[64][HASH_SIZE];
+  size_t proof_len = 64;
+  uint64_t pos = mmr_leaf_index_to_pos(0);
+  _assert(mmr_gen_proof(&ctx, proof, &proof_len, pos) == 0);
+  /* 9 siblings to the peak of 512 leaves, 3 of them are under the peak */
+  size_t gets = test_store.gets;
+  proof_len = 64;
+  _assert(mmr_gen_proof(&ctx, proof, &proof_len, pos) == 0);
+  _assert(test_store.gets - gets == 6);
+  for (uint64_t i = 0; i < MMR_TREE_LEAVES; i += 7) {
+    size_t flat_proof_len = 64;
+    proof_len = 64;
+    pos = mmr_leaf_index_to_pos(i);
+    _assert(mmr_gen_proof(&ctx, proof, &proof_len, pos) == 0);
+    _assert(mmr_gen_proof(&flat_ctx, flat_proof, &flat_proof_len, pos) == 0);
+    _assert(proof_len == flat_proof_len);
+    _assert(memcmp(proof, flat_proof, proof_len * HASH_SIZE) == 0);
+  }
+
+  /* push other leaves after a truncate, no stale node is read */
+  _assert(mmr_truncate(&ctx, 700) == 0);
+  for (uint64_t i = 700; i < MMR_TREE_LEAVES; i++) {
+    uint8_t leaf[HASH_SIZE] = {1};
+    memcpy(leaf + 8, &i, sizeof(uint64_t));
+    _assert(mmr_push(&ctx, leaf) == 0);
+  }
+  MMRContext uncached_ctx;
+  ret = mmr_initialize_store_context(&uncached_ctx, ctx.mmr_size, &store,
+                                     merge_hash);
+  _assert(ret == 0);
+  for (uint64_t i = 600; i < MMR_TREE_LEAVES; i += 3) {
+    size_t uncached_proof_len = 64;
+    proof_len = 64;
+    pos = mmr_leaf_index_to_pos(i);
+    _assert(mmr_gen_proof(&ctx, proof, &proof_len, pos) == 0);
+    _assert(mmr_gen_proof(&uncached_ctx, flat_proof, &uncached_proof_len,
+                          pos) == 0);
+    _assert(proof_len == uncached_proof_len);
+    _assert(memcmp(proof, flat_proof, proof_len * HASH_SIZE) == 0);
+  }
+  _assert(mmr_set_top_cache(&ctx, NULL, 3) == 0);
+  _assert(ctx.top_cache_levels == 0);
+  return 0;
+}
+
+int test_two_phase_proof() {
+  MMRContext ctx;
+  int ret = mmr_initialize_context(&ctx, shared_mmr_size, shared_mmr_tree,
+                                   MMR_TREE_LEAVES * MMR_TREE_LEAVES,
+                                   merge_hash);
+  _assert(ret == 0);
+  MMRVerifyContext vctx;
+  mmr_initialize_verify_context(&vctx, merge_hash);
+  uint64_t positions[] = {0, 1, 500, 511, 512, 997, 999};
+  size_t n = sizeof(positions) / sizeof(positions[0]);
+  for (size_t i = 0; i < n; i++) {
+    positions[i] = mmr_leaf_index_to_pos(positions[i]);
+  }
+  uint64_t nodes_pos[64 * 8];
+  size_t nodes_len = 64 * 8;
+  ret = mmr_proof_nodes(ctx.mmr_size, positions, n, nodes_pos, &nodes_len);
+  _assert(ret == 0);
+  static uint8_t nodes[64 * 8][HASH_SIZE];
+  for (size_t i = 0; i < nodes_len; i++) {
+    _assert(i == 0 || nodes_pos[i - 1] < nodes_pos[i]);
+    memcpy(nodes[i], shared_mmr_tree[nodes_pos[i]], HASH_SIZE);
+  }
+  uint8_t proof[64][HASH_SIZE], expected_proof[64][HASH_SIZE];
+  for (size_t i = 0; i < n; i++) {
+    size_t proof_len = 64, expected_len = 64;
+    ret = mmr_assemble_proof(&vctx, ctx.mmr_size, positions[i], nodes_pos,
+                             nodes, nodes_len, proof, &proof_len);
+    _assert(ret == 0);
+    ret = mmr_gen_proof(&ctx, expected_proof, &expected_len, positions[i]);
+    _assert(ret == 0);
+    _assert(proof_len == expected_len);
+    _assert(memcmp(proof, expected_proof, proof_len * HASH_SIZE) == 0);
+  }
+  /* a single proof reads its siblings and the other peaks, 1000 leaves have
+   * peaks of 512 256 128 64 32 8 */
+  nodes_len = 64;
+  ret = mmr_proof_nodes(ctx.mmr_size, positions, 1, nodes_pos, &nodes_len);
+  _assert(ret == 0);
+  _assert(nodes_len == 9 + 5);
+  size_t proof_len = 64;
+  ret = mmr_assemble_proof(&vctx, ctx.mmr_size, positions[1], nodes_pos,
+                           nodes, nodes_len, proof, &proof_len);
+  _assert(ret == -1);
+  nodes_len = 13;
+  ret = mmr_proof_nodes(ctx.mmr_size, positions, 1, nodes_pos, &nodes_len);
+  _assert(ret == -1);
+  nodes_len = 64;
+  ret = mmr_proof_nodes(ctx.mmr_size, &ctx.mmr_size, 1, nodes_pos, &nodes_len);
+  _assert(ret == -1);
+  return 0;
+}
+
+int test_encoded_proof() {
+  MMRContext ctx;
+  int ret = mmr_initialize_context(&ctx, shared_mmr_size, shared_mmr_tree,
+                                   MMR_TREE_LEAVES * MMR_TREE_LEAVES,
+                                   merge_hash);
+  _assert(ret == 0);
+  MMRVerifyContext vctx;
+  mmr_initialize_verify_context(&vctx, merge_hash);
+  uint8_t root[HASH_SIZE];
+  _assert(mmr_get_root(&ctx, root) == 0);
+  /* encode at an odd offset to read the hashes unaligned */
+  static uint8_t storage[1 + 64 * 8 + 64 * 8 * HASH_SIZE];
+  uint8_t *buf = storage + 1;
+  uint8_t proof[64 * 8][HASH_SIZE];
+  uint8_t leaves[8][HASH_SIZE];
+  MMRProofHeader header;
+
+  /* single */
+  uint64_t pos = mmr_leaf_index_to_pos(123);
+  size_t proof_len = 64;
+  _assert(mmr_gen_proof(&ctx, proof, &proof_len, pos) == 0);
+  size_t buf_len = mmr_proof_encoded_size(MMR_PROOF_SINGLE, 1, proof_len) - 1;
+  _assert(mmr_encode_proof(buf, &buf_len, ctx.mmr_size, pos, proof,
+                           proof_len) == -1);
+  buf_len = sizeof(storage) - 1;
+  _assert(mmr_encode_proof(buf, &buf_len, ctx.mmr_size, pos, proof,
+                           proof_len) == 0);
+  _assert(buf_len == MMR_PROOF_HEADER_SIZE + proof_len * HASH_SIZE);
+  memcpy(leaves[0], shared_mmr_tree[pos], HASH_SIZE);
+  _assert(mmr_verify_encoded_proof(&vctx, root, buf, buf_len, &header, leaves,
+                                   NULL, 1) == 0);
+  _assert(header.kind == MMR_PROOF_SINGLE && header.pos == pos);
+  _assert(header.mmr_size == ctx.mmr_size && header.items == proof_len);
+  _assert(mmr_verify_encoded_proof(&vctx, root, buf, buf_len - 1, NULL, leaves,
+                                   NULL, 1) == -1);
+  _assert(mmr_verify_encoded_proof(&vctx, root, buf, buf_len, NULL, leaves,
+                                   NULL, 2) == -1);
+  uint8_t decoded[64][HASH_SIZE];
+  size_t decoded_len = 64;
+  _assert(mmr_decode_proof(buf, buf_len, &header, NULL, NULL, decoded,
+                           &decoded_len) == 0);
+  _assert(decoded_len == proof_len);
+  _assert(memcmp(decoded, proof, proof_len * HASH_SIZE) == 0);
+  buf[buf_len - 1] ^= 1;
+  _assert(mmr_verify_encoded_proof(&vctx, root, buf, buf_len, NULL, leaves,
+                                   NULL, 1) == -1);
+  buf[0] = 'X';
+  _assert(mmr_decode_proof_header(buf, buf_len, &header) == -1);
+
+  /* batch */
+  uint64_t positions[] = {mmr_leaf_index_to_pos(2), mmr_leaf_index_to_pos(600),
+                          mmr_leaf_index_to_pos(999)};
+  proof_len = 64 * 8;
+  _assert(mmr_gen_batch_proof(&ctx, proof, &proof_len, positions, 3) == 0);
+  buf_len = sizeof(storage) - 1;
+  _assert(mmr_encode_batch_proof(buf, &buf_len, ctx.mmr_size, positions, 3,
+                                 proof, proof_len) == 0);
+  for (size_t i = 0; i < 3; i++) {
+    memcpy(leaves[i], shared_mmr_tree[positions[i]], HASH_SIZE);
+  }
+  uint64_t work_positions[3];
+  _assert(mmr_verify_encoded_proof(&vctx, root, buf, buf_len, NULL, leaves,
+                                   NULL, 3) == -1);
+  _assert(mmr_verify_encoded_proof(&vctx, root, buf, buf_len, &header, leaves,
+                                   work_positions, 3) == 0);
+  _assert(header.kind == MMR_PROOF_BATCH && header.count == 3);
+  uint64_t decoded_positions[3];
+  size_t positions_len = 2;
+  decoded_len = 64;
+  _assert(mmr_decode_proof(buf, buf_len, &header, decoded_positions,
+                           &positions_len, decoded, &decoded_len) == -1);
+  positions_len = 3;
+  _assert(mmr_decode_proof(buf, buf_len, &header, decoded_positions,
+                           &positions_len, decoded, &decoded_len) == 0);
+  _assert(memcmp(decoded_positions, positions, sizeof(positions)) == 0);
+
+  /* range */
+  proof_len = 64 * 8;
+  _assert(mmr_gen_range_proof(&ctx, proof, &proof_len, 510, 514) == 0);
+  buf_len = sizeof(storage) - 1;
+  _assert(mmr_encode_range_proof(buf, &buf_len, ctx.mmr_size, 510, 4, proof,
+                                 proof_len) == 0);
+  for (size_t i = 0; i < 4; i++) {
+    memcpy(leaves[i], shared_mmr_tree[mmr_leaf_index_to_pos(510 + i)],
+           HASH_SIZE);
+  }
+  _assert(mmr_verify_encoded_proof(&vctx, root, buf, buf_len, &header, leaves,
+                                   NULL, 4) == 0);
+  _assert(header.kind == MMR_PROOF_RANGE && header.pos == 510);
+  _assert(mmr_verify_encoded_proof(&vctx, root, buf, buf_len, NULL, leaves + 1,
+                                   NULL, 3) == -1);
+  return 0;
+}
+
+int test_file_store() {
+  char path[] = "/tmp/mmr_test_XXXXXX";
+  int fd = mkstemp(path);
+  _assert(fd >= 0);
+  close(fd);
+
+  MMRFile file;
+  int ret = mmr_file_open(&file, path, MMR_FILE_WRITE | MMR_FILE_CREATE);
+  _assert(ret == 0);
+  MMRContext ctx;
+  ret = mmr_file_initialize_context(&ctx, &file, merge_hash);
+  _assert(ret == 0);
+  _assert(ctx.mmr_size == 0);
+  /* readers open the file and refresh instead */
+  MMRContext snapshot;
+  _assert(mmr_snapshot(&ctx, &snapshot) == -1);
+  for (uint64_t i = 0; i < MMR_TREE_LEAVES / 2; i++) {
+    uint8_t leaf[HASH_SIZE];
+    memset(leaf, 0, HASH_SIZE);
+    memcpy(leaf, &i, sizeof(uint64_t));
+    ret = mmr_push(&ctx, leaf);
+    _assert(ret == 0);
+  }
+  _assert(mmr_file_mmr_size(&file) == ctx.mmr_size);
+
+  /* a reader maps the same file while the writer appends */
+  MMRFile reader;
+  ret = mmr_file_open(&reader, path, MMR_FILE_READ_ONLY);
+  _assert(ret == 0);
+  for (uint64_t i = MMR_TREE_LEAVES / 2; i < MMR_TREE_LEAVES; i++) {
+    uint8_t leaf[HASH_SIZE];
+    memset(leaf, 0, HASH_SIZE);
+    memcpy(leaf, &i, sizeof(uint64_t));
+    ret = mmr_push(&ctx, leaf);
+    _assert(ret == 0);
+  }
+  _assert(ctx.mmr_size == shared_mmr_size);
+  _assert(mmr_file_sync(&file) == 0);
+  mmr_file_close(&file);
+
+  _assert(mmr_file_refresh(&reader) == shared_mmr_size);
+  MMRContext reader_ctx;
+  ret = mmr_file_initialize_context(&reader_ctx, &reader, merge_hash);
+  _assert(ret == 0);
+  _assert(reader_ctx.mmr_size == shared_mmr_size);
+  MMRContext flat_ctx;
+  ret = mmr_initialize_context(&flat_ctx, shared_mmr_size, shared_mmr_tree,
+                               MMR_TREE_LEAVES * MMR_TREE_LEAVES, merge_hash);
+  _assert(ret == 0);
+  uint8_t root[HASH_SIZE], flat_root[HASH_SIZE];
+  _assert(mmr_get_root(&reader_ctx, root) == 0);
+  _assert(mmr_get_root(&flat_ctx, flat_root) == 0);
+  _assert(memcmp(root, flat_root, HASH_SIZE) == 0);
+  uint8_t proof[64][HASH_SIZE], flat_proof[64][HASH_SIZE];
+  size_t proof_len = 64, flat_proof_len = 64;
+  uint64_t pos = mmr_leaf_index_to_pos(MMR_TREE_LEAVES / 3);
+  _assert(mmr_gen_proof(&reader_ctx, proof, &proof_len, pos) == 0);
+  _assert(mmr_gen_proof(&flat_ctx, flat_proof, &flat_proof_len, pos) == 0);
+  _assert(proof_len == flat_proof_len);
+  _assert(memcmp(proof, flat_proof, proof_len * HASH_SIZE) == 0);
+  /* read only */
+  _assert(mmr_push(&reader_ctx, root) == -1);
+  mmr_file_close(&reader);
+
+  /* reopen and continue to push */
+  ret = mmr_file_open(&file, path, MMR_FILE_WRITE);
+  _assert(ret == 0);
+  ret = mmr_file_initialize_context(&ctx, &file, merge_hash);
+  _assert(ret == 0);
+  _assert(ctx.mmr_size == shared_mmr_size);
+  _assert(mmr_get_root(&ctx, root) == 0);
+  _assert(memcmp(root, flat_root, HASH_SIZE) == 0);
+  _assert(mmr_push(&ctx, root) == 0);
+  /* a truncate is recorded in the file */
+  _assert(mmr_truncate(&ctx, MMR_TREE_LEAVES / 2) == 0);
+  _assert(mmr_file_mmr_size(&file) == ctx.mmr_size);
+  mmr_file_close(&file);
+  ret = mmr_file_open(&file, path, MMR_FILE_READ_ONLY);
+  _assert(ret == 0);
+  ret = mmr_file_initialize_context(&ctx, &file, merge_hash);
+  _assert(ret == 0);
+  _assert(ctx.mmr_size == mmr_leaf_index_to_pos(MMR_TREE_LEAVES / 2));
+  _assert(mmr_truncate(&ctx, 1) == -1);
+  mmr_file_close(&file);
+  unlink(path);
+
+  /* not a MMR file */
+  _assert(mmr_file_open(&file, "test_runner.c", MMR_FILE_READ_ONLY) == -1);
+  return 0;
+}
+
+int test_blocked_store() {
+  _assert(mmr_blocked_buf_size(0) == 0);
+  /* 1000 leaves fill 16 blocks of band 0 and 1 block of band 1 */
+  uint64_t buf_size = mmr_blocked_buf_size(MMR_TREE_LEAVES);
+  _assert(buf_size == 17 * MMR_BLOCK_SIZE);
+  uint8_t *buf = (uint8_t *)aligned_alloc(MMR_BLOCK_SIZE, buf_size);
+  _assert(buf != NULL);
+  MMRBlocked blocked;
+  _assert(mmr_blocked_init(&blocked, buf, buf_size - 1, MMR_TREE_LEAVES) ==
+          -1);
+  _assert(mmr_blocked_init(&blocked, buf, buf_size, MMR_TREE_LEAVES) == 0);
+  MMRContext ctx;
+  int ret = mmr_blocked_initialize_context(&ctx, &blocked, 0, merge_hash);
+  _assert(ret == 0);
+  for (uint64_t i = 0; i < MMR_TREE_LEAVES; i++) {
+    uint8_t leaf[HASH_SIZE];
+    memset(leaf, 0, HASH_SIZE);
+    memcpy(leaf, &i, sizeof(uint64_t));
+    _assert(mmr_push(&ctx, leaf) == 0);
+  }
+  _assert(ctx.mmr_size == shared_mmr_size);
+  uint8_t leaf[HASH_SIZE] = {0};
+  _assert(mmr_push(&ctx, leaf) == -1);
+
+  MMRContext flat_ctx;
+  ret = mmr_initialize_context(&flat_ctx, shared_mmr_size, shared_mmr_tree,
+                               MMR_TREE_LEAVES * MMR_TREE_LEAVES, merge_hash);
+  _assert(ret == 0);
+  uint8_t root[HASH_SIZE], flat_root[HASH_SIZE];
+  _assert(mmr_get_root(&ctx, root) == 0);
+  _assert(mmr_get_root(&flat_ctx, flat_root) == 0);
+  _assert(memcmp(root, flat_root, HASH_SIZE) == 0);
+  uint8_t proof[64][HASH_SIZE], flat_proof[64][HASH_SIZE];
+  for (uint64_t i = 0; i < MMR_TREE_LEAVES; i += 37) {
+    size_t proof_len = 64, flat_proof_len = 64;
+    uint64_t pos = mmr_leaf_index_to_pos(i);
+    _assert(mmr_gen_proof(&ctx, proof, &proof_len, pos) == 0);
+    _assert(mmr_gen_proof(&flat_ctx, flat_proof, &flat_proof_len, pos) == 0);
+    _assert(proof_len == flat_proof_len);
+    _assert(memcmp(proof, flat_proof, proof_len * HASH_SIZE) == 0);
+  }
+
+  /* every node has its own slot */
+  static uint8_t used[17 * MMR_BLOCK_NODES];
+  memset(used, 0, sizeof(used));
+  for (uint64_t pos = 0; pos < shared_mmr_size; pos++) {
+    uint64_t index = mmr_blocked_node_index(&blocked, pos);
+    _assert(index < 17 * MMR_BLOCK_NODES && !used[index]);
+    used[index] = 1;
+  }
+  /* the path of a leaf to the peak of 512 leaves crosses 2 blocks */
+  uint64_t pos = mmr_leaf_index_to_pos(100);
+  uint64_t first_block = mmr_blocked_node_index(&blocked, pos) /
+                         MMR_BLOCK_NODES;
+  for (uint32_t height = 0; height < 10; height++) {
+    uint64_t block = mmr_blocked_node_index(&blocked, pos) / MMR_BLOCK_NODES;
+    _assert(block == (height < MMR_BLOCK_LEVELS ? first_block : 16));
+    uint64_t leaf_index = mmr_pos_to_leaf_index(pos);
+    pos += ((leaf_index >> height) & 1) ? 1 : (2 << height);
+  }
+
+  /* load a postorder tree */
+  _assert(mmr_blocked_init(&blocked, buf, buf_size, MMR_TREE_LEAVES) == 0);
+  _assert(mmr_blocked_load(&blocked, shared_mmr_tree, shared_mmr_size) == 0);
+  ret = mmr_blocked_initialize_context(&ctx, &blocked, shared_mmr_size,
+                                       merge_hash);
+  _assert(ret == 0);
+  _assert(mmr_get_root(&ctx, root) == 0);
+  _assert(memcmp(root, flat_root, HASH_SIZE) == 0);
+  _assert(mmr_truncate(&ctx, 10) == 0);
+  ret = mmr_blocked_initialize_context(&ctx, &blocked, shared_mmr_size + 1,
+                                       merge_hash);
+  _assert(ret == -1);
+  free(buf);
+  return 0;
+}
+
+static int check_sparse_proof(MMRContext *ctx, MMRContext *flat_ctx,
+                              uint64_t leaf_index) {
+  uint8_t proof[64][HASH_SIZE], flat_proof[64][HASH_SIZE];
+  size_t proof_len = 64, flat_proof_len = 64;
+  uint64_t pos = mmr_leaf_index_to_pos(leaf_index);
+  _assert(mmr_gen_proof(ctx, proof, &proof_len, pos) == 0);
+  _assert(mmr_gen_proof(flat_ctx, flat_proof, &flat_proof_len, pos) == 0);
+  _assert(proof_len == flat_proof_len);
+  _assert(memcmp(proof, flat_proof, proof_len * HASH_SIZE) == 0);
+  return 0;
+}
+
+int test_sparse_store() {
+  static MMRSparseEntry entries[256];
+  uint64_t watched[8];
+  MMRSparse sparse;
+  _assert(mmr_sparse_init(&sparse, entries, 200, watched, 8) == -1);
+  _assert(mmr_sparse_init(&sparse, entries, 256, watched, 8) == 0);
+  uint64_t watch_leaves[] = {3, 100, 511, 512, 998};
+  for (size_t i = 0; i < 5; i++) {
+    _assert(mmr_sparse_watch(&sparse, watch_leaves[i]) == 0);
+  }
+  MMRContext ctx;
+  _assert(mmr_sparse_initialize_context(&ctx, &sparse, merge_hash) == 0);
+  MMRContext snapshot;
+  _assert(mmr_snapshot(&ctx, &snapshot) == -1);
+  for (uint64_t i = 0; i < MMR_TREE_LEAVES; i++) {
+    uint8_t leaf[HASH_SIZE];
+    memset(leaf, 0, HASH_SIZE);
+    memcpy(leaf, &i, sizeof(uint64_t));
+    _assert(mmr_push(&ctx, leaf) == 0);
+    /* the watched leaves, their siblings and the peaks */
+    _assert(sparse.len <= 5 * 11 + 10);
+  }
+  _assert(ctx.mmr_size == shared_mmr_size);
+  MMRContext flat_ctx;
+  int ret = mmr_initialize_context(&flat_ctx, shared_mmr_size, shared_mmr_tree,
+                                   MMR_TREE_LEAVES * MMR_TREE_LEAVES,
+                                   merge_hash);
+  _assert(ret == 0);
+  uint8_t root[HASH_SIZE], flat_root[HASH_SIZE];
+  _assert(mmr_get_root(&ctx, root) == 0);
+  _assert(mmr_get_root(&flat_ctx, flat_root) == 0);
+  _assert(memcmp(root, flat_root, HASH_SIZE) == 0);
+  for (size_t i = 0; i < 5; i++) {
+    _assert(check_sparse_proof(&ctx, &flat_ctx, watch_leaves[i]) == 0);
+  }
+  uint8_t proof[64][HASH_SIZE];
+  size_t proof_len = 64;
+  _assert(mmr_gen_proof(&ctx, proof, &proof_len, mmr_leaf_index_to_pos(5)) ==
+          -1);
+  /* the siblings of 5 are dropped, the siblings of 999 are kept for 998 */
+  _assert(mmr_sparse_watch(&sparse, 5) == -1);
+  _assert(mmr_sparse_watch(&sparse, 999) == 0);
+  _assert(check_sparse_proof(&ctx, &flat_ctx, 999) == 0);
+
+  uint64_t len = sparse.len;
+  _assert(mmr_sparse_unwatch(&sparse, 7) == -1);
+  _assert(mmr_sparse_unwatch(&sparse, 100) == 0);
+  _assert(sparse.len < len);
+  proof_len = 64;
+  _assert(mmr_gen_proof(&ctx, proof, &proof_len,
+                        mmr_leaf_index_to_pos(100)) == -1);
+  uint64_t kept_leaves[] = {3, 511, 512, 998, 999};
+  for (size_t i = 0; i < 5; i++) {
+    _assert(check_sparse_proof(&ctx, &flat_ctx, kept_leaves[i]) == 0);
+  }
+  _assert(mmr_get_root(&ctx, root) == 0);
+  _assert(memcmp(root, flat_root, HASH_SIZE) == 0);
+  _assert(mmr_truncate(&ctx, 10) == -1);
+  return 0;
+}
+
+typedef struct TestAllocator {
+  int allocs;
+  int frees;
+  /* fail the allocations after this many */
+  int max_allocs;
+} TestAllocator;
+
+static void *test_alloc(void *data, size_t size, int flags) {
+  TestAllocator *allocator = (TestAllocator *)data;
+  (void)flags;
+  if (allocator->allocs >= allocator->max_allocs) {
+    return NULL;
+  }
+  allocator->allocs++;
+  return malloc(size);
+}
+
+static void test_free(void *data, void *ptr, size_t size, int flags) {
+  TestAllocator *allocator = (TestAllocator *)data;
+  (void)size;
+  (void)flags;
+  allocator->frees++;
+  free(ptr);
+}
+
+int test_arena_store() {
+  TestAllocator test_allocator = {0, 0, 10};
+  MMRArenaAllocator allocator = {&test_allocator, test_alloc, test_free};
+  MMRArena arena;
+  _assert(mmr_arena_init(&arena, 64, 0, &allocator) == -1);
+  /* 16 nodes per segment, a directory of 16 segments is grown once */
+  _assert(mmr_arena_init(&arena, 4, 0, &allocator) == 0);
+  MMRContext ctx;
+  _assert(mmr_arena_initialize_context(&ctx, &arena, 0, merge_hash) == 0);
+  int failed = 0;
+  for (uint64_t i = 0; i < MMR_TREE_LEAVES; i++) {
+    uint8_t leaf[HASH_SIZE];
+    memset(leaf, 0, HASH_SIZE);
+    memcpy(leaf, &i, sizeof(uint64_t));
+    if (mmr_push(&ctx, leaf) != 0) {
+      /* the allocator is out, the push is retried once it's back */
+      failed++;
+      test_allocator.max_allocs += 1000;
+      _assert(mmr_push(&ctx, leaf) == 0);
+    }
+  }
+  _assert(failed == 1);
+  _assert(ctx.mmr_size == shared_mmr_size);
+  /* the first directory is still readable after it is replaced */
+  _assert(arena.segments_cap > 16);
+  uint8_t (**first)[HASH_SIZE] = arena.segments;
+  for (uint64_t cap = arena.segments_cap; first[cap] != NULL; cap /= 2) {
+    first = (uint8_t(**)[HASH_SIZE])first[cap];
+  }
+  _assert(first[0] == arena.segments[0]);
+  /* every segment is still where it was allocated */
+  _assert(arena.segments_len == (shared_mmr_size + 15) / 16);
+  for (uint64_t pos = 0; pos < shared_mmr_size; pos++) {
+    _assert(memcmp(mmr_arena_node(&arena, pos), shared_mmr_tree[pos],
+                   HASH_SIZE) == 0);
+  }
+  _assert(mmr_arena_node(&arena, shared_mmr_size) == NULL);
+  uint8_t root[HASH_SIZE], expected_root[HASH_SIZE];
+  _assert(mmr_get_root(&ctx, root) == 0);
+  shared_root(MMR_TREE_LEAVES, expected_root);
+  _assert(memcmp(root, expected_root, HASH_SIZE) == 0);
+  uint8_t proof[MMR_MAX_PEAKS][HASH_SIZE];
+  size_t proof_len = MMR_MAX_PEAKS;
+  _assert(mmr_gen_proof_by_leaf_index(&ctx, proof, &proof_len, 500) == 0);
+  /* truncate keeps the segments */
+  _assert(mmr_truncate(&ctx, 500) == 0);
+  _assert(arena.segments_len == (shared_mmr_size + 15) / 16);
+  mmr_arena_free(&arena);
+  _assert(test_allocator.allocs == test_allocator.frees);
+
+  /* the default allocator with huge pages falls back to normal pages */
+  _assert(mmr_arena_init(&arena, MMR_ARENA_DEFAULT_SEGMENT_SHIFT,
+                         MMR_ARENA_HUGE_PAGES | MMR_ARENA_NUMA_LOCAL,
+                         NULL) == 0);
+  _assert(mmr_arena_reserve(&arena, shared_mmr_size) == 0);
+  _assert(arena.segments_len == 1);
+  _assert(mmr_arena_initialize_context(&ctx, &arena, 0, merge_hash) == 0);
+  static uint8_t leaves[MMR_TREE_LEAVES][HASH_SIZE];
+  for (uint64_t i = 0; i < MMR_TREE_LEAVES; i++) {
+    memset(leaves[i], 0, HASH_SIZE);
+    memcpy(leaves[i], &i, sizeof(uint64_t));
+  }
+  _assert(mmr_push_batch(&ctx, leaves, MMR_TREE_LEAVES) == 0);
+  _assert(mmr_get_root(&ctx, root) == 0);
+  _assert(memcmp(root, expected_root, HASH_SIZE) == 0);
+  mmr_arena_free(&arena);
+  return 0;
+}
+
+int test_accumulator() {
+  static uint8_t leaves[MMR_TREE_LEAVES][HASH_SIZE];
+  for (uint64_t i = 0; i < MMR_TREE_LEAVES; i++) {
+    memset(leaves[i], 0, HASH_SIZE);
+    memcpy(leaves[i], &i, sizeof(uint64_t));
+  }
+  MMRAccumulator acc, batch_acc;
+  _assert(mmr_initialize_accumulator(&acc, merge_hash) == 0);
+  _assert(mmr_initialize_accumulator(&batch_acc, merge_hash) == 0);
+  mmr_acc_set_merge_many(&batch_acc, merge_hash_many);
+  uint8_t root[HASH_SIZE];
+  _assert(mmr_acc_get_root(&acc, root) == -1);
+
+  size_t batch = 1;
+  for (uint64_t i = 0; i < MMR_TREE_LEAVES; i++) {
+    _assert(mmr_acc_push(&acc, leaves[i]) == 0);
+    /* the root is the same as the mmr of the same leaves */
+    MMRContext ctx;
+    MMRSizePos pos = mmr_compute_pos_by_leaf_index(i);
+    int ret = mmr_initialize_context(&ctx, pos.mmr_size, shared_mmr_tree,
+                                     MMR_TREE_LEAVES * MMR_TREE_LEAVES,
+                                     merge_hash);
+    _assert(ret == 0);
+    uint8_t mmr_root[HASH_SIZE];
+    _assert(mmr_get_root(&ctx, mmr_root) == 0);
+    _assert(mmr_acc_get_root(&acc, root) == 0);
+    _assert(memcmp(root, mmr_root, HASH_SIZE) == 0);
+
+    /* push batches of growing sizes */
+    if (batch_acc.leaf_count == i + 1 - batch) {
+      _assert(mmr_acc_push_batch(&batch_acc, &leaves[i + 1 - batch], batch) ==
+              0);
+      _assert(batch_acc.leaf_count == i + 1);
+      _assert(mmr_acc_get_root(&batch_acc, root) == 0);
+      _assert(memcmp(root, mmr_root, HASH_SIZE) == 0);
+      batch = batch * 2 + 1;
+    }
+  }
+
+  /* export and import to another accumulator */
+  uint8_t state[MMR_ACC_STATE_MAX_SIZE];
+  size_t state_len = 8;
+  _assert(mmr_acc_export(&acc, state, &state_len) == -1);
+  state_len = MMR_ACC_STATE_MAX_SIZE;
+  _assert(mmr_acc_export(&acc, state, &state_len) == 0);
+  _assert(state_len == 8 + __builtin_popcountll(MMR_TREE_LEAVES) * HASH_SIZE);
+  MMRAccumulator imported;
+  _assert(mmr_initialize_accumulator(&imported, merge_hash) == 0);
+  _assert(mmr_acc_import(&imported, state, state_len - 1) == -1);
+  _assert(mmr_acc_import(&imported, state, state_len) == 0);
+  _assert(imported.leaf_count == MMR_TREE_LEAVES);
+  uint8_t imported_root[HASH_SIZE];
+  _assert(mmr_acc_get_root(&acc, root) == 0);
+  _assert(mmr_acc_get_root(&imported, imported_root) == 0);
+  _assert(memcmp(root, imported_root, HASH_SIZE) == 0);
+  return 0;
+}
+
+int test_batch_proof() {
+  MMRContext ctx;
+  int ret =
+      mmr_initialize_context(&ctx, shared_mmr_size, shared_mmr_tree,
+                             MMR_TREE_LEAVES * MMR_TREE_LEAVES, merge_hash);
+  _assert(ret == 0);
+  MMRVerifyContext verify_ctx;
+  ret = mmr_initialize_verify_context(&verify_ctx, merge_hash);
+  _assert(ret == 0);
+  mmr_set_verify_merge_many(&verify_ctx, merge_hash_many);
+  uint8_t root[HASH_SIZE];
+  ret = mmr_get_root(&ctx, root);
+  _assert(ret == 0);
+
+  static uint64_t positions[MMR_TREE_LEAVES];
+  static uint8_t leaves[MMR_TREE_LEAVES][HASH_SIZE];
+  static uint8_t proof[MMR_TREE_LEAVES * 8][HASH_SIZE];
+  /* leaves from first..first + n step by step */
+  uint64_t cases[][3] = {{0, 1, 1},   {5, 1, 1},   {999, 1, 1}, {0, 1000, 1},
+                         {10, 100, 1}, {3, 300, 3}, {100, 50, 17},
+                         {0, 2, 998}, {511, 2, 1}, {512, 488, 1}};
+  for (int c = 0; c < (int)(sizeof(cases) / sizeof(cases[0])); c++) {
+    size_t n = cases[c][1];
+    size_t single_proof_len = 0;
+    for (size_t i = 0; i < n; i++) {
+      uint64_t leaf_index = cases[c][0] + i * cases[c][2];
+      positions[i] = mmr_leaf_index_to_pos(leaf_index);
+      memset(leaves[i], 0, HASH_SIZE);
+      memcpy(leaves[i], &leaf_index, sizeof(uint64_t));
+      uint8_t single_proof[64][HASH_SIZE];
+      size_t len = 64;
+      _assert(mmr_gen_proof(&ctx, single_proof, &len, positions[i]) == 0);
+      single_proof_len += len;
+    }
+    size_t proof_len = MMR_TREE_LEAVES * 8;
+    ret = mmr_gen_batch_proof(&ctx, proof, &proof_len, positions, n);
+    _assert(ret == 0);
+    _assert(proof_len <= single_proof_len);
+    if (n > 1) {
+      _assert(proof_len < single_proof_len);
+    }
+    ret = mmr_verify_batch_proof(&verify_ctx, root, shared_mmr_size,
+                                 positions, leaves, n, proof, proof_len);
+    _assert(ret == 0);
+  }
+  /* all leaves need no proof but the peaks */
+  for (uint64_t i = 0; i < MMR_TREE_LEAVES; i++) {
+    positions[i] = mmr_leaf_index_to_pos(i);
+  }
+  size_t proof_len = MMR_TREE_LEAVES * 8;
+  ret = mmr_gen_batch_proof(&ctx, proof, &proof_len, positions,
+                            MMR_TREE_LEAVES);
+  _assert(ret == 0);
+  _assert(proof_len == 0);
+
+  /* invalid proofs */
+  uint64_t leaf_index = 300;
+  positions[0] = mmr_leaf_index_to_pos(leaf_index);
+  positions[1] = mmr_leaf_index_to_pos(leaf_index + 1);
+  proof_len = MMR_TREE_LEAVES * 8;
+  ret = mmr_gen_batch_proof(&ctx, proof, &proof_len, positions, 2);
+  _assert(ret == 0);
+  for (uint64_t i = 0; i < 2; i++) {
+    uint64_t index = leaf_index + i;
+    memset(leaves[i], 0, HASH_SIZE);
+    memcpy(leaves[i], &index, sizeof(uint64_t));
+  }
+  proof[0][0] ^= 1;
+  ret = mmr_verify_batch_proof(&verify_ctx, root, shared_mmr_size, positions,
+                               leaves, 2, proof, proof_len);
+  _assert(ret == -1);
+  ret = mmr_verify_batch_proof(&verify_ctx, root, shared_mmr_size, positions,
+                               leaves, 2, proof, proof_len - 1);
+  _assert(ret == -1);
+  /* unsorted and non leaf positions */
+  uint64_t bad_positions[] = {positions[1], positions[0]};
+  proof_len = MMR_TREE_LEAVES * 8;
+  _assert(mmr_gen_batch_proof(&ctx, proof, &proof_len, bad_positions, 2) ==
+          -1);
+  bad_positions[0] = 2;
+  _assert(mmr_gen_batch_proof(&ctx, proof, &proof_len, bad_positions, 1) ==
+          -1);
+  return 0;
+}
+
+#ifdef MMR_ENABLE_STATS
+typedef struct TestHooks {
+  size_t begins;
+  size_t ends;
+  int last_op;
+  int last_ret;
+} TestHooks;
+
+void test_hook_begin(void *data, int op) {
+  TestHooks *hooks = (TestHooks *)data;
+  hooks->begins++;
+  hooks->last_op = op;
+}
+
+void test_hook_end(void *data, int op, int ret) {
+  TestHooks *hooks = (TestHooks *)data;
+  hooks->ends++;
+  hooks->last_op = op;
+  hooks->last_ret = ret;
+}
+
+int test_stats() {
+  uint8_t tree_buf[32][HASH_SIZE];
+  MMRContext ctx;
+  int ret = mmr_initialize_context(&ctx, 0, tree_buf, 32, merge_hash);
+  _assert(ret == 0);
+  TestHooks test_hooks = {0};
+  MMRHooks hooks = {&test_hooks, test_hook_begin, test_hook_end};
+  mmr_set_hooks(&ctx, &hooks);
+  for (uint64_t i = 0; i < 7; i++) {
+    uint8_t leaf[HASH_SIZE] = {0};
+    memcpy(leaf, &i, sizeof(uint64_t));
+    _assert(mmr_push(&ctx, leaf) == 0);
+  }
+  /* 7 leaves merge 2 + 1 + 1 parents */
+  _assert(ctx.stats.merges == 4);
+  _assert(test_hooks.begins == 7 && test_hooks.ends == 7);
+  _assert(test_hooks.last_op == MMR_OP_PUSH && test_hooks.last_ret == 0);
+
+  /* peaks of 4 2 1 leaves are read and bagged */
+  memset(&ctx.stats, 0, sizeof(ctx.stats));
+  uint8_t root[HASH_SIZE];
+  _assert(mmr_get_root(&ctx, root) == 0);
+  _assert(ctx.stats.merges == 2);
+  _assert(ctx.stats.node_reads == 3);
+  _assert(ctx.stats.peaks_bagged == 3);
+  _assert(test_hooks.last_op == MMR_OP_GET_ROOT);
+
+  /* 2 siblings and the bag of rhs peaks */
+  memset(&ctx.stats, 0, sizeof(ctx.stats));
+  uint8_t proof[8][HASH_SIZE];
+  size_t proof_len = 8;
+  _assert(mmr_gen_proof(&ctx, proof, &proof_len, 0) == 0);
+  _assert(proof_len == 3);
+  _assert(ctx.stats.proof_items == 3);
+  _assert(test_hooks.last_op == MMR_OP_GEN_PROOF);
+  proof_len = 1;
+  _assert(mmr_gen_proof(&ctx, proof, &proof_len, 0) == -1);
+  _assert(ctx.stats.proof_items == 3);
+  _assert(test_hooks.last_ret == -1);
+
+  MMRVerifyContext vctx;
+  mmr_initialize_verify_context(&vctx, merge_hash);
+  mmr_set_verify_hooks(&vctx, &hooks);
+  proof_len = 8;
+  _assert(mmr_gen_proof(&ctx, proof, &proof_len, 0) == 0);
+  uint64_t pos = 0;
+  uint8_t leaves[1][HASH_SIZE] = {{0}};
+  _assert(mmr_compute_batch_proof_root(&vctx, root, ctx.mmr_size, &pos, leaves,
+                                       1, proof, proof_len) == 0);
+  _assert(test_hooks.last_op == MMR_OP_VERIFY_BATCH);
+  /* 2 merges on the path, 1 with the rhs bag */
+  _assert(vctx.stats.merges == 3);
+
+  /* single leaf proofs are traced once, streams from init to finish */
+  size_t begins = test_hooks.begins;
+  uint8_t leaf[HASH_SIZE] = {0};
+  _assert(mmr_verify_proof_by_leaf_index(&vctx, root, 7, leaf, 0, proof,
+                                         proof_len) == 0);
+  _assert(test_hooks.begins == begins + 1);
+  _assert(test_hooks.last_op == MMR_OP_VERIFY && test_hooks.last_ret == 0);
+  MMRProofStream stream;
+  mmr_proof_stream_init(&stream, &vctx, ctx.mmr_size, leaf, 0);
+  _assert(test_hooks.begins == begins + 2 && test_hooks.ends == begins + 1);
+  mmr_proof_stream_feed(&stream, proof, proof_len);
+  mmr_proof_stream_finish(&stream, root);
+  _assert(test_hooks.ends == begins + 2);
+  _assert(test_hooks.last_op == MMR_OP_VERIFY);
+  uint64_t mmr_size = ctx.mmr_size;
+  uint8_t last_leaf[HASH_SIZE] = {6};
+  proof_len = 8;
+  _assert(mmr_gen_proof(&ctx, proof, &proof_len, mmr_leaf_index_to_pos(6)) ==
+          0);
+  _assert(mmr_compute_new_root_and_proof(&vctx, root, &mmr_size, last_leaf,
+                                         proof, &proof_len, 8, leaf) == 0);
+  _assert(test_hooks.last_op == MMR_OP_NEW_ROOT && test_hooks.last_ret == 0);
+  return 0;
+}
+#endif
+
 /* end unit tests */
 
 int all_tests() {
@@ -322,6 +2297,37 @@ int all_tests() {
   _verify(test_mmr);
   _verify(test_gen_new_root);
   _verify(test_empty_proof);
+  _verify(test_push_batch);
+  _verify(test_push_batch_merge_many);
+  _verify(test_peaks_from_size);
+  _verify(test_pos_math);
+  _verify(test_leaf_index_api);
+  _verify(test_store);
+  _verify(test_peaks_cache);
+  _verify(test_build_parallel);
+  _verify(test_forest);
+  _verify(test_verify_many);
+  _verify(test_snapshot);
+  _verify(test_root_tracker);
+  _verify(test_compute_new_root_from_proof_many);
+  _verify(test_spec);
+  _verify(test_range_proof);
+  _verify(test_consistency_proof);
+  _verify(test_new_root_and_proof);
+  _verify(test_proof_stream);
+  _verify(test_truncate);
+  _verify(test_top_cache);
+  _verify(test_two_phase_proof);
+  _verify(test_encoded_proof);
+  _verify(test_file_store);
+  _verify(test_blocked_store);
+  _verify(test_sparse_store);
+  _verify(test_arena_store);
+  _verify(test_accumulator);
+  _verify(test_batch_proof);
+#ifdef MMR_ENABLE_STATS
+  _verify(test_stats);
+#endif
 
   return 0;
 }